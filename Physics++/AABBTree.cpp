@@ -0,0 +1,495 @@
+#include "AABBTree.h"
+#include <cmath>
+#include <cfloat>
+
+#define AABB_TREE_STACK_SIZE 64
+
+static AABB Combine(const AABB& a, const AABB& b)
+{
+	Vec3 minA = GetMin(a);
+	Vec3 maxA = GetMax(a);
+	Vec3 minB = GetMin(b);
+	Vec3 maxB = GetMax(b);
+
+	return FromMinMax(
+		Vec3(fminf(minA.x, minB.x), fminf(minA.y, minB.y), fminf(minA.z, minB.z)),
+		Vec3(fmaxf(maxA.x, maxB.x), fmaxf(maxA.y, maxB.y), fmaxf(maxA.z, maxB.z)));
+}
+
+static bool ContainsAABB(const AABB& outer, const AABB& inner)
+{
+	Vec3 outerMin = GetMin(outer);
+	Vec3 outerMax = GetMax(outer);
+	Vec3 innerMin = GetMin(inner);
+	Vec3 innerMax = GetMax(inner);
+
+	return innerMin.x >= outerMin.x && innerMin.y >= outerMin.y && innerMin.z >= outerMin.z &&
+		innerMax.x <= outerMax.x && innerMax.y <= outerMax.y && innerMax.z <= outerMax.z;
+}
+
+static AABB Fatten(const AABB& aabb, float margin)
+{
+	return AABB(aabb.position, aabb.size + Vec3(margin, margin, margin));
+}
+
+int AABBTree::AllocateNode()
+{
+	int node = freeList;
+
+	if (node == AABB_TREE_NULL)
+	{
+		node = nodes.size();
+		nodes.push_back(AABBTreeNode());
+	}
+	else
+	{
+		freeList = nodes[node].parent;
+	}
+
+	nodes[node].parent = AABB_TREE_NULL;
+	nodes[node].left = AABB_TREE_NULL;
+	nodes[node].right = AABB_TREE_NULL;
+	nodes[node].height = 0;
+	nodes[node].model = 0;
+	return node;
+}
+
+void AABBTree::FreeNode(int node)
+{
+	nodes[node].parent = freeList;
+	nodes[node].height = -1;
+	nodes[node].model = 0;
+	freeList = node;
+}
+
+void AABBTree::Refit(int node)
+{
+	AABBTreeNode& n = nodes[node];
+	const AABBTreeNode& left = nodes[n.left];
+	const AABBTreeNode& right = nodes[n.right];
+
+	n.bounds = Combine(left.bounds, right.bounds);
+	n.height = 1 + (left.height > right.height ? left.height : right.height);
+}
+
+// Picks the sibling that grows the total surface area the least, using
+// the cost of the enlarged ancestors as a lower bound to stop early
+void AABBTree::InsertLeaf(int leaf)
+{
+	if (root == AABB_TREE_NULL)
+	{
+		root = leaf;
+		nodes[root].parent = AABB_TREE_NULL;
+		return;
+	}
+
+	AABB leafBounds = nodes[leaf].bounds;
+	int index = root;
+
+	while (nodes[index].height > 0)
+	{
+		int left = nodes[index].left;
+		int right = nodes[index].right;
+
+		float area = SurfaceArea(nodes[index].bounds);
+		float combinedArea = SurfaceArea(Combine(nodes[index].bounds, leafBounds));
+
+		// Cost of making a new parent for this node and the leaf
+		float cost = 2.0f * combinedArea;
+		// Cost of pushing the leaf further down
+		float inheritance = 2.0f * (combinedArea - area);
+
+		float costLeft = SurfaceArea(Combine(leafBounds, nodes[left].bounds)) + inheritance;
+		if (nodes[left].height > 0)
+		{
+			costLeft -= SurfaceArea(nodes[left].bounds);
+		}
+
+		float costRight = SurfaceArea(Combine(leafBounds, nodes[right].bounds)) + inheritance;
+		if (nodes[right].height > 0)
+		{
+			costRight -= SurfaceArea(nodes[right].bounds);
+		}
+
+		if (cost < costLeft && cost < costRight)
+		{
+			break;
+		}
+
+		index = costLeft < costRight ? left : right;
+	}
+
+	int sibling = index;
+	int oldParent = nodes[sibling].parent;
+	int newParent = AllocateNode();
+
+	nodes[newParent].parent = oldParent;
+	nodes[newParent].left = sibling;
+	nodes[newParent].right = leaf;
+	nodes[newParent].bounds = Combine(leafBounds, nodes[sibling].bounds);
+	nodes[newParent].height = nodes[sibling].height + 1;
+	nodes[sibling].parent = newParent;
+	nodes[leaf].parent = newParent;
+
+	if (oldParent == AABB_TREE_NULL)
+	{
+		root = newParent;
+	}
+	else if (nodes[oldParent].left == sibling)
+	{
+		nodes[oldParent].left = newParent;
+	}
+	else
+	{
+		nodes[oldParent].right = newParent;
+	}
+
+	for (index = nodes[leaf].parent; index != AABB_TREE_NULL; index = nodes[index].parent)
+	{
+		index = Balance(index);
+		Refit(index);
+	}
+}
+
+void AABBTree::RemoveLeaf(int leaf)
+{
+	if (leaf == root)
+	{
+		root = AABB_TREE_NULL;
+		return;
+	}
+
+	int parent = nodes[leaf].parent;
+	int grandParent = nodes[parent].parent;
+	int sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+
+	FreeNode(parent);
+	nodes[leaf].parent = AABB_TREE_NULL;
+
+	if (grandParent == AABB_TREE_NULL)
+	{
+		root = sibling;
+		nodes[sibling].parent = AABB_TREE_NULL;
+		return;
+	}
+
+	if (nodes[grandParent].left == parent)
+	{
+		nodes[grandParent].left = sibling;
+	}
+	else
+	{
+		nodes[grandParent].right = sibling;
+	}
+	nodes[sibling].parent = grandParent;
+
+	for (int index = grandParent; index != AABB_TREE_NULL; index = nodes[index].parent)
+	{
+		index = Balance(index);
+		Refit(index);
+	}
+}
+
+// If one child of a is more than one level taller than the other, rotates
+// that child up to take a's place. Returns the root of the subtree.
+int AABBTree::Balance(int a)
+{
+	if (nodes[a].height < 2)
+	{
+		return a;
+	}
+
+	int b = nodes[a].left;
+	int c = nodes[a].right;
+	int balance = nodes[c].height - nodes[b].height;
+
+	if (balance >= -1 && balance <= 1)
+	{
+		return a;
+	}
+
+	// The taller child moves up, its taller child stays below it and its
+	// shorter child moves down to a
+	int up = balance > 1 ? c : b;
+	int other = balance > 1 ? b : c;
+	int f = nodes[up].left;
+	int g = nodes[up].right;
+
+	nodes[up].left = a;
+	nodes[up].parent = nodes[a].parent;
+	nodes[a].parent = up;
+
+	if (nodes[up].parent == AABB_TREE_NULL)
+	{
+		root = up;
+	}
+	else if (nodes[nodes[up].parent].left == a)
+	{
+		nodes[nodes[up].parent].left = up;
+	}
+	else
+	{
+		nodes[nodes[up].parent].right = up;
+	}
+
+	int taller = nodes[f].height > nodes[g].height ? f : g;
+	int shorter = taller == f ? g : f;
+
+	nodes[up].right = taller;
+	nodes[a].left = other;
+	nodes[a].right = shorter;
+	nodes[shorter].parent = a;
+
+	Refit(a);
+	Refit(up);
+	return up;
+}
+
+int AABBTree::Insert(Model* model)
+{
+	int leaf = AllocateNode();
+	nodes[leaf].bounds = Fatten(GetAABB(*model), margin);
+	nodes[leaf].model = model;
+
+	InsertLeaf(leaf);
+	++numLeaves;
+	return leaf;
+}
+
+void AABBTree::Remove(int proxy)
+{
+	RemoveLeaf(proxy);
+	FreeNode(proxy);
+	--numLeaves;
+}
+
+bool AABBTree::Move(int proxy)
+{
+	AABB bounds = GetAABB(*nodes[proxy].model);
+
+	// Models that shrank a lot are refitted too, so their fat bounds do
+	// not keep growing the tree
+	if (ContainsAABB(nodes[proxy].bounds, bounds) &&
+		ContainsAABB(Fatten(bounds, margin * 4.0f), nodes[proxy].bounds))
+	{
+		return false;
+	}
+
+	RemoveLeaf(proxy);
+	nodes[proxy].bounds = Fatten(bounds, margin);
+	InsertLeaf(proxy);
+	return true;
+}
+
+void AABBTree::Clear()
+{
+	nodes.clear();
+	root = AABB_TREE_NULL;
+	freeList = AABB_TREE_NULL;
+	numLeaves = 0;
+}
+
+int AABBTree::GetHeight() const
+{
+	return root == AABB_TREE_NULL ? 0 : nodes[root].height;
+}
+
+// Visits the model of every leaf whose fattened bounds pass test, returns
+// false as soon as visit does
+template <typename NodeTest, typename Visit>
+static bool TraverseAABBTree(const std::vector<AABBTreeNode>& nodes, int root,
+	const NodeTest& test, Visit& visit)
+{
+	if (root == AABB_TREE_NULL)
+	{
+		return true;
+	}
+
+	int stack[AABB_TREE_STACK_SIZE];
+	int top = 0;
+	stack[top++] = root;
+
+	while (top > 0)
+	{
+		const AABBTreeNode& node = nodes[stack[--top]];
+
+		if (!test(node.bounds))
+		{
+			continue;
+		}
+
+		if (node.height == 0)
+		{
+			if (!visit(node.model))
+			{
+				return false;
+			}
+			continue;
+		}
+
+		// Balancing keeps the tree shallow, subtrees that do not fit on
+		// the stack are walked recursively
+		if (top + 2 > AABB_TREE_STACK_SIZE)
+		{
+			if (!TraverseAABBTree(nodes, node.left, test, visit) ||
+				!TraverseAABBTree(nodes, node.right, test, visit))
+			{
+				return false;
+			}
+			continue;
+		}
+
+		stack[top++] = node.left;
+		stack[top++] = node.right;
+	}
+
+	return true;
+}
+
+struct AABBTreeClosestHit
+{
+	const Ray& ray;
+	Model* closest;
+	float closestT;
+	int closestTriangle;
+	AABBTreeClosestHit(const Ray& r) : ray(r), closest(0), closestT(FLT_MAX), closestTriangle(-1) { }
+	bool operator()(const AABB& bounds) const
+	{
+		// Boxes entered past the closest hit so far cannot hold a closer one
+		float entry = RaycastEntry(bounds, ray);
+		return entry >= 0 && entry <= closestT;
+	}
+	bool operator()(Model* model)
+	{
+		int triangle;
+		float t = ModelRay(*model, ray, 0, &triangle);
+		if (t >= 0 && t < closestT)
+		{
+			closest = model;
+			closestT = t;
+			closestTriangle = triangle;
+		}
+		return true;
+	}
+};
+
+struct AABBTreeRayVisit
+{
+	const Ray& ray;
+	ModelRayVisitor visit;
+	void* userData;
+	AABBTreeRayVisit(const Ray& r, ModelRayVisitor v, void* u) : ray(r), visit(v), userData(u) { }
+	bool operator()(const AABB& bounds) const
+	{
+		return RaycastEntry(bounds, ray) >= 0;
+	}
+	bool operator()(Model* model)
+	{
+		float t = ModelRay(*model, ray);
+		return t < 0 || visit(model, t, userData);
+	}
+};
+
+Model* AABBTree::Raycast(const Ray& ray) const
+{
+	float t;
+	int triangle;
+	return Raycast(ray, &t, &triangle);
+}
+
+Model* AABBTree::Raycast(const Ray& ray, float* outT, int* outTriangle) const
+{
+	AABBTreeClosestHit raycast(ray);
+	TraverseAABBTree(nodes, root, raycast, raycast);
+
+	*outT = raycast.closest != 0 ? raycast.closestT : -1;
+	*outTriangle = raycast.closestTriangle;
+
+	return raycast.closest;
+}
+
+bool AABBTree::Raycast(const Ray& ray, ModelRayVisitor visit, void* userData) const
+{
+	AABBTreeRayVisit raycast(ray, visit, userData);
+	return TraverseAABBTree(nodes, root, raycast, raycast);
+}
+
+std::vector<Model*> AABBTree::Query(const Sphere& sphere) const
+{
+	std::vector<Model*> result;
+	SceneSphereTest test(sphere);
+	SceneCollect<SceneSphereTest> collect(test, result);
+	TraverseAABBTree(nodes, root, test, collect);
+	return result;
+}
+
+bool AABBTree::Query(const Sphere& sphere, ModelVisitor visit, void* userData) const
+{
+	SceneSphereTest test(sphere);
+	SceneVisit<SceneSphereTest> visitor(test, visit, userData);
+	return TraverseAABBTree(nodes, root, test, visitor);
+}
+
+std::vector<Model*> AABBTree::Query(const AABB& aabb) const
+{
+	std::vector<Model*> result;
+	SceneAABBTest test(aabb);
+	SceneCollect<SceneAABBTest> collect(test, result);
+	TraverseAABBTree(nodes, root, test, collect);
+	return result;
+}
+
+bool AABBTree::Query(const AABB& aabb, ModelVisitor visit, void* userData) const
+{
+	SceneAABBTest test(aabb);
+	SceneVisit<SceneAABBTest> visitor(test, visit, userData);
+	return TraverseAABBTree(nodes, root, test, visitor);
+}
+
+std::vector<Model*> AABBTree::Cull(const Frustum& frustum) const
+{
+	std::vector<Model*> result;
+	SceneFrustumTest test(frustum);
+	SceneCollect<SceneFrustumTest> collect(test, result);
+	TraverseAABBTree(nodes, root, test, collect);
+	return result;
+}
+
+bool AABBTree::Cull(const Frustum& frustum, ModelVisitor visit, void* userData) const
+{
+	SceneFrustumTest test(frustum);
+	SceneVisit<SceneFrustumTest> visitor(test, visit, userData);
+	return TraverseAABBTree(nodes, root, test, visitor);
+}
+
+struct AABBTreeNearestExpand
+{
+	const std::vector<AABBTreeNode>& nodes;
+	AABBTreeNearestExpand(const std::vector<AABBTreeNode>& n) : nodes(n) { }
+	void operator()(int index, NearestSearch<int>& search) const
+	{
+		const AABBTreeNode& node = nodes[index];
+
+		if (node.height == 0)
+		{
+			search.PushModel(node.model);
+			return;
+		}
+
+		search.PushNode(node.left, nodes[node.left].bounds);
+		search.PushNode(node.right, nodes[node.right].bounds);
+	}
+};
+
+int AABBTree::Nearest(const Point& point, int k, float maxDistance, bool exact,
+	Model** outModels, float* outDistances) const
+{
+	if (root == AABB_TREE_NULL)
+	{
+		return 0;
+	}
+
+	NearestSearch<int> search(point, maxDistance, exact);
+	AABBTreeNearestExpand expand(nodes);
+	return search.Run(root, k, expand, outModels, outDistances);
+}
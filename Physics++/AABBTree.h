@@ -0,0 +1,70 @@
+#pragma once
+
+#include "Geometry3D.h"
+#include <vector>
+
+#define AABB_TREE_NULL -1
+
+struct AABBTreeNode
+{
+	// Leaves store the fattened bounds of their model
+	AABB bounds;
+	// Next free node while the node is unused
+	int parent;
+	int left;
+	int right;
+	// Leaves are 0, unused nodes -1
+	int height;
+	Model* model;
+};
+
+// Binary tree of model bounds that is updated incrementally. Leaf bounds
+// are grown by a margin so small movements do not touch the tree, and
+// rotations keep it balanced as models are inserted and removed.
+class AABBTree
+{
+protected:
+	std::vector<AABBTreeNode> nodes;
+	int root;
+	int freeList;
+	int numLeaves;
+	float margin;
+
+	int AllocateNode();
+	void FreeNode(int node);
+	void InsertLeaf(int leaf);
+	void RemoveLeaf(int leaf);
+	int Balance(int node);
+	void Refit(int node);
+
+public:
+	inline AABBTree() : root(AABB_TREE_NULL), freeList(AABB_TREE_NULL), numLeaves(0), margin(0.1f) { }
+	inline AABBTree(float margin) : root(AABB_TREE_NULL), freeList(AABB_TREE_NULL), numLeaves(0), margin(margin) { }
+
+	// Returns the proxy of the model, valid until it is removed
+	int Insert(Model* model);
+	void Remove(int proxy);
+	// Returns true if the tree changed, false if the model still fits
+	// inside its fattened bounds
+	bool Move(int proxy);
+	void Clear();
+
+	inline int NumLeaves() const { return numLeaves; }
+	int GetHeight() const;
+
+	Model* Raycast(const Ray& ray) const;
+	// Also reports the distance and mesh triangle of the hit, -1 on a miss
+	Model* Raycast(const Ray& ray, float* outT, int* outTriangle) const;
+	std::vector<Model*> Query(const Sphere& sphere) const;
+	std::vector<Model*> Query(const AABB& aabb) const;
+	std::vector<Model*> Cull(const Frustum& frustum) const;
+
+	// Return false if visit stopped the traversal early
+	bool Raycast(const Ray& ray, ModelRayVisitor visit, void* userData) const;
+	bool Query(const Sphere& sphere, ModelVisitor visit, void* userData) const;
+	bool Query(const AABB& aabb, ModelVisitor visit, void* userData) const;
+	bool Cull(const Frustum& frustum, ModelVisitor visit, void* userData) const;
+	// See Scene::Nearest
+	int Nearest(const Point& point, int k, float maxDistance, bool exact,
+		Model** outModels, float* outDistances) const;
+};
@@ -0,0 +1,629 @@
+#include "Broadphase.h"
+#include <algorithm>
+
+// More new proxies than this are sorted and swept in one go instead of
+// being insertion sorted in from the end of the axes
+#define SWEEP_BATCH_INSERT 64
+
+static unsigned int HashCell(int x, int y, int z)
+{
+	return ((unsigned int)x * 73856093u) ^ ((unsigned int)y * 19349663u) ^ ((unsigned int)z * 83492791u);
+}
+
+static unsigned long long PairKey(int proxy1, int proxy2)
+{
+	if (proxy1 > proxy2)
+	{
+		int swap = proxy1;
+		proxy1 = proxy2;
+		proxy2 = swap;
+	}
+
+	return ((unsigned long long)(unsigned int)proxy1 << 32) | (unsigned int)proxy2;
+}
+
+static BroadphasePair PairFromKey(unsigned long long key)
+{
+	BroadphasePair pair;
+	pair.proxy1 = (int)(key >> 32);
+	pair.proxy2 = (int)(key & 0xFFFFFFFF);
+	return pair;
+}
+
+bool Broadphase::HasPair(int proxy1, int proxy2) const
+{
+	return pairIndex.find(PairKey(proxy1, proxy2)) != pairIndex.end();
+}
+
+void Broadphase::AddPair(int proxy1, int proxy2)
+{
+	unsigned long long key = PairKey(proxy1, proxy2);
+	if (pairIndex.find(key) != pairIndex.end())
+	{
+		return;
+	}
+
+	// Remembers the state at the last Update the first time a pair changes
+	changedPairs.insert(std::make_pair(key, false));
+	pairIndex[key] = pairs.size();
+	pairs.push_back(PairFromKey(key));
+}
+
+void Broadphase::RemovePair(int proxy1, int proxy2)
+{
+	unsigned long long key = PairKey(proxy1, proxy2);
+	std::unordered_map<unsigned long long, int>::iterator it = pairIndex.find(key);
+	if (it == pairIndex.end())
+	{
+		return;
+	}
+
+	changedPairs.insert(std::make_pair(key, true));
+
+	int index = it->second;
+	pairIndex.erase(it);
+
+	if (index != (int)pairs.size() - 1)
+	{
+		pairs[index] = pairs.back();
+		pairIndex[PairKey(pairs[index].proxy1, pairs[index].proxy2)] = index;
+	}
+	pairs.pop_back();
+}
+
+void Broadphase::RemoveProxyPairs(const std::vector<int>& proxies)
+{
+	if (proxies.empty())
+	{
+		return;
+	}
+
+	int maxProxy = *std::max_element(proxies.begin(), proxies.end());
+	std::vector<bool> removed(maxProxy + 1, false);
+	for (int i = 0, size = proxies.size(); i < size; ++i)
+	{
+		removed[proxies[i]] = true;
+	}
+
+	for (int i = pairs.size() - 1; i >= 0; --i)
+	{
+		BroadphasePair pair = pairs[i];
+		if ((pair.proxy1 <= maxProxy && removed[pair.proxy1]) ||
+			(pair.proxy2 <= maxProxy && removed[pair.proxy2]))
+		{
+			RemovePair(pair.proxy1, pair.proxy2);
+		}
+	}
+}
+
+void Broadphase::FlushPairEvents()
+{
+	addedPairs.clear();
+	removedPairs.clear();
+
+	for (std::unordered_map<unsigned long long, bool>::iterator it = changedPairs.begin();
+		it != changedPairs.end(); ++it)
+	{
+		bool exists = pairIndex.find(it->first) != pairIndex.end();
+
+		if (exists && !it->second)
+		{
+			addedPairs.push_back(PairFromKey(it->first));
+		}
+		else if (!exists && it->second)
+		{
+			removedPairs.push_back(PairFromKey(it->first));
+		}
+	}
+
+	changedPairs.clear();
+}
+
+int SweepAndPrune::CreateProxy(const AABB& bounds, void* userData)
+{
+	int proxy;
+
+	if (freeProxies.empty())
+	{
+		proxy = proxies.size();
+		proxies.push_back(SweepProxy());
+	}
+	else
+	{
+		proxy = freeProxies.back();
+		freeProxies.pop_back();
+	}
+
+	proxies[proxy].min = GetMin(bounds);
+	proxies[proxy].max = GetMax(bounds);
+	proxies[proxy].userData = userData;
+	proxies[proxy].alive = true;
+	proxies[proxy].inserted = true;
+
+	// New endpoints start at the end of each axis, the next Update sorts
+	// them into place and finds their pairs on the way
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		SweepEndpoint min = { proxies[proxy].min.asArray[axis], proxy * 2 };
+		SweepEndpoint max = { proxies[proxy].max.asArray[axis], proxy * 2 + 1 };
+		endpoints[axis].push_back(min);
+		endpoints[axis].push_back(max);
+	}
+
+	return proxy;
+}
+
+void SweepAndPrune::DestroyProxy(int proxy)
+{
+	proxies[proxy].alive = false;
+	proxies[proxy].userData = 0;
+	deadProxies.push_back(proxy);
+}
+
+void SweepAndPrune::MoveProxy(int proxy, const AABB& bounds)
+{
+	proxies[proxy].min = GetMin(bounds);
+	proxies[proxy].max = GetMax(bounds);
+}
+
+void* SweepAndPrune::GetUserData(int proxy) const
+{
+	return proxies[proxy].userData;
+}
+
+bool SweepAndPrune::Overlaps(int proxy1, int proxy2) const
+{
+	const SweepProxy& a = proxies[proxy1];
+	const SweepProxy& b = proxies[proxy2];
+
+	return a.min.x <= b.max.x && b.min.x <= a.max.x &&
+		a.min.y <= b.max.y && b.min.y <= a.max.y &&
+		a.min.z <= b.max.z && b.min.z <= a.max.z;
+}
+
+// Min endpoints sort before max endpoints of the same value, so touching
+// bounds count as overlapping like AABBAABB
+static bool Before(const SweepEndpoint& a, const SweepEndpoint& b)
+{
+	return a.value < b.value || (a.value == b.value && (a.data & 1) < (b.data & 1));
+}
+
+// Insertion sorts the first count endpoints of axis. Every swap is a
+// change in the order of two proxies on this axis, the only place where
+// their pair can start or stop.
+void SweepAndPrune::SortAxis(int axis, int count)
+{
+	std::vector<SweepEndpoint>& axisEndpoints = endpoints[axis];
+
+	for (int i = 0, size = axisEndpoints.size(); i < size; ++i)
+	{
+		SweepEndpoint& endpoint = axisEndpoints[i];
+		const SweepProxy& proxy = proxies[endpoint.data >> 1];
+		endpoint.value = (endpoint.data & 1) ? proxy.max.asArray[axis] : proxy.min.asArray[axis];
+	}
+
+	for (int i = 1; i < count; ++i)
+	{
+		SweepEndpoint moving = axisEndpoints[i];
+		int proxy = moving.data >> 1;
+		bool isMax = (moving.data & 1) != 0;
+		int j = i;
+
+		for (; j > 0 && Before(moving, axisEndpoints[j - 1]); --j)
+		{
+			const SweepEndpoint& passed = axisEndpoints[j - 1];
+			int other = passed.data >> 1;
+			bool passedMax = (passed.data & 1) != 0;
+
+			// A min moving below a max may start an overlap, a max moving
+			// below a min ends one
+			if (!isMax && passedMax)
+			{
+				if (other != proxy && Overlaps(proxy, other))
+				{
+					AddPair(proxy, other);
+				}
+			}
+			else if (isMax && !passedMax && other != proxy)
+			{
+				RemovePair(proxy, other);
+			}
+
+			axisEndpoints[j] = passed;
+		}
+
+		axisEndpoints[j] = moving;
+	}
+}
+
+// Sorts the new endpoints on their own and merges them in, then sweeps
+// the x axis once for the pairs that involve a new proxy
+void SweepAndPrune::InsertBatch(int firstNew)
+{
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		std::vector<SweepEndpoint>& axisEndpoints = endpoints[axis];
+		std::sort(axisEndpoints.begin() + firstNew, axisEndpoints.end(), Before);
+		std::inplace_merge(axisEndpoints.begin(), axisEndpoints.begin() + firstNew,
+			axisEndpoints.end(), Before);
+	}
+
+	// Proxies whose x interval holds the sweep position, with the position
+	// of each in its list so it can be removed in constant time
+	std::vector<int> activeOld;
+	std::vector<int> activeNew;
+	std::vector<int> activeSlot(proxies.size());
+
+	const std::vector<SweepEndpoint>& axisEndpoints = endpoints[0];
+	for (int i = 0, size = axisEndpoints.size(); i < size; ++i)
+	{
+		int proxy = axisEndpoints[i].data >> 1;
+		std::vector<int>& active = proxies[proxy].inserted ? activeNew : activeOld;
+
+		if (axisEndpoints[i].data & 1)
+		{
+			int slot = activeSlot[proxy];
+			active[slot] = active.back();
+			activeSlot[active[slot]] = slot;
+			active.pop_back();
+			continue;
+		}
+
+		for (int j = 0, count = activeNew.size(); j < count; ++j)
+		{
+			if (Overlaps(proxy, activeNew[j]))
+			{
+				AddPair(proxy, activeNew[j]);
+			}
+		}
+
+		if (proxies[proxy].inserted)
+		{
+			for (int j = 0, count = activeOld.size(); j < count; ++j)
+			{
+				if (Overlaps(proxy, activeOld[j]))
+				{
+					AddPair(proxy, activeOld[j]);
+				}
+			}
+		}
+
+		activeSlot[proxy] = active.size();
+		active.push_back(proxy);
+	}
+}
+
+void SweepAndPrune::Update()
+{
+	int firstNew = numSorted;
+
+	if (!deadProxies.empty())
+	{
+		RemoveProxyPairs(deadProxies);
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			std::vector<SweepEndpoint>& axisEndpoints = endpoints[axis];
+			int count = 0;
+
+			for (int i = 0, size = axisEndpoints.size(); i < size; ++i)
+			{
+				if (i == numSorted)
+				{
+					firstNew = count;
+				}
+
+				if (proxies[axisEndpoints[i].data >> 1].alive)
+				{
+					axisEndpoints[count++] = axisEndpoints[i];
+				}
+			}
+
+			if (numSorted == (int)axisEndpoints.size())
+			{
+				firstNew = count;
+			}
+
+			axisEndpoints.resize(count);
+		}
+
+		// Ids are only reused once their endpoints are gone
+		freeProxies.insert(freeProxies.end(), deadProxies.begin(), deadProxies.end());
+		deadProxies.clear();
+	}
+
+	int numEndpoints = endpoints[0].size();
+	bool batch = (numEndpoints - firstNew) / 2 > SWEEP_BATCH_INSERT;
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		SortAxis(axis, batch ? firstNew : numEndpoints);
+	}
+
+	if (batch)
+	{
+		InsertBatch(firstNew);
+	}
+
+	for (int i = firstNew; i < numEndpoints; ++i)
+	{
+		proxies[endpoints[0][i].data >> 1].inserted = false;
+	}
+
+	numSorted = numEndpoints;
+	FlushPairEvents();
+}
+
+int HashGrid::CreateProxy(const AABB& bounds, void* userData)
+{
+	int proxy;
+
+	if (freeProxies.empty())
+	{
+		proxy = proxies.size();
+		proxies.push_back(HashGridProxy());
+	}
+	else
+	{
+		proxy = freeProxies.back();
+		freeProxies.pop_back();
+	}
+
+	proxies[proxy].min = GetMin(bounds);
+	proxies[proxy].max = GetMax(bounds);
+	proxies[proxy].userData = userData;
+	proxies[proxy].alive = true;
+
+	return proxy;
+}
+
+void HashGrid::DestroyProxy(int proxy)
+{
+	proxies[proxy].alive = false;
+	proxies[proxy].userData = 0;
+	deadProxies.push_back(proxy);
+}
+
+void HashGrid::MoveProxy(int proxy, const AABB& bounds)
+{
+	proxies[proxy].min = GetMin(bounds);
+	proxies[proxy].max = GetMax(bounds);
+}
+
+void* HashGrid::GetUserData(int proxy) const
+{
+	return proxies[proxy].userData;
+}
+
+bool HashGrid::Overlaps(int proxy1, int proxy2) const
+{
+	const HashGridProxy& a = proxies[proxy1];
+	const HashGridProxy& b = proxies[proxy2];
+
+	return a.min.x <= b.max.x && b.min.x <= a.max.x &&
+		a.min.y <= b.max.y && b.min.y <= a.max.y &&
+		a.min.z <= b.max.z && b.min.z <= a.max.z;
+}
+
+int HashGrid::CellCoord(float value) const
+{
+	return (int)floorf(value * invCellSize);
+}
+
+int HashGrid::FindCell(int x, int y, int z) const
+{
+	if (cells.empty())
+	{
+		return -1;
+	}
+
+	unsigned int mask = cells.size() - 1;
+	for (unsigned int slot = HashCell(x, y, z) & mask; cells[slot].count != 0; slot = (slot + 1) & mask)
+	{
+		if (cells[slot].x == x && cells[slot].y == y && cells[slot].z == z)
+		{
+			return slot;
+		}
+	}
+
+	return -1;
+}
+
+// The table always has more slots than cells, so probing ends
+int HashGrid::InsertCell(int x, int y, int z)
+{
+	unsigned int mask = cells.size() - 1;
+	unsigned int slot = HashCell(x, y, z) & mask;
+
+	for (; cells[slot].count != 0; slot = (slot + 1) & mask)
+	{
+		if (cells[slot].x == x && cells[slot].y == y && cells[slot].z == z)
+		{
+			return slot;
+		}
+	}
+
+	cells[slot].x = x;
+	cells[slot].y = y;
+	cells[slot].z = z;
+	return slot;
+}
+
+void HashGrid::Update()
+{
+	RemoveProxyPairs(deadProxies);
+	freeProxies.insert(freeProxies.end(), deadProxies.begin(), deadProxies.end());
+	deadProxies.clear();
+
+	int numEntries = 0;
+	for (int i = 0, size = proxies.size(); i < size; ++i)
+	{
+		if (proxies[i].alive)
+		{
+			const HashGridProxy& proxy = proxies[i];
+			numEntries += (CellCoord(proxy.max.x) - CellCoord(proxy.min.x) + 1) *
+				(CellCoord(proxy.max.y) - CellCoord(proxy.min.y) + 1) *
+				(CellCoord(proxy.max.z) - CellCoord(proxy.min.z) + 1);
+		}
+	}
+
+	// At least twice as many slots as cells keeps the probes short
+	unsigned int numSlots = 16;
+	while (numSlots < (unsigned int)numEntries * 2)
+	{
+		numSlots <<= 1;
+	}
+
+	HashGridCell empty = { 0, 0, 0, 0, 0 };
+	cells.assign(numSlots, empty);
+
+	// Counting sort, first count the proxies of every cell, remembering the
+	// slot of each entry, then place them
+	std::vector<int> entrySlots(numEntries);
+	for (int i = 0, entry = 0, size = proxies.size(); i < size; ++i)
+	{
+		if (!proxies[i].alive)
+		{
+			continue;
+		}
+
+		const HashGridProxy& proxy = proxies[i];
+		int minX = CellCoord(proxy.min.x), maxX = CellCoord(proxy.max.x);
+		int minY = CellCoord(proxy.min.y), maxY = CellCoord(proxy.max.y);
+		int minZ = CellCoord(proxy.min.z), maxZ = CellCoord(proxy.max.z);
+
+		for (int x = minX; x <= maxX; ++x)
+		{
+			for (int y = minY; y <= maxY; ++y)
+			{
+				for (int z = minZ; z <= maxZ; ++z)
+				{
+					int slot = InsertCell(x, y, z);
+					cells[slot].count += 1;
+					entrySlots[entry++] = slot;
+				}
+			}
+		}
+	}
+
+	for (int i = 0, first = 0; i < (int)numSlots; ++i)
+	{
+		cells[i].first = first;
+		first += cells[i].count;
+	}
+
+	std::vector<int> fill(numSlots, 0);
+	cellProxies.resize(numEntries);
+	for (int i = 0, entry = 0, size = proxies.size(); i < size; ++i)
+	{
+		if (!proxies[i].alive)
+		{
+			continue;
+		}
+
+		const HashGridProxy& proxy = proxies[i];
+		int numCells = (CellCoord(proxy.max.x) - CellCoord(proxy.min.x) + 1) *
+			(CellCoord(proxy.max.y) - CellCoord(proxy.min.y) + 1) *
+			(CellCoord(proxy.max.z) - CellCoord(proxy.min.z) + 1);
+
+		for (int last = entry + numCells; entry < last; ++entry)
+		{
+			int slot = entrySlots[entry];
+			cellProxies[cells[slot].first + fill[slot]++] = i;
+		}
+	}
+
+	// Pairs that stopped overlapping, the ones still overlapping are found
+	// again below
+	for (int i = pairs.size() - 1; i >= 0; --i)
+	{
+		if (!Overlaps(pairs[i].proxy1, pairs[i].proxy2))
+		{
+			RemovePair(pairs[i].proxy1, pairs[i].proxy2);
+		}
+	}
+
+	// Two proxies can share many cells, the pair only counts in the cell
+	// holding the min corner of their overlap
+	for (int i = 0; i < (int)numSlots; ++i)
+	{
+		const HashGridCell& cell = cells[i];
+
+		for (int a = cell.first, last = cell.first + cell.count; a < last; ++a)
+		{
+			int proxy1 = cellProxies[a];
+
+			for (int b = a + 1; b < last; ++b)
+			{
+				int proxy2 = cellProxies[b];
+				if (!Overlaps(proxy1, proxy2))
+				{
+					continue;
+				}
+
+				const HashGridProxy& p1 = proxies[proxy1];
+				const HashGridProxy& p2 = proxies[proxy2];
+				if (CellCoord(fmaxf(p1.min.x, p2.min.x)) == cell.x &&
+					CellCoord(fmaxf(p1.min.y, p2.min.y)) == cell.y &&
+					CellCoord(fmaxf(p1.min.z, p2.min.z)) == cell.z)
+				{
+					AddPair(proxy1, proxy2);
+				}
+			}
+		}
+	}
+
+	FlushPairEvents();
+}
+
+int HashGrid::Query(const Sphere& sphere, std::vector<int>& outProxies) const
+{
+	outProxies.clear();
+
+	float radius = sphere.radius;
+	int minX = CellCoord(sphere.position.x - radius), maxX = CellCoord(sphere.position.x + radius);
+	int minY = CellCoord(sphere.position.y - radius), maxY = CellCoord(sphere.position.y + radius);
+	int minZ = CellCoord(sphere.position.z - radius), maxZ = CellCoord(sphere.position.z + radius);
+
+	for (int x = minX; x <= maxX; ++x)
+	{
+		for (int y = minY; y <= maxY; ++y)
+		{
+			for (int z = minZ; z <= maxZ; ++z)
+			{
+				int slot = FindCell(x, y, z);
+				if (slot < 0)
+				{
+					continue;
+				}
+
+				const HashGridCell& cell = cells[slot];
+				for (int i = cell.first, last = cell.first + cell.count; i < last; ++i)
+				{
+					const HashGridProxy& proxy = proxies[cellProxies[i]];
+					if (!proxy.alive)
+					{
+						continue;
+					}
+
+					// Only report a proxy from the first cell it shares with
+					// the query
+					int firstX = CellCoord(proxy.min.x), firstY = CellCoord(proxy.min.y), firstZ = CellCoord(proxy.min.z);
+					if ((firstX > minX ? firstX : minX) != x ||
+						(firstY > minY ? firstY : minY) != y ||
+						(firstZ > minZ ? firstZ : minZ) != z)
+					{
+						continue;
+					}
+
+					if (SphereAABB(sphere, FromMinMax(proxy.min, proxy.max)))
+					{
+						outProxies.push_back(cellProxies[i]);
+					}
+				}
+			}
+		}
+	}
+
+	return outProxies.size();
+}
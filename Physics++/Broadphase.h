@@ -0,0 +1,151 @@
+#pragma once
+
+#include "Geometry3D.h"
+#include <vector>
+#include <unordered_map>
+
+#define BROADPHASE_NULL -1
+
+struct BroadphasePair
+{
+	// proxy1 < proxy2
+	int proxy1;
+	int proxy2;
+};
+
+// Finds the pairs of proxies whose bounds overlap. Proxies are created,
+// destroyed and moved freely, Update then brings the pair list up to date
+// and reports which pairs started or stopped overlapping since the previous
+// Update.
+// Standalone for now: rigidbodies carry no bounds, so nothing in
+// PhysicsSystem or Scene feeds proxies in yet.
+class Broadphase
+{
+protected:
+	std::vector<BroadphasePair> pairs;
+	std::vector<BroadphasePair> addedPairs;
+	std::vector<BroadphasePair> removedPairs;
+	// Index of each pair in pairs
+	std::unordered_map<unsigned long long, int> pairIndex;
+	// Pairs touched since the last Update and whether they existed then
+	std::unordered_map<unsigned long long, bool> changedPairs;
+
+	void AddPair(int proxy1, int proxy2);
+	void RemovePair(int proxy1, int proxy2);
+	// One pass over the pairs, Update drops the destroyed proxies' pairs
+	// together instead of one scan per DestroyProxy
+	void RemoveProxyPairs(const std::vector<int>& proxies);
+	bool HasPair(int proxy1, int proxy2) const;
+	// Turns the pairs touched since the last call into added and removed
+	void FlushPairEvents();
+
+public:
+	virtual ~Broadphase() { }
+
+	virtual int CreateProxy(const AABB& bounds, void* userData) = 0;
+	virtual void DestroyProxy(int proxy) = 0;
+	virtual void MoveProxy(int proxy, const AABB& bounds) = 0;
+	virtual void* GetUserData(int proxy) const = 0;
+	virtual void Update() = 0;
+
+	inline const std::vector<BroadphasePair>& GetPairs() const { return pairs; }
+	inline const std::vector<BroadphasePair>& GetAddedPairs() const { return addedPairs; }
+	inline const std::vector<BroadphasePair>& GetRemovedPairs() const { return removedPairs; }
+};
+
+struct SweepEndpoint
+{
+	float value;
+	// Proxy index times two, plus one for a max endpoint
+	int data;
+};
+
+struct SweepProxy
+{
+	Vec3 min;
+	Vec3 max;
+	void* userData;
+	bool alive;
+	// Created since the last Update
+	bool inserted;
+};
+
+// Incremental sort and sweep. Every axis keeps the proxies' endpoints
+// sorted between updates, so with coherent motion the insertion sort in
+// Update does little work. Pairs change exactly where two endpoints swap.
+class SweepAndPrune : public Broadphase
+{
+protected:
+	std::vector<SweepProxy> proxies;
+	std::vector<SweepEndpoint> endpoints[3];
+	std::vector<int> freeProxies;
+	// Destroyed proxies whose endpoints are still in the axes
+	std::vector<int> deadProxies;
+	// Endpoints past this index on every axis belong to new proxies
+	int numSorted;
+
+	void SortAxis(int axis, int count);
+	void InsertBatch(int firstNew);
+	bool Overlaps(int proxy1, int proxy2) const;
+
+public:
+	inline SweepAndPrune() : numSorted(0) { }
+
+	int CreateProxy(const AABB& bounds, void* userData);
+	void DestroyProxy(int proxy);
+	void MoveProxy(int proxy, const AABB& bounds);
+	void* GetUserData(int proxy) const;
+	void Update();
+};
+
+struct HashGridProxy
+{
+	Vec3 min;
+	Vec3 max;
+	void* userData;
+	bool alive;
+};
+
+struct HashGridCell
+{
+	int x;
+	int y;
+	int z;
+	// Range of the cell's proxies in cellProxies, count is 0 for empty slots
+	int first;
+	int count;
+};
+
+// Uniform grid of cells hashed into an open addressing table, rebuilt from
+// scratch by every Update. Best for many objects of about the cell size,
+// where keeping a tree up to date costs more than starting over.
+class HashGrid : public Broadphase
+{
+protected:
+	std::vector<HashGridProxy> proxies;
+	std::vector<int> freeProxies;
+	// Destroyed proxies, reused after the next Update
+	std::vector<int> deadProxies;
+	std::vector<HashGridCell> cells;
+	// Proxies grouped by cell
+	std::vector<int> cellProxies;
+	float cellSize;
+	float invCellSize;
+
+	int CellCoord(float value) const;
+	int FindCell(int x, int y, int z) const;
+	int InsertCell(int x, int y, int z);
+	bool Overlaps(int proxy1, int proxy2) const;
+
+public:
+	inline HashGrid(float cellSize) : cellSize(cellSize), invCellSize(1.0f / cellSize) { }
+
+	int CreateProxy(const AABB& bounds, void* userData);
+	void DestroyProxy(int proxy);
+	void MoveProxy(int proxy, const AABB& bounds);
+	void* GetUserData(int proxy) const;
+	void Update();
+
+	// Proxies whose bounds touch the sphere, as of the last Update
+	int Query(const Sphere& sphere, std::vector<int>& outProxies) const;
+};
@@ -1,7 +1,23 @@
 #include "Geometry3D.h"
 #include <cmath>
 #include <cfloat>
-#include <list>
+#include <vector>
+#include <algorithm>
+
+#include <cstring>
+#include <thread>
+#include <mutex>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define WIDE_BVH_SSE
+#endif
+
+#define WIDE_BVH_STACK_SIZE 256
+#define BVH_SPLIT_DEPTH 3
+#define LAZY_BVH_LOCKS 64
+#define COMPRESSED_BVH_LEAF 0x80000000u
+#define MODEL_CHAIN_SIZE 32
 
 void Model::SetContent(Mesh* mesh)
 {
@@ -25,6 +41,106 @@ void Model::SetContent(Mesh* mesh)
 
 		bounds = FromMinMax(min, max);
 	}
+
+	cacheValid = false;
+}
+
+static bool SameVec3(const Vec3& a, const Vec3& b)
+{
+	return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+unsigned int Model::RefreshCache() const
+{
+	// Walk up first and refresh top down, only chains deeper than
+	// MODEL_CHAIN_SIZE recurse
+	const Model* chain[MODEL_CHAIN_SIZE];
+	int depth = 0;
+	const Model* top = this;
+
+	for (; top != 0 && depth < MODEL_CHAIN_SIZE; top = top->parent)
+	{
+		chain[depth++] = top;
+	}
+
+	if (top != 0)
+	{
+		top->RefreshCache();
+	}
+
+	for (int i = depth - 1; i >= 0; --i)
+	{
+		const Model* model = chain[i];
+
+		if (!model->IsCacheCurrent())
+		{
+			Mat4 localMat = model->GetLocalMatrix();
+			model->StoreWorld(model->parent != 0 ? localMat * model->parent->worldCache : localMat);
+		}
+	}
+
+	return revision;
+}
+
+Mat4 Model::GetLocalMatrix() const
+{
+	float sp = sinf(DEG2RAD(rotation.x)), cp = cosf(DEG2RAD(rotation.x));
+	float sy = sinf(DEG2RAD(rotation.y)), cy = cosf(DEG2RAD(rotation.y));
+	float sr = sinf(DEG2RAD(rotation.z)), cr = cosf(DEG2RAD(rotation.z));
+
+	// ZRotation(roll) * XRotation(pitch) * YRotation(yaw) multiplied out
+	return Mat4(
+		cr * cy + sr * sp * sy, sr * cp, sr * sp * cy - cr * sy, 0.0f,
+		cr * sp * sy - sr * cy, cr * cp, sr * sy + cr * sp * cy, 0.0f,
+		cp * sy, -sp, cp * cy, 0.0f,
+		position.x, position.y, position.z, 1.0f
+	);
+}
+
+bool Model::IsCacheCurrent() const
+{
+	unsigned int parentRevision = parent != 0 ? parent->revision : 0;
+
+	return cacheValid && parent == cachedParent && parentRevision == cachedParentRevision &&
+		SameVec3(position, cachedPosition) && SameVec3(rotation, cachedRotation);
+}
+
+unsigned int Model::StoreWorld(const Mat4& world) const
+{
+	worldCache = world;
+	inverseValid = false;
+
+	obbCache.size = bounds.size;
+	obbCache.position = MultiplyPoint(bounds.position, worldCache);
+	obbCache.orientation = Cut(worldCache, 3, 3);
+
+	const float* axis = obbCache.orientation.asArray;
+	Vec3 extent(
+		fabsf(axis[0] * bounds.size.x) + fabsf(axis[3] * bounds.size.y) + fabsf(axis[6] * bounds.size.z),
+		fabsf(axis[1] * bounds.size.x) + fabsf(axis[4] * bounds.size.y) + fabsf(axis[7] * bounds.size.z),
+		fabsf(axis[2] * bounds.size.x) + fabsf(axis[5] * bounds.size.y) + fabsf(axis[8] * bounds.size.z));
+	aabbCache = AABB(obbCache.position, extent);
+
+	cachedPosition = position;
+	cachedRotation = rotation;
+	cachedParent = parent;
+	cachedParentRevision = parent != 0 ? parent->revision : 0;
+	cacheValid = true;
+
+	return ++revision;
+}
+
+const Mat4& Model::GetInverseWorldMatrix() const
+{
+	RefreshCache();
+
+	if (!inverseValid)
+	{
+		inverseWorldCache = Inverse(worldCache);
+		inverseValid = true;
+	}
+
+	return inverseWorldCache;
 }
 
 float Lenght(const Line& line)
@@ -64,7 +180,16 @@ Vec3 GetMax(const AABB& aabb)
 
 AABB FromMinMax(const Vec3& min, const Vec3& max)
 {
-	return AABB((min + max) * 0.5f, (min - max) * 0.5f);
+	return AABB((min + max) * 0.5f, (max - min) * 0.5f);
+}
+
+float SurfaceArea(const AABB& aabb)
+{
+	float x = fabsf(aabb.size.x) * 2.0f;
+	float y = fabsf(aabb.size.y) * 2.0f;
+	float z = fabsf(aabb.size.z) * 2.0f;
+
+	return 2.0f * (x * y + y * z + z * x);
 }
 
 float PlaneEquation(const Point& point, const Plane& plane)
@@ -556,6 +681,38 @@ bool Raycast(const AABB& aabb, const Ray& ray, RaycastResult* outResult)
 	return true;
 }
 
+// Cheaper than Raycast when only the entry distance is needed, 0 if the
+// ray starts inside the box and -1 if it misses
+float RaycastEntry(const AABB& aabb, const Ray& ray)
+{
+	Vec3 min = GetMin(aabb);
+	Vec3 max = GetMax(aabb);
+	float tEnter = 0.0f;
+	float tExit = FLT_MAX;
+
+	for (int i = 0; i < 3; ++i)
+	{
+		float origin = ray.origin.asArray[i];
+		float direction = ray.direction.asArray[i];
+
+		if (fabsf(direction) < 1e-8f)
+		{
+			if (origin < min.asArray[i] || origin > max.asArray[i])
+			{
+				return -1;
+			}
+			continue;
+		}
+
+		float t1 = (min.asArray[i] - origin) / direction;
+		float t2 = (max.asArray[i] - origin) / direction;
+		tEnter = fmaxf(tEnter, fminf(t1, t2));
+		tExit = fminf(tExit, fmaxf(t1, t2));
+	}
+
+	return tEnter <= tExit ? tEnter : -1;
+}
+
 bool Raycast(const OBB& obb, const Ray& ray, RaycastResult* outResult)
 {
 	ResetRaycastResult(outResult);
@@ -772,7 +929,7 @@ bool Linecast(const Triangle& triangle, const Line& line)
 {
 	Ray ray;
 	ray.origin = line.start;
-	ray.origin = Normalized(line.end - line.start);
+	ray.direction = Normalized(line.end - line.start);
 	RaycastResult result;
 	
 	if (!Raycast(triangle, ray, &result))
@@ -870,14 +1027,14 @@ bool OverlapOnAxis(const AABB& aabb, const Triangle& triangle, const Vec3& axis)
 
 	return ((b.min <= a.max) && (a.min <= b.max));
 }
-/*
+
 bool OverlapOnAxis(const OBB& obb, const Triangle& triangle, const Vec3& axis)
 {
 	Interval a = GetInterval(obb, axis);
 	Interval b = GetInterval(triangle, axis);
 
 	return ((b.min <= a.max) && (a.min <= b.max));
-}*/
+}
 
 bool OverlapOnAxis(const Triangle& triangle1, const Triangle& triangle2, const Vec3& axis)
 {
@@ -1005,37 +1162,6 @@ bool TriangleOBB(const Triangle& triangle, const OBB& obb)
 	return true;
 }
 
-bool OverlapOnAxis(const OBB& obb, const Triangle& triangle, const Vec3& axis)
-{
-	Vec3 f0 = triangle.b - triangle.a;
-	Vec3 f1 = triangle.c - triangle.b;
-	Vec3 f2 = triangle.a - triangle.c;
-
-	const float* orientation = obb.orientation.asArray;
-	Vec3 u0(orientation[0], orientation[1], orientation[2]);
-	Vec3 u1(orientation[3], orientation[4], orientation[5]);
-	Vec3 u2(orientation[6], orientation[7], orientation[8]);
-
-	Vec3 test[13] =
-	{
-		u0, u1, u2,
-		Cross(f0, f1),
-		Cross(u0, f0), Cross(u0, f1), Cross(u0, f2),
-		Cross(u1, f0), Cross(u1, f1), Cross(u1, f2),
-		Cross(u2, f0), Cross(u2, f1), Cross(u2, f2)
-	};
-
-	for (int i = 0; i < 13; ++i)
-	{
-		if (!OverlapOnAxis(obb, triangle, test[i]))
-		{
-			return false;
-		}
-	}
-
-	return true;
-}
-
 bool TrianglePlane(const Triangle& triangle, const Plane& plane)
 {
 	float side1 = PlaneEquation(triangle.a, plane);
@@ -1124,13 +1250,8 @@ bool TriangleTriangleRobust(const Triangle& triangle1, const Triangle& triangle2
 	return true;
 }
 
-void AccelarateMesh(Mesh& mesh)
+static BVHNode* CreateRootBVHNode(const Mesh& mesh)
 {
-	if (mesh.accelerator != 0)
-	{
-		return;
-	}
-
 	Vec3 min = mesh.vertices[0];
 	Vec3 max = mesh.vertices[0];
 	for (int i = 0; i < mesh.numTriangles * 3; ++i)
@@ -1143,17 +1264,160 @@ void AccelarateMesh(Mesh& mesh)
 		max.z = fmaxf(mesh.vertices[i].z, max.z);
 	}
 
-	mesh.accelerator = new BVHNode();
-	mesh.accelerator->bounds = FromMinMax(min, max);
-	mesh.accelerator->numTriangles = mesh.numTriangles;
-	mesh.accelerator->triangles = new int[mesh.numTriangles];
+	BVHNode* root = new BVHNode();
+	root->bounds = FromMinMax(min, max);
+	root->numTriangles = mesh.numTriangles;
+	root->triangles = new int[mesh.numTriangles];
 
 	for (int i = 0; i < mesh.numTriangles; ++i)
 	{
-		mesh.accelerator->triangles[i] = i;
+		root->triangles[i] = i;
+	}
+
+	return root;
+}
+
+void AccelarateMesh(Mesh& mesh)
+{
+	if (mesh.accelerator != 0)
+	{
+		return;
+	}
+
+	mesh.accelerator = CreateRootBVHNode(mesh);
+	SplitBVHNode(mesh.accelerator, mesh, BVH_SPLIT_DEPTH);
+	RefitBVHNode(mesh.accelerator, mesh);
+	mesh.acceleratorCost = BVHCost(mesh);
+}
+
+static void MarkPendingBVHNodes(BVHNode* node, int depth, int cell)
+{
+	if (node->children == 0)
+	{
+		if (node->numTriangles > 0)
+		{
+			node->pendingCell = cell;
+			node->pendingDepth.store(depth, std::memory_order_relaxed);
+		}
+		return;
+	}
+
+	for (int i = 0; i < 8; ++i)
+	{
+		MarkPendingBVHNodes(&node->children[i], depth, (cell << 3) | i);
+	}
+}
+
+static void SetBVHChildCells(BVHNode* node, const AABB& cell)
+{
+	Vec3 c = cell.position;
+	Vec3 e = cell.size * 0.5f;
+
+	node->children[0].bounds = AABB(c + Vec3(-e.x, +e.y, -e.z), e);
+	node->children[1].bounds = AABB(c + Vec3(+e.x, +e.y, -e.z), e);
+	node->children[2].bounds = AABB(c + Vec3(-e.x, +e.y, +e.z), e);
+	node->children[3].bounds = AABB(c + Vec3(+e.x, +e.y, +e.z), e);
+	node->children[4].bounds = AABB(c + Vec3(-e.x, -e.y, -e.z), e);
+	node->children[5].bounds = AABB(c + Vec3(+e.x, -e.y, -e.z), e);
+	node->children[6].bounds = AABB(c + Vec3(-e.x, -e.y, +e.z), e);
+	node->children[7].bounds = AABB(c + Vec3(+e.x, -e.y, +e.z), e);
+}
+
+// The cell SplitBVHNode would have given a pending leaf, found by walking
+// its octants down from the root's cell. Its refit bounds are not a cell.
+static AABB PendingBVHCell(const Mesh& mesh, int cell)
+{
+	int levels = 0;
+	for (int key = cell; key > 1; key >>= 3)
+	{
+		++levels;
+	}
+
+	AABB bounds = mesh.accelerator->bounds;
+	for (int level = levels - 1; level >= 0; --level)
+	{
+		int octant = (cell >> (3 * level)) & 7;
+		Vec3 e = bounds.size * 0.5f;
+		bounds = AABB(bounds.position + Vec3(
+			(octant & 1) ? +e.x : -e.x,
+			(octant & 4) ? -e.y : +e.y,
+			(octant & 2) ? +e.z : -e.z), e);
+	}
+
+	return bounds;
+}
+
+void AccelarateMeshLazy(Mesh& mesh, int eagerDepth)
+{
+	if (mesh.accelerator != 0)
+	{
+		return;
+	}
+
+	if (eagerDepth > BVH_SPLIT_DEPTH)
+	{
+		eagerDepth = BVH_SPLIT_DEPTH;
+	}
+
+	mesh.accelerator = CreateRootBVHNode(mesh);
+	SplitBVHNode(mesh.accelerator, mesh, eagerDepth);
+
+	// The root keeps its cell, the vertex bounds, so pending leaves can find
+	// theirs
+	AABB rootCell = mesh.accelerator->bounds;
+	RefitBVHNode(mesh.accelerator, mesh);
+	mesh.accelerator->bounds = rootCell;
+
+	if (eagerDepth < BVH_SPLIT_DEPTH)
+	{
+		MarkPendingBVHNodes(mesh.accelerator, BVH_SPLIT_DEPTH - eagerDepth, 1);
+	}
+
+	mesh.acceleratorCost = BVHCost(mesh);
+}
+
+static std::mutex lazyBVHLocks[LAZY_BVH_LOCKS];
+
+void SplitPendingBVHNode(BVHNode* node, const Mesh& mesh)
+{
+	std::mutex& lock = lazyBVHLocks[((size_t)node / sizeof(BVHNode)) % LAZY_BVH_LOCKS];
+	std::lock_guard<std::mutex> guard(lock);
+
+	// Another thread may have split the node while this one waited
+	int depth = node->pendingDepth.load(std::memory_order_relaxed);
+	if (depth == 0)
+	{
+		return;
+	}
+
+	// Split the original cell like the eager build, node->bounds has been refit
+	node->children = new BVHNode[8];
+	SetBVHChildCells(node, PendingBVHCell(mesh, node->pendingCell));
+	SplitBVHNode(node, mesh, 1);
+
+	for (int i = 0; i < 8; ++i)
+	{
+		BVHNode* child = &node->children[i];
+		if (child->numTriangles > 0)
+		{
+			RefitBVHNode(child, mesh);
+			child->pendingCell = (node->pendingCell << 3) | i;
+			child->pendingDepth.store(depth - 1, std::memory_order_relaxed);
+		}
 	}
 
-	SplitBVHNode(mesh.accelerator, mesh, 3);
+	// Readers only touch the children after seeing this store
+	node->pendingDepth.store(0, std::memory_order_release);
+}
+
+void SplitAllPendingBVHNodes(BVHNode* node, const Mesh& mesh)
+{
+	EnsureBVHNode(node, mesh);
+
+	for (int i = 0; node->children != 0 && i < 8; ++i)
+	{
+		SplitAllPendingBVHNodes(&node->children[i], mesh);
+	}
 }
 
 void SplitBVHNode(BVHNode* node, const Mesh& model, int depth)
@@ -1168,17 +1432,7 @@ void SplitBVHNode(BVHNode* node, const Mesh& model, int depth)
 		if (node->numTriangles > 0)
 		{
 			node->children = new BVHNode[8];
-			Vec3 c = node->bounds.position;
-			Vec3 e = node->bounds.size * 0.5f;
-
-			node->children[0].bounds = AABB(c + Vec3(-e.x, +e.y, -e.z), e);
-			node->children[1].bounds = AABB(c + Vec3(+e.x, +e.y, -e.z), e);
-			node->children[2].bounds = AABB(c + Vec3(-e.x, +e.y, +e.z), e);
-			node->children[3].bounds = AABB(c + Vec3(+e.x, +e.y, +e.z), e);
-			node->children[4].bounds = AABB(c + Vec3(-e.x, -e.y, -e.z), e);
-			node->children[5].bounds = AABB(c + Vec3(+e.x, -e.y, -e.z), e);
-			node->children[6].bounds = AABB(c + Vec3(-e.x, -e.y, +e.z), e);
-			node->children[7].bounds = AABB(c + Vec3(+e.x, -e.y, +e.z), e);
+			SetBVHChildCells(node, node->bounds);
 		}
 	}
 
@@ -1210,7 +1464,7 @@ void SplitBVHNode(BVHNode* node, const Mesh& model, int depth)
 			{
 				Triangle t = model.triangles[node->triangles[j]];
 
-				if (TriangleAABB(t, node->children->bounds))
+				if (TriangleAABB(t, node->children[i].bounds))
 				{
 					node->children[i].triangles[index++] = node->triangles[j];
 				}
@@ -1239,398 +1493,3419 @@ void FreeBVHNode(BVHNode* node)
 		
 		delete[] node->children;
 		node->children = 0;
+	}
 
-		if (node->numTriangles != 0 || node->triangles != 0)
-		{
-			delete[] node->triangles;
-			node->triangles = 0;
-			node->numTriangles = 0;
-		}
+	if (node->numTriangles != 0 || node->triangles != 0)
+	{
+		delete[] node->triangles;
+		node->triangles = 0;
+		node->numTriangles = 0;
 	}
 }
 
-float MeshRay(const Mesh& mesh, const Ray& ray)
+bool RefitBVHNode(BVHNode* node, const Mesh& mesh)
 {
-	if (mesh.accelerator == 0)
+	Vec3 min, max;
+	bool empty = true;
+
+	if (node->children == 0)
 	{
-		for (int i = 0; i < mesh.numTriangles; ++i)
+		for (int i = 0; i < node->numTriangles; ++i)
 		{
-			RaycastResult raycastResult;
-			Raycast(mesh.triangles[i], ray, &raycastResult);
-			float result = raycastResult.t;
-			if (result >= 0)
+			const Triangle& t = mesh.triangles[node->triangles[i]];
+
+			for (int j = 0; j < 3; ++j)
 			{
-				return result;
+				if (empty)
+				{
+					min = max = t.points[j];
+					empty = false;
+				}
+
+				min.x = fminf(t.points[j].x, min.x);
+				min.y = fminf(t.points[j].y, min.y);
+				min.z = fminf(t.points[j].z, min.z);
+				max.x = fmaxf(t.points[j].x, max.x);
+				max.y = fmaxf(t.points[j].y, max.y);
+				max.z = fmaxf(t.points[j].z, max.z);
 			}
 		}
 	}
 	else
 	{
-		std::list<BVHNode*> toProcess;
-		toProcess.push_front(mesh.accelerator);
-
-		while (!toProcess.empty())
+		for (int i = 0; i < 8; ++i)
 		{
-			BVHNode* iterator = *(toProcess.begin());
-			toProcess.erase(toProcess.begin());
-
-			if (iterator->numTriangles < 0)
+			if (!RefitBVHNode(&node->children[i], mesh))
 			{
-				for (int i = 0; i < iterator->numTriangles; ++i)
-				{
-					RaycastResult raycastResult;
-					Raycast(mesh.triangles[iterator->triangles[i]], ray, &raycastResult);
-					float r = raycastResult.t;
-					if (r >= 0)
-					{
-						return r;
-					}
-				}
+				continue;
 			}
 
-			if (iterator->children != 0)
-			{
-				for (int i = 8 - 1; i >= 0; --i)
-				{
-					RaycastResult result;
-					Raycast(iterator->children[i].bounds, ray, &result);
+			Vec3 childMin = GetMin(node->children[i].bounds);
+			Vec3 childMax = GetMax(node->children[i].bounds);
 
-					if (result.t >= 0)
-					{
-						toProcess.push_front(&iterator->children[i]);
-					}
-				}
+			if (empty)
+			{
+				min = childMin;
+				max = childMax;
+				empty = false;
 			}
+
+			min.x = fminf(childMin.x, min.x);
+			min.y = fminf(childMin.y, min.y);
+			min.z = fminf(childMin.z, min.z);
+			max.x = fmaxf(childMax.x, max.x);
+			max.y = fmaxf(childMax.y, max.y);
+			max.z = fmaxf(childMax.z, max.z);
 		}
 	}
 
-	return -1;
+	// Empty subtrees keep their old bounds, they hold nothing to test
+	if (!empty)
+	{
+		node->bounds = FromMinMax(min, max);
+	}
+
+	return !empty;
 }
 
-bool LineTest(const Mesh& mesh, const Line& line)
+static void RefitWideBVH(WideBVH* bvh, const Mesh& mesh);
+static void RefitCompressedBVH(CompressedBVH* bvh, const Mesh& mesh);
+static float FlatBVHCost(const Mesh& mesh);
+static void GatherFlatBVHStats(const Mesh& mesh, BVHStats& stats,
+	std::vector<int>& references, long long& leafDepths);
+
+float RefitMesh(Mesh& mesh)
 {
-	if (mesh.accelerator == 0)
+	// The flat copies are preferred by the queries, keep them in step
+	if (mesh.wideAccelerator != 0)
 	{
-		for (int i = 0; i < mesh.numTriangles; ++i)
-		{
-			if (Linecast(mesh.triangles[i], line))
-			{
-				return true;
-			}
-		}
+		RefitWideBVH(mesh.wideAccelerator, mesh);
 	}
-	else
+
+	if (mesh.compressedAccelerator != 0)
 	{
-		std::list<BVHNode*> toProcess;
-		toProcess.push_front(mesh.accelerator);
-		while (!toProcess.empty())
-		{
-			BVHNode* iterator = *(toProcess.begin());
-			toProcess.erase(toProcess.begin());
+		RefitCompressedBVH(mesh.compressedAccelerator, mesh);
+	}
 
-			if (iterator->numTriangles >= 0)
-			{
-				for (int i = 0; i < iterator->numTriangles; ++i)
-				{
-					if (Linecast(mesh.triangles[i], line))
-					{
-						return true;
-					}
-				}
-			}
+	if (mesh.accelerator != 0)
+	{
+		RefitBVHNode(mesh.accelerator, mesh);
+	}
 
-			if (iterator->children != 0)
-			{
-				for (int i = 8 - 1; i >= 0; --i)
-				{
-					if (Linecast(mesh.triangles[i], line))
-					{
-						toProcess.push_front(&iterator->children[i]);
-					}
-				}
-			}
-		}
+	if (mesh.acceleratorCost <= 0.0f)
+	{
+		return 1.0f;
 	}
-	
-	return false;
+
+	return BVHCost(mesh) / mesh.acceleratorCost;
 }
 
-bool MeshSphere(const Mesh& mesh, const Sphere& sphere)
+static float BVHNodeCost(const BVHNode* node)
 {
-	if (mesh.accelerator == 0)
+	if (node->children == 0)
 	{
-		for (int i = 0; i < mesh.numTriangles; ++i)
-		{
-			if (TriangleSphere(mesh.triangles[i], sphere))
-			{
-				return true;
+		return SurfaceArea(node->bounds) * (float)node->numTriangles;
+	}
+
+	float cost = SurfaceArea(node->bounds);
+
+	for (int i = 0; i < 8; ++i)
+	{
+		cost += BVHNodeCost(&node->children[i]);
+	}
+
+	return cost;
+}
+
+float BVHCost(const Mesh& mesh)
+{
+	if (mesh.compressedAccelerator != 0 || mesh.wideAccelerator != 0)
+	{
+		return FlatBVHCost(mesh);
+	}
+
+	if (mesh.accelerator == 0)
+	{
+		return 0.0f;
+	}
+
+	float rootArea = SurfaceArea(mesh.accelerator->bounds);
+
+	if (rootArea <= 0.0f)
+	{
+		return 0.0f;
+	}
+
+	return BVHNodeCost(mesh.accelerator) / rootArea;
+}
+
+static bool ContainsBounds(const AABB& outer, const AABB& inner)
+{
+	Vec3 outerMin = GetMin(outer);
+	Vec3 outerMax = GetMax(outer);
+	Vec3 innerMin = GetMin(inner);
+	Vec3 innerMax = GetMax(inner);
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float epsilon = 1e-4f * fmaxf(1.0f, outerMax.asArray[axis] - outerMin.asArray[axis]);
+
+		if (innerMin.asArray[axis] < outerMin.asArray[axis] - epsilon ||
+			innerMax.asArray[axis] > outerMax.asArray[axis] + epsilon)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void GatherLeafStats(const AABB& leafBounds, const int* triangles, int numTriangles,
+	int depth, const Mesh& mesh, BVHStats& stats, std::vector<int>& references,
+	long long& leafDepths)
+{
+	stats.numLeaves += 1;
+	stats.numReferences += numTriangles;
+	leafDepths += depth;
+
+	if (stats.minLeafTriangles == 0 || numTriangles < stats.minLeafTriangles)
+	{
+		stats.minLeafTriangles = numTriangles;
+	}
+	if (numTriangles > stats.maxLeafTriangles)
+	{
+		stats.maxLeafTriangles = numTriangles;
+	}
+
+	// With the tolerance of ContainsBounds, a triangle lying in a face of
+	// the bounds can round to just outside them
+	AABB bounds = leafBounds;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		bounds.size.asArray[axis] += 1e-4f * fmaxf(1.0f, 2.0f * bounds.size.asArray[axis]);
+	}
+
+	for (int i = 0; i < numTriangles; ++i)
+	{
+		int triangle = triangles[i];
+
+		if (triangle < 0 || triangle >= mesh.numTriangles)
+		{
+			stats.numInvalidReferences += 1;
+			continue;
+		}
+
+		references[triangle] += 1;
+
+		// Spatial splits clip leaf bounds, so only overlap is required
+		if (!TriangleAABB(mesh.triangles[triangle], bounds))
+		{
+			stats.numDisjointTriangles += 1;
+		}
+	}
+}
+
+static void GatherBVHStats(const BVHNode* node, const Mesh& mesh, int depth,
+	BVHStats& stats, std::vector<int>& references, long long& leafDepths)
+{
+	stats.numNodes += 1;
+	stats.maxDepth = depth > stats.maxDepth ? depth : stats.maxDepth;
+
+	if (node->pendingDepth.load(std::memory_order_acquire) != 0)
+	{
+		stats.numPendingNodes += 1;
+	}
+
+	if (IsEmptyBVHNode(node))
+	{
+		stats.numEmptyNodes += 1;
+		return;
+	}
+
+	if (node->numTriangles > 0)
+	{
+		GatherLeafStats(node->bounds, node->triangles, node->numTriangles, depth,
+			mesh, stats, references, leafDepths);
+	}
+
+	if (node->children == 0)
+	{
+		return;
+	}
+
+	for (int i = 0; i < 8; ++i)
+	{
+		const BVHNode* child = &node->children[i];
+
+		if (!IsEmptyBVHNode(child) && !ContainsBounds(node->bounds, child->bounds))
+		{
+			stats.numUncontainedChildren += 1;
+		}
+
+		GatherBVHStats(child, mesh, depth + 1, stats, references, leafDepths);
+	}
+}
+
+BVHStats ComputeStats(const Mesh& mesh)
+{
+	BVHStats stats;
+	memset(&stats, 0, sizeof(BVHStats));
+
+	bool flat = mesh.compressedAccelerator != 0 || mesh.wideAccelerator != 0;
+	if (!flat && mesh.accelerator == 0)
+	{
+		stats.valid = mesh.numTriangles == 0;
+		stats.numMissingTriangles = mesh.numTriangles;
+		return stats;
+	}
+
+	std::vector<int> references(mesh.numTriangles, 0);
+	long long leafDepths = 0;
+
+	if (flat)
+	{
+		GatherFlatBVHStats(mesh, stats, references, leafDepths);
+	}
+	else
+	{
+		GatherBVHStats(mesh.accelerator, mesh, 0, stats, references, leafDepths);
+	}
+
+	for (int i = 0; i < mesh.numTriangles; ++i)
+	{
+		if (references[i] == 0)
+		{
+			stats.numMissingTriangles += 1;
+		}
+	}
+
+	if (stats.numLeaves > 0)
+	{
+		stats.averageLeafDepth = (float)leafDepths / (float)stats.numLeaves;
+		stats.averageLeafTriangles = (float)stats.numReferences / (float)stats.numLeaves;
+	}
+
+	int numValidReferences = stats.numReferences - stats.numInvalidReferences;
+	int numReachable = mesh.numTriangles - stats.numMissingTriangles;
+	stats.numDuplicateReferences = numValidReferences - numReachable;
+	stats.sahCost = BVHCost(mesh);
+	stats.valid = stats.numMissingTriangles == 0 && stats.numInvalidReferences == 0 &&
+		stats.numUncontainedChildren == 0 && stats.numDisjointTriangles == 0;
+
+	return stats;
+}
+
+static void GetNonEmptyChildren(const BVHNode* node, std::vector<const BVHNode*>& outChildren)
+{
+	for (int i = 0; i < 8; ++i)
+	{
+		if (!IsEmptyBVHNode(&node->children[i]))
+		{
+			outChildren.push_back(&node->children[i]);
+		}
+	}
+}
+
+static void GetTriangleMinMax(const Triangle& triangle, Vec3& outMin, Vec3& outMax)
+{
+	outMin.x = fminf(triangle.a.x, fminf(triangle.b.x, triangle.c.x));
+	outMin.y = fminf(triangle.a.y, fminf(triangle.b.y, triangle.c.y));
+	outMin.z = fminf(triangle.a.z, fminf(triangle.b.z, triangle.c.z));
+	outMax.x = fmaxf(triangle.a.x, fmaxf(triangle.b.x, triangle.c.x));
+	outMax.y = fmaxf(triangle.a.y, fmaxf(triangle.b.y, triangle.c.y));
+	outMax.z = fmaxf(triangle.a.z, fmaxf(triangle.b.z, triangle.c.z));
+}
+
+static unsigned int ExpandBits(unsigned int v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+static unsigned long long ExpandBits(unsigned long long v)
+{
+	v &= 0x1FFFFFull;
+	v = (v | v << 32) & 0x1F00000000FFFFull;
+	v = (v | v << 16) & 0x1F0000FF0000FFull;
+	v = (v | v << 8) & 0x100F00F00F00F00Full;
+	v = (v | v << 4) & 0x10C30C30C30C30C3ull;
+	v = (v | v << 2) & 0x1249249249249249ull;
+	return v;
+}
+
+template <typename Key>
+struct LinearBVHBuilder
+{
+	const Mesh* mesh;
+	Key* keys;
+	int* indices;
+	Vec3* mins;
+	Vec3* maxs;
+	int levels;
+	int leafSize;
+};
+
+template <typename Key>
+static void ComputeMortonKeys(LinearBVHBuilder<Key>& builder, const Vec3& sceneMin,
+	const Vec3& sceneExtent, int first, int last)
+{
+	float cells = (float)(1 << builder.levels);
+
+	for (int i = first; i < last; ++i)
+	{
+		const Triangle& t = builder.mesh->triangles[i];
+		GetTriangleMinMax(t, builder.mins[i], builder.maxs[i]);
+
+		Vec3 center = (builder.mins[i] + builder.maxs[i]) * 0.5f;
+		Key code = 0;
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float extent = sceneExtent.asArray[axis];
+			float normalized = extent > 0.0f ?
+				(center.asArray[axis] - sceneMin.asArray[axis]) / extent : 0.0f;
+			float cell = fminf(fmaxf(normalized * cells, 0.0f), cells - 1.0f);
+
+			code |= ExpandBits((Key)cell) << (2 - axis);
+		}
+
+		builder.keys[i] = code;
+		builder.indices[i] = i;
+	}
+}
+
+template <typename Key>
+static void RadixSort(Key* keys, int* indices, int count, int totalBits, int numThreads)
+{
+	std::vector<Key> tempKeys(count);
+	std::vector<int> tempIndices(count);
+	Key* srcKeys = keys;
+	int* srcIndices = indices;
+	Key* dstKeys = &tempKeys[0];
+	int* dstIndices = &tempIndices[0];
+
+	if (numThreads < 1 || count < 4096 * numThreads)
+	{
+		numThreads = 1;
+	}
+
+	std::vector<int> histograms(numThreads * 256);
+	std::vector<std::thread> workers;
+
+	for (int shift = 0; shift < totalBits; shift += 8)
+	{
+		std::fill(histograms.begin(), histograms.end(), 0);
+
+		for (int t = 0; t < numThreads; ++t)
+		{
+			int first = (int)(((long long)count * t) / numThreads);
+			int last = (int)(((long long)count * (t + 1)) / numThreads);
+			int* histogram = &histograms[t * 256];
+
+			workers.push_back(std::thread([=]()
+			{
+				for (int i = first; i < last; ++i)
+				{
+					++histogram[(srcKeys[i] >> shift) & 0xFF];
+				}
+			}));
+		}
+		for (int t = 0; t < numThreads; ++t)
+		{
+			workers[t].join();
+		}
+		workers.clear();
+
+		// Turn the per-thread counts into stable scatter offsets
+		int offset = 0;
+		for (int digit = 0; digit < 256; ++digit)
+		{
+			for (int t = 0; t < numThreads; ++t)
+			{
+				int size = histograms[t * 256 + digit];
+				histograms[t * 256 + digit] = offset;
+				offset += size;
+			}
+		}
+
+		for (int t = 0; t < numThreads; ++t)
+		{
+			int first = (int)(((long long)count * t) / numThreads);
+			int last = (int)(((long long)count * (t + 1)) / numThreads);
+			int* histogram = &histograms[t * 256];
+
+			workers.push_back(std::thread([=]()
+			{
+				for (int i = first; i < last; ++i)
+				{
+					int target = histogram[(srcKeys[i] >> shift) & 0xFF]++;
+					dstKeys[target] = srcKeys[i];
+					dstIndices[target] = srcIndices[i];
+				}
+			}));
+		}
+		for (int t = 0; t < numThreads; ++t)
+		{
+			workers[t].join();
+		}
+		workers.clear();
+
+		std::swap(srcKeys, dstKeys);
+		std::swap(srcIndices, dstIndices);
+	}
+
+	if (srcKeys != keys)
+	{
+		std::copy(srcKeys, srcKeys + count, keys);
+		std::copy(srcIndices, srcIndices + count, indices);
+	}
+}
+
+template <typename Key>
+static int GetMortonDigit(const LinearBVHBuilder<Key>& builder, Key key, int level)
+{
+	return (int)((key >> (3 * (builder.levels - 1 - level))) & 7);
+}
+
+template <typename Key>
+static void BuildLinearBVHNode(const LinearBVHBuilder<Key>& builder, BVHNode* node,
+	int first, int last, int level, int numThreads)
+{
+	// Levels where the whole range falls in one octant add no information
+	while (level < builder.levels && GetMortonDigit(builder, builder.keys[first], level) ==
+		GetMortonDigit(builder, builder.keys[last - 1], level))
+	{
+		++level;
+	}
+
+	if (last - first <= builder.leafSize || level >= builder.levels)
+	{
+		Vec3 min = builder.mins[first];
+		Vec3 max = builder.maxs[first];
+
+		node->numTriangles = last - first;
+		node->triangles = new int[last - first];
+
+		for (int i = first; i < last; ++i)
+		{
+			node->triangles[i - first] = builder.indices[i];
+
+			min.x = fminf(builder.mins[i].x, min.x);
+			min.y = fminf(builder.mins[i].y, min.y);
+			min.z = fminf(builder.mins[i].z, min.z);
+			max.x = fmaxf(builder.maxs[i].x, max.x);
+			max.y = fmaxf(builder.maxs[i].y, max.y);
+			max.z = fmaxf(builder.maxs[i].z, max.z);
+		}
+
+		node->bounds = FromMinMax(min, max);
+		return;
+	}
+
+	node->children = new BVHNode[8];
+
+	int ranges[9];
+	ranges[0] = first;
+	for (int digit = 0; digit < 8; ++digit)
+	{
+		int low = ranges[digit];
+		int high = last;
+
+		while (low < high)
+		{
+			int middle = low + (high - low) / 2;
+			if (GetMortonDigit(builder, builder.keys[middle], level) <= digit)
+			{
+				low = middle + 1;
+			}
+			else
+			{
+				high = middle;
+			}
+		}
+
+		ranges[digit + 1] = low;
+	}
+
+	int numLarge = 0;
+	for (int i = 0; i < 8; ++i)
+	{
+		numLarge += ranges[i + 1] - ranges[i] > 1024 ? 1 : 0;
+	}
+
+	// At most numThreads - 1 large children get a worker and an even share
+	// of the threads, this thread builds the rest with what is left over
+	int numWorkers = numThreads > 1 ? std::min(numLarge, numThreads - 1) : 0;
+	int workerThreads = numThreads / (numWorkers + 1);
+	int inlineThreads = numThreads - numWorkers * workerThreads;
+
+	std::vector<std::thread> workers;
+
+	for (int i = 0; i < 8; ++i)
+	{
+		if (ranges[i + 1] == ranges[i])
+		{
+			continue;
+		}
+
+		BVHNode* child = &node->children[i];
+		int childFirst = ranges[i];
+		int childLast = ranges[i + 1];
+
+		if ((int)workers.size() < numWorkers && childLast - childFirst > 1024)
+		{
+			workers.push_back(std::thread([=, &builder]()
+			{
+				BuildLinearBVHNode(builder, child, childFirst, childLast, level + 1, workerThreads);
+			}));
+		}
+		else
+		{
+			BuildLinearBVHNode(builder, child, childFirst, childLast, level + 1, inlineThreads);
+		}
+	}
+
+	for (int i = 0, size = workers.size(); i < size; ++i)
+	{
+		workers[i].join();
+	}
+
+	bool empty = true;
+	Vec3 min, max;
+
+	for (int i = 0; i < 8; ++i)
+	{
+		if (ranges[i + 1] == ranges[i])
+		{
+			continue;
+		}
+
+		Vec3 childMin = GetMin(node->children[i].bounds);
+		Vec3 childMax = GetMax(node->children[i].bounds);
+
+		if (empty)
+		{
+			min = childMin;
+			max = childMax;
+			empty = false;
+		}
+
+		min.x = fminf(childMin.x, min.x);
+		min.y = fminf(childMin.y, min.y);
+		min.z = fminf(childMin.z, min.z);
+		max.x = fmaxf(childMax.x, max.x);
+		max.y = fmaxf(childMax.y, max.y);
+		max.z = fmaxf(childMax.z, max.z);
+	}
+
+	node->bounds = FromMinMax(min, max);
+
+	for (int i = 0; i < 8; ++i)
+	{
+		if (ranges[i + 1] == ranges[i])
+		{
+			node->children[i].bounds = AABB(node->bounds.position, Vec3());
+		}
+	}
+}
+
+template <typename Key>
+static void BuildLinearBVH(Mesh& mesh, int levels, int numThreads)
+{
+	int count = mesh.numTriangles;
+	std::vector<Key> keys(count);
+	std::vector<int> indices(count);
+	std::vector<Vec3> mins(count);
+	std::vector<Vec3> maxs(count);
+
+	LinearBVHBuilder<Key> builder;
+	builder.mesh = &mesh;
+	builder.keys = &keys[0];
+	builder.indices = &indices[0];
+	builder.mins = &mins[0];
+	builder.maxs = &maxs[0];
+	builder.levels = levels;
+	builder.leafSize = 4;
+
+	Vec3 sceneMin = mesh.vertices[0];
+	Vec3 sceneMax = mesh.vertices[0];
+	for (int i = 0; i < count * 3; ++i)
+	{
+		sceneMin.x = fminf(mesh.vertices[i].x, sceneMin.x);
+		sceneMin.y = fminf(mesh.vertices[i].y, sceneMin.y);
+		sceneMin.z = fminf(mesh.vertices[i].z, sceneMin.z);
+		sceneMax.x = fmaxf(mesh.vertices[i].x, sceneMax.x);
+		sceneMax.y = fmaxf(mesh.vertices[i].y, sceneMax.y);
+		sceneMax.z = fmaxf(mesh.vertices[i].z, sceneMax.z);
+	}
+	Vec3 sceneExtent = sceneMax - sceneMin;
+
+	int keyThreads = numThreads > 1 && count >= 4096 * numThreads ? numThreads : 1;
+	std::vector<std::thread> workers;
+	for (int t = 0; t < keyThreads; ++t)
+	{
+		int first = (int)(((long long)count * t) / keyThreads);
+		int last = (int)(((long long)count * (t + 1)) / keyThreads);
+
+		workers.push_back(std::thread([=, &builder]()
+		{
+			ComputeMortonKeys(builder, sceneMin, sceneExtent, first, last);
+		}));
+	}
+	for (int t = 0; t < keyThreads; ++t)
+	{
+		workers[t].join();
+	}
+
+	RadixSort(builder.keys, builder.indices, count, levels * 3, numThreads);
+
+	// Put the triangle boxes in key order so leaves read them sequentially
+	std::vector<Vec3> sortedMins(count);
+	std::vector<Vec3> sortedMaxs(count);
+	for (int i = 0; i < count; ++i)
+	{
+		sortedMins[i] = mins[indices[i]];
+		sortedMaxs[i] = maxs[indices[i]];
+	}
+	builder.mins = &sortedMins[0];
+	builder.maxs = &sortedMaxs[0];
+
+	mesh.accelerator = new BVHNode();
+	BuildLinearBVHNode(builder, mesh.accelerator, 0, count, 0, numThreads);
+}
+
+void AccelarateMeshLBVH(Mesh& mesh, int mortonBits, int numThreads, bool flatten)
+{
+	if (mesh.accelerator != 0 || mesh.numTriangles <= 0)
+	{
+		return;
+	}
+
+	if (mortonBits > 30)
+	{
+		BuildLinearBVH<unsigned long long>(mesh, 21, numThreads);
+	}
+	else
+	{
+		BuildLinearBVH<unsigned int>(mesh, 10, numThreads);
+	}
+
+	if (flatten)
+	{
+		FlattenBVHNodes(mesh.accelerator);
+	}
+
+	mesh.acceleratorCost = BVHCost(mesh);
+}
+
+struct SpatialReference
+{
+	int triangle;
+	Vec3 min;
+	Vec3 max;
+};
+
+struct SpatialNode
+{
+	Vec3 min;
+	Vec3 max;
+	int children[2];
+	int first;
+	int count;
+};
+
+struct SpatialBVHBuilder
+{
+	const Mesh* mesh;
+	std::vector<SpatialNode> nodes;
+	std::vector<int> leafTriangles;
+	int numReferences;
+	int maxReferences;
+	float rootArea;
+};
+
+struct SpatialBin
+{
+	Vec3 min;
+	Vec3 max;
+	int count;
+	int entries;
+	int exits;
+};
+
+#define SBVH_BINS 32
+#define SBVH_LEAF_SIZE 4
+#define SBVH_MAX_DEPTH 64
+#define SBVH_OVERLAP_THRESHOLD 1e-5f
+
+static float SurfaceArea(const Vec3& min, const Vec3& max)
+{
+	Vec3 d = max - min;
+	if (d.x < 0.0f || d.y < 0.0f || d.z < 0.0f)
+	{
+		return 0.0f;
+	}
+
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+static void GrowBounds(Vec3& min, Vec3& max, const Vec3& otherMin, const Vec3& otherMax)
+{
+	min.x = fminf(otherMin.x, min.x);
+	min.y = fminf(otherMin.y, min.y);
+	min.z = fminf(otherMin.z, min.z);
+	max.x = fmaxf(otherMax.x, max.x);
+	max.y = fmaxf(otherMax.y, max.y);
+	max.z = fmaxf(otherMax.z, max.z);
+}
+
+static void ResetBin(SpatialBin& bin)
+{
+	bin.min = Vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+	bin.max = Vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	bin.count = 0;
+	bin.entries = 0;
+	bin.exits = 0;
+}
+
+static int ClipPolygon(const Vec3* in, int count, int axis, float value, float sign, Vec3* out)
+{
+	int result = 0;
+
+	for (int i = 0; i < count; ++i)
+	{
+		const Vec3& a = in[i];
+		const Vec3& b = in[(i + 1) % count];
+		float da = (a.asArray[axis] - value) * sign;
+		float db = (b.asArray[axis] - value) * sign;
+
+		if (da >= 0.0f)
+		{
+			out[result++] = a;
+		}
+
+		if ((da >= 0.0f) != (db >= 0.0f))
+		{
+			float t = da / (da - db);
+			out[result] = a + (b - a) * t;
+			out[result].asArray[axis] = value;
+			++result;
+		}
+	}
+
+	return result;
+}
+
+// Bounds of the part of a reference between lo and hi along one axis
+static bool ClipReference(const Triangle& triangle, const SpatialReference& reference,
+	int axis, float lo, float hi, Vec3& outMin, Vec3& outMax)
+{
+	Vec3 polygon[9] = { triangle.a, triangle.b, triangle.c };
+	Vec3 clipped[9];
+
+	int count = ClipPolygon(polygon, 3, axis, lo, 1.0f, clipped);
+	count = ClipPolygon(clipped, count, axis, hi, -1.0f, polygon);
+
+	if (count == 0)
+	{
+		return false;
+	}
+
+	outMin = polygon[0];
+	outMax = polygon[0];
+	for (int i = 1; i < count; ++i)
+	{
+		GrowBounds(outMin, outMax, polygon[i], polygon[i]);
+	}
+
+	outMin.x = fmaxf(outMin.x, reference.min.x);
+	outMin.y = fmaxf(outMin.y, reference.min.y);
+	outMin.z = fmaxf(outMin.z, reference.min.z);
+	outMax.x = fminf(outMax.x, reference.max.x);
+	outMax.y = fminf(outMax.y, reference.max.y);
+	outMax.z = fminf(outMax.z, reference.max.z);
+
+	return outMin.x <= outMax.x && outMin.y <= outMax.y && outMin.z <= outMax.z;
+}
+
+static int BuildSpatialNode(SpatialBVHBuilder& builder, std::vector<SpatialReference>& references, int depth)
+{
+	int index = builder.nodes.size();
+	builder.nodes.push_back(SpatialNode());
+
+	Vec3 min(FLT_MAX, FLT_MAX, FLT_MAX);
+	Vec3 max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	Vec3 centroidMin = min;
+	Vec3 centroidMax = max;
+	int count = references.size();
+
+	for (int i = 0; i < count; ++i)
+	{
+		GrowBounds(min, max, references[i].min, references[i].max);
+		Vec3 centroid = (references[i].min + references[i].max) * 0.5f;
+		GrowBounds(centroidMin, centroidMax, centroid, centroid);
+	}
+
+	builder.nodes[index].min = min;
+	builder.nodes[index].max = max;
+	builder.nodes[index].children[0] = -1;
+	builder.nodes[index].children[1] = -1;
+
+	float area = SurfaceArea(min, max);
+	float leafCost = (float)count;
+	float bestCost = FLT_MAX;
+	int bestAxis = -1;
+	int bestSplit = 0;
+	bool spatial = false;
+	Vec3 overlapMin, overlapMax;
+	SpatialBin bins[SBVH_BINS];
+
+	// Object split, binned SAH over the reference centroids
+	for (int axis = 0; axis < 3 && count > SBVH_LEAF_SIZE && depth < SBVH_MAX_DEPTH; ++axis)
+	{
+		float lo = centroidMin.asArray[axis];
+		float extent = centroidMax.asArray[axis] - lo;
+		if (extent <= 0.0f)
+		{
+			continue;
+		}
+
+		for (int b = 0; b < SBVH_BINS; ++b)
+		{
+			ResetBin(bins[b]);
+		}
+
+		for (int i = 0; i < count; ++i)
+		{
+			float centroid = (references[i].min.asArray[axis] + references[i].max.asArray[axis]) * 0.5f;
+			int b = (int)((centroid - lo) / extent * SBVH_BINS);
+			b = b < 0 ? 0 : (b >= SBVH_BINS ? SBVH_BINS - 1 : b);
+			bins[b].count += 1;
+			GrowBounds(bins[b].min, bins[b].max, references[i].min, references[i].max);
+		}
+
+		Vec3 rightMin[SBVH_BINS], rightMax[SBVH_BINS];
+		int rightCount[SBVH_BINS];
+		Vec3 accumMin(FLT_MAX, FLT_MAX, FLT_MAX), accumMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		int accumCount = 0;
+
+		for (int b = SBVH_BINS - 1; b > 0; --b)
+		{
+			GrowBounds(accumMin, accumMax, bins[b].min, bins[b].max);
+			accumCount += bins[b].count;
+			rightMin[b] = accumMin;
+			rightMax[b] = accumMax;
+			rightCount[b] = accumCount;
+		}
+
+		accumMin = Vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+		accumMax = Vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		accumCount = 0;
+
+		for (int b = 0; b < SBVH_BINS - 1; ++b)
+		{
+			GrowBounds(accumMin, accumMax, bins[b].min, bins[b].max);
+			accumCount += bins[b].count;
+
+			if (accumCount == 0 || rightCount[b + 1] == 0)
+			{
+				continue;
+			}
+
+			float cost = 1.0f + (SurfaceArea(accumMin, accumMax) * accumCount +
+				SurfaceArea(rightMin[b + 1], rightMax[b + 1]) * rightCount[b + 1]) / area;
+
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = b;
+
+				overlapMin = Vec3(fmaxf(accumMin.x, rightMin[b + 1].x),
+					fmaxf(accumMin.y, rightMin[b + 1].y), fmaxf(accumMin.z, rightMin[b + 1].z));
+				overlapMax = Vec3(fminf(accumMax.x, rightMax[b + 1].x),
+					fminf(accumMax.y, rightMax[b + 1].y), fminf(accumMax.z, rightMax[b + 1].z));
+			}
+		}
+	}
+
+	// Spatial split, only tried when the object split children overlap
+	// noticeably and the duplicate reference budget is not used up
+	float spatialPlane = 0.0f;
+	bool trySpatial = bestAxis >= 0 && builder.numReferences < builder.maxReferences &&
+		SurfaceArea(overlapMin, overlapMax) / builder.rootArea > SBVH_OVERLAP_THRESHOLD;
+
+	for (int axis = 0; axis < 3 && trySpatial; ++axis)
+	{
+		float lo = min.asArray[axis];
+		float extent = max.asArray[axis] - lo;
+		if (extent <= 0.0f)
+		{
+			continue;
+		}
+
+		float binSize = extent / SBVH_BINS;
+
+		for (int b = 0; b < SBVH_BINS; ++b)
+		{
+			ResetBin(bins[b]);
+		}
+
+		for (int i = 0; i < count; ++i)
+		{
+			const SpatialReference& reference = references[i];
+			const Triangle& triangle = builder.mesh->triangles[reference.triangle];
+
+			int first = (int)((reference.min.asArray[axis] - lo) / binSize);
+			int last = (int)((reference.max.asArray[axis] - lo) / binSize);
+			first = first < 0 ? 0 : (first >= SBVH_BINS ? SBVH_BINS - 1 : first);
+			last = last < first ? first : (last >= SBVH_BINS ? SBVH_BINS - 1 : last);
+
+			bins[first].entries += 1;
+			bins[last].exits += 1;
+
+			for (int b = first; b <= last; ++b)
+			{
+				Vec3 clipMin, clipMax;
+				if (ClipReference(triangle, reference, axis, lo + binSize * b,
+					lo + binSize * (b + 1), clipMin, clipMax))
+				{
+					GrowBounds(bins[b].min, bins[b].max, clipMin, clipMax);
+				}
+			}
+		}
+
+		Vec3 rightMin[SBVH_BINS], rightMax[SBVH_BINS];
+		int rightCount[SBVH_BINS];
+		Vec3 accumMin(FLT_MAX, FLT_MAX, FLT_MAX), accumMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		int accumCount = 0;
+
+		for (int b = SBVH_BINS - 1; b > 0; --b)
+		{
+			GrowBounds(accumMin, accumMax, bins[b].min, bins[b].max);
+			accumCount += bins[b].exits;
+			rightMin[b] = accumMin;
+			rightMax[b] = accumMax;
+			rightCount[b] = accumCount;
+		}
+
+		accumMin = Vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+		accumMax = Vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		accumCount = 0;
+
+		for (int b = 0; b < SBVH_BINS - 1; ++b)
+		{
+			GrowBounds(accumMin, accumMax, bins[b].min, bins[b].max);
+			accumCount += bins[b].entries;
+
+			if (accumCount == 0 || rightCount[b + 1] == 0 ||
+				builder.numReferences + accumCount + rightCount[b + 1] - count > builder.maxReferences)
+			{
+				continue;
+			}
+
+			float cost = 1.0f + (SurfaceArea(accumMin, accumMax) * accumCount +
+				SurfaceArea(rightMin[b + 1], rightMax[b + 1]) * rightCount[b + 1]) / area;
+
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = b;
+				spatial = true;
+				spatialPlane = lo + binSize * (b + 1);
+			}
+		}
+	}
+
+	if (bestAxis < 0 || (bestCost >= leafCost && count <= SBVH_LEAF_SIZE * 4))
+	{
+		builder.nodes[index].first = builder.leafTriangles.size();
+		builder.nodes[index].count = count;
+
+		for (int i = 0; i < count; ++i)
+		{
+			builder.leafTriangles.push_back(references[i].triangle);
+		}
+
+		return index;
+	}
+
+	std::vector<SpatialReference> left;
+	std::vector<SpatialReference> right;
+
+	if (spatial)
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			const SpatialReference& reference = references[i];
+
+			if (reference.max.asArray[bestAxis] <= spatialPlane)
+			{
+				left.push_back(reference);
+				continue;
+			}
+			if (reference.min.asArray[bestAxis] >= spatialPlane)
+			{
+				right.push_back(reference);
+				continue;
+			}
+
+			const Triangle& triangle = builder.mesh->triangles[reference.triangle];
+			SpatialReference part = reference;
+			if (ClipReference(triangle, reference, bestAxis, -FLT_MAX, spatialPlane, part.min, part.max))
+			{
+				left.push_back(part);
+			}
+			part = reference;
+			if (ClipReference(triangle, reference, bestAxis, spatialPlane, FLT_MAX, part.min, part.max))
+			{
+				right.push_back(part);
+			}
+		}
+
+		builder.numReferences += left.size() + right.size() - count;
+	}
+	else
+	{
+		float lo = centroidMin.asArray[bestAxis];
+		float extent = centroidMax.asArray[bestAxis] - lo;
+
+		for (int i = 0; i < count; ++i)
+		{
+			float centroid = (references[i].min.asArray[bestAxis] + references[i].max.asArray[bestAxis]) * 0.5f;
+			int b = (int)((centroid - lo) / extent * SBVH_BINS);
+			b = b < 0 ? 0 : (b >= SBVH_BINS ? SBVH_BINS - 1 : b);
+
+			if (b <= bestSplit)
+			{
+				left.push_back(references[i]);
+			}
+			else
+			{
+				right.push_back(references[i]);
+			}
+		}
+	}
+
+	references.clear();
+	references.shrink_to_fit();
+
+	int leftChild = BuildSpatialNode(builder, left, depth + 1);
+	int rightChild = BuildSpatialNode(builder, right, depth + 1);
+	builder.nodes[index].children[0] = leftChild;
+	builder.nodes[index].children[1] = rightChild;
+
+	return index;
+}
+
+static void EmitSpatialNode(const SpatialBVHBuilder& builder, int index, BVHNode* out)
+{
+	const SpatialNode& node = builder.nodes[index];
+	out->bounds = FromMinMax(node.min, node.max);
+
+	if (node.children[0] < 0)
+	{
+		out->numTriangles = node.count;
+		out->triangles = new int[node.count];
+
+		for (int i = 0; i < node.count; ++i)
+		{
+			out->triangles[i] = builder.leafTriangles[node.first + i];
+		}
+
+		return;
+	}
+
+	// Collapse binary levels until the eight slots are used
+	std::vector<int> items;
+	items.push_back(node.children[0]);
+	items.push_back(node.children[1]);
+
+	while (items.size() < 8)
+	{
+		int best = -1;
+		float bestArea = -1.0f;
+
+		for (int i = 0, size = items.size(); i < size; ++i)
+		{
+			const SpatialNode& item = builder.nodes[items[i]];
+			float area = SurfaceArea(item.min, item.max);
+
+			if (item.children[0] >= 0 && area > bestArea)
+			{
+				best = i;
+				bestArea = area;
+			}
+		}
+
+		if (best < 0)
+		{
+			break;
+		}
+
+		const SpatialNode& item = builder.nodes[items[best]];
+		items[best] = item.children[0];
+		items.push_back(item.children[1]);
+	}
+
+	out->children = new BVHNode[8];
+
+	for (int i = 0; i < 8; ++i)
+	{
+		if (i < (int)items.size())
+		{
+			EmitSpatialNode(builder, items[i], &out->children[i]);
+		}
+		else
+		{
+			out->children[i].bounds = AABB(out->bounds.position, Vec3());
+		}
+	}
+}
+
+void AccelarateMeshSBVH(Mesh& mesh, float maxDuplication)
+{
+	if (mesh.accelerator != 0 || mesh.numTriangles <= 0)
+	{
+		return;
+	}
+
+	SpatialBVHBuilder builder;
+	builder.mesh = &mesh;
+	builder.numReferences = mesh.numTriangles;
+	builder.maxReferences = mesh.numTriangles + (int)(mesh.numTriangles * fmaxf(maxDuplication, 0.0f));
+
+	std::vector<SpatialReference> references(mesh.numTriangles);
+	Vec3 min = mesh.vertices[0];
+	Vec3 max = mesh.vertices[0];
+
+	for (int i = 0; i < mesh.numTriangles; ++i)
+	{
+		references[i].triangle = i;
+		GetTriangleMinMax(mesh.triangles[i], references[i].min, references[i].max);
+		GrowBounds(min, max, references[i].min, references[i].max);
+	}
+
+	builder.rootArea = SurfaceArea(min, max);
+	if (builder.rootArea <= 0.0f)
+	{
+		builder.rootArea = 1.0f;
+	}
+
+	BuildSpatialNode(builder, references, 0);
+
+	mesh.accelerator = new BVHNode();
+	EmitSpatialNode(builder, 0, mesh.accelerator);
+	mesh.acceleratorCost = BVHCost(mesh);
+}
+
+static void MoveBVHNode(BVHNode* to, BVHNode* from)
+{
+	to->bounds = from->bounds;
+	to->children = from->children;
+	to->numTriangles = from->numTriangles;
+	to->triangles = from->triangles;
+	to->pendingDepth.store(from->pendingDepth.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+	from->children = 0;
+	from->numTriangles = 0;
+	from->triangles = 0;
+	from->pendingDepth.store(0, std::memory_order_relaxed);
+}
+
+// Pulls grandchildren up into free child slots. Only inner nodes are
+// removed, the tree is not rearranged.
+void FlattenBVHNodes(BVHNode* node)
+{
+	if (node->children == 0)
+	{
+		return;
+	}
+
+	// Dissolve the largest child whose children fit in the free slots,
+	// every removed inner node takes its area out of the SAH cost
+	while (true)
+	{
+		int numFree = 0;
+		for (int i = 0; i < 8; ++i)
+		{
+			numFree += IsEmptyBVHNode(&node->children[i]) ? 1 : 0;
+		}
+
+		int best = -1;
+		float bestArea = -1.0f;
+
+		for (int i = 0; i < 8; ++i)
+		{
+			BVHNode* child = &node->children[i];
+			if (child->children == 0 || IsEmptyBVHNode(child))
+			{
+				continue;
+			}
+
+			int numOccupied = 0;
+			for (int j = 0; j < 8; ++j)
+			{
+				numOccupied += IsEmptyBVHNode(&child->children[j]) ? 0 : 1;
+			}
+
+			float area = SurfaceArea(child->bounds);
+			if (numOccupied <= numFree + 1 && area > bestArea)
+			{
+				best = i;
+				bestArea = area;
+			}
+		}
+
+		if (best < 0)
+		{
+			break;
+		}
+
+		BVHNode* grandChildren = node->children[best].children;
+		node->children[best].children = 0;
+		node->children[best].bounds = AABB(node->bounds.position, Vec3());
+
+		int slot = 0;
+		for (int j = 0; j < 8; ++j)
+		{
+			if (IsEmptyBVHNode(&grandChildren[j]))
+			{
+				continue;
+			}
+
+			while (!IsEmptyBVHNode(&node->children[slot]))
+			{
+				++slot;
+			}
+
+			MoveBVHNode(&node->children[slot], &grandChildren[j]);
+		}
+
+		delete[] grandChildren;
+	}
+
+	for (int i = 0; i < 8; ++i)
+	{
+		FlattenBVHNodes(&node->children[i]);
+	}
+}
+
+struct WideBVHBuilder
+{
+	int width;
+	std::vector<float> bounds;
+	std::vector<int> children;
+	std::vector<int> counts;
+	std::vector<int> numChildren;
+	std::vector<int> triangles;
+	int stackSize;
+};
+
+static void GetGroupBounds(const std::vector<const BVHNode*>& items, int first, int last, Vec3& outMin, Vec3& outMax)
+{
+	outMin = GetMin(items[first]->bounds);
+	outMax = GetMax(items[first]->bounds);
+
+	for (int i = first + 1; i < last; ++i)
+	{
+		Vec3 min = GetMin(items[i]->bounds);
+		Vec3 max = GetMax(items[i]->bounds);
+
+		outMin.x = fminf(min.x, outMin.x);
+		outMin.y = fminf(min.y, outMin.y);
+		outMin.z = fminf(min.z, outMin.z);
+		outMax.x = fmaxf(max.x, outMax.x);
+		outMax.y = fmaxf(max.y, outMax.y);
+		outMax.z = fmaxf(max.z, outMax.z);
+	}
+}
+
+static int BuildWideNode(WideBVHBuilder& builder, std::vector<const BVHNode*> items, int stackDepth)
+{
+	int width = builder.width;
+
+	// Pull grandchildren up into free slots, largest boxes first
+	while ((int)items.size() < width)
+	{
+		int best = -1;
+		float bestArea = -1.0f;
+		std::vector<const BVHNode*> bestChildren;
+
+		for (int i = 0, size = items.size(); i < size; ++i)
+		{
+			if (items[i]->children == 0)
+			{
+				continue;
+			}
+
+			std::vector<const BVHNode*> grandChildren;
+			GetNonEmptyChildren(items[i], grandChildren);
+
+			float area = SurfaceArea(items[i]->bounds);
+			bool fits = (int)(items.size() + grandChildren.size()) - 1 <= width;
+			if ((fits || items.size() == 1) && area > bestArea)
+			{
+				best = i;
+				bestArea = area;
+				bestChildren = grandChildren;
+			}
+		}
+
+		if (best < 0)
+		{
+			break;
+		}
+
+		items.erase(items.begin() + best);
+		items.insert(items.end(), bestChildren.begin(), bestChildren.end());
+	}
+
+	int node = builder.numChildren.size();
+	builder.bounds.resize(builder.bounds.size() + 6 * width, 0.0f);
+	builder.children.resize(builder.children.size() + width, -1);
+	builder.counts.resize(builder.counts.size() + width, 0);
+	builder.numChildren.push_back(0);
+
+	int numSlots = (int)items.size() < width ? (int)items.size() : width;
+	builder.numChildren[node] = numSlots;
+
+	if (stackDepth + numSlots > builder.stackSize)
+	{
+		builder.stackSize = stackDepth + numSlots;
+	}
+
+	// Too many children for one node, group them along the widest axis
+	if ((int)items.size() > width)
+	{
+		Vec3 min, max;
+		GetGroupBounds(items, 0, items.size(), min, max);
+		Vec3 extent = max - min;
+		int axis = 0;
+		if (extent.y > extent.x && extent.y >= extent.z) axis = 1;
+		if (extent.z > extent.x && extent.z > extent.y) axis = 2;
+
+		for (int i = 1, size = items.size(); i < size; ++i)
+		{
+			for (int j = i; j > 0 && items[j]->bounds.position.asArray[axis] <
+				items[j - 1]->bounds.position.asArray[axis]; --j)
+			{
+				const BVHNode* swap = items[j];
+				items[j] = items[j - 1];
+				items[j - 1] = swap;
+			}
+		}
+	}
+
+	for (int slot = 0; slot < numSlots; ++slot)
+	{
+		int first = (slot * items.size()) / numSlots;
+		int last = ((slot + 1) * items.size()) / numSlots;
+
+		Vec3 min, max;
+		GetGroupBounds(items, first, last, min, max);
+
+		float* bounds = &builder.bounds[node * 6 * width];
+		bounds[0 * width + slot] = min.x;
+		bounds[1 * width + slot] = min.y;
+		bounds[2 * width + slot] = min.z;
+		bounds[3 * width + slot] = max.x;
+		bounds[4 * width + slot] = max.y;
+		bounds[5 * width + slot] = max.z;
+
+		int child = 0;
+		if (last - first > 1)
+		{
+			std::vector<const BVHNode*> group(items.begin() + first, items.begin() + last);
+			child = BuildWideNode(builder, group, stackDepth + numSlots - 1);
+		}
+		else if (items[first]->children != 0)
+		{
+			std::vector<const BVHNode*> grandChildren;
+			GetNonEmptyChildren(items[first], grandChildren);
+			child = BuildWideNode(builder, grandChildren, stackDepth + numSlots - 1);
+		}
+		else
+		{
+			child = -(int)builder.triangles.size() - 1;
+			builder.counts[node * width + slot] = items[first]->numTriangles;
+			builder.triangles.insert(builder.triangles.end(), items[first]->triangles,
+				items[first]->triangles + items[first]->numTriangles);
+		}
+
+		builder.children[node * width + slot] = child;
+	}
+
+	return node;
+}
+
+bool CollapseBVH(Mesh& mesh, int width)
+{
+	if (mesh.accelerator == 0 || mesh.wideAccelerator != 0)
+	{
+		return false;
+	}
+
+	if (width != 4 && width != 8)
+	{
+		return false;
+	}
+
+	SplitAllPendingBVHNodes(mesh.accelerator, mesh);
+
+	WideBVHBuilder builder;
+	builder.width = width;
+	builder.stackSize = 0;
+
+	std::vector<const BVHNode*> root;
+	if (!IsEmptyBVHNode(mesh.accelerator))
+	{
+		root.push_back(mesh.accelerator);
+	}
+	BuildWideNode(builder, root, 0);
+
+	if (builder.stackSize > WIDE_BVH_STACK_SIZE)
+	{
+		return false;
+	}
+
+	WideBVH* bvh = new WideBVH();
+	bvh->width = width;
+	bvh->numNodes = builder.numChildren.size();
+	bvh->bounds = new float[builder.bounds.size()];
+	bvh->children = new int[builder.children.size()];
+	bvh->counts = new int[builder.counts.size()];
+	bvh->numChildren = new int[builder.numChildren.size()];
+	bvh->triangles = new int[builder.triangles.size() + 1];
+
+	std::copy(builder.bounds.begin(), builder.bounds.end(), bvh->bounds);
+	std::copy(builder.children.begin(), builder.children.end(), bvh->children);
+	std::copy(builder.counts.begin(), builder.counts.end(), bvh->counts);
+	std::copy(builder.numChildren.begin(), builder.numChildren.end(), bvh->numChildren);
+	std::copy(builder.triangles.begin(), builder.triangles.end(), bvh->triangles);
+
+	mesh.wideAccelerator = bvh;
+	// RefitMesh compares against the tree the queries use from now on
+	mesh.acceleratorCost = BVHCost(mesh);
+	return true;
+}
+
+void FreeWideBVH(WideBVH* bvh)
+{
+	delete[] bvh->bounds;
+	delete[] bvh->children;
+	delete[] bvh->counts;
+	delete[] bvh->numChildren;
+	delete[] bvh->triangles;
+
+	bvh->bounds = 0;
+	bvh->children = 0;
+	bvh->counts = 0;
+	bvh->numChildren = 0;
+	bvh->triangles = 0;
+	bvh->numNodes = 0;
+}
+
+static int WideRayMask(const float* bounds, int width, const Vec3& origin,
+	const Vec3& invDir, float tMax, float* outEntry)
+{
+	int mask = 0;
+
+#ifdef WIDE_BVH_SSE
+	__m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+	__m128 ix = _mm_set1_ps(invDir.x), iy = _mm_set1_ps(invDir.y), iz = _mm_set1_ps(invDir.z);
+	__m128 zero = _mm_setzero_ps(), limit = _mm_set1_ps(tMax);
+
+	for (int lane = 0; lane < width; lane += 4)
+	{
+		__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds + 0 * width + lane), ox), ix);
+		__m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds + 3 * width + lane), ox), ix);
+		__m128 enter = _mm_max_ps(zero, _mm_min_ps(t1, t2));
+		__m128 leave = _mm_min_ps(limit, _mm_max_ps(t1, t2));
+
+		t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds + 1 * width + lane), oy), iy);
+		t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds + 4 * width + lane), oy), iy);
+		enter = _mm_max_ps(enter, _mm_min_ps(t1, t2));
+		leave = _mm_min_ps(leave, _mm_max_ps(t1, t2));
+
+		t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds + 2 * width + lane), oz), iz);
+		t2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(bounds + 5 * width + lane), oz), iz);
+		enter = _mm_max_ps(enter, _mm_min_ps(t1, t2));
+		leave = _mm_min_ps(leave, _mm_max_ps(t1, t2));
+
+		_mm_storeu_ps(outEntry + lane, enter);
+		mask |= _mm_movemask_ps(_mm_cmple_ps(enter, leave)) << lane;
+	}
+#else
+	const float* o = origin.asArray;
+	const float* inv = invDir.asArray;
+
+	for (int lane = 0; lane < width; ++lane)
+	{
+		float enter = 0.0f;
+		float leave = tMax;
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float t1 = (bounds[axis * width + lane] - o[axis]) * inv[axis];
+			float t2 = (bounds[(axis + 3) * width + lane] - o[axis]) * inv[axis];
+			enter = fmaxf(enter, fminf(t1, t2));
+			leave = fminf(leave, fmaxf(t1, t2));
+		}
+
+		outEntry[lane] = enter;
+		mask |= (enter <= leave) << lane;
+	}
+#endif
+
+	return mask;
+}
+
+static int WideOverlapMask(const float* bounds, int width, const Vec3& min, const Vec3& max)
+{
+	int mask = 0;
+
+#ifdef WIDE_BVH_SSE
+	__m128 minX = _mm_set1_ps(min.x), minY = _mm_set1_ps(min.y), minZ = _mm_set1_ps(min.z);
+	__m128 maxX = _mm_set1_ps(max.x), maxY = _mm_set1_ps(max.y), maxZ = _mm_set1_ps(max.z);
+
+	for (int lane = 0; lane < width; lane += 4)
+	{
+		__m128 overlap = _mm_and_ps(
+			_mm_cmple_ps(_mm_loadu_ps(bounds + 0 * width + lane), maxX),
+			_mm_cmpge_ps(_mm_loadu_ps(bounds + 3 * width + lane), minX));
+		overlap = _mm_and_ps(overlap, _mm_and_ps(
+			_mm_cmple_ps(_mm_loadu_ps(bounds + 1 * width + lane), maxY),
+			_mm_cmpge_ps(_mm_loadu_ps(bounds + 4 * width + lane), minY)));
+		overlap = _mm_and_ps(overlap, _mm_and_ps(
+			_mm_cmple_ps(_mm_loadu_ps(bounds + 2 * width + lane), maxZ),
+			_mm_cmpge_ps(_mm_loadu_ps(bounds + 5 * width + lane), minZ)));
+
+		mask |= _mm_movemask_ps(overlap) << lane;
+	}
+#else
+	for (int lane = 0; lane < width; ++lane)
+	{
+		bool overlap =
+			bounds[0 * width + lane] <= max.x && bounds[3 * width + lane] >= min.x &&
+			bounds[1 * width + lane] <= max.y && bounds[4 * width + lane] >= min.y &&
+			bounds[2 * width + lane] <= max.z && bounds[5 * width + lane] >= min.z;
+
+		mask |= overlap << lane;
+	}
+#endif
+
+	return mask;
+}
+
+static int WideSphereMask(const float* bounds, int width, const Sphere& sphere)
+{
+	int mask = 0;
+
+#ifdef WIDE_BVH_SSE
+	__m128 px = _mm_set1_ps(sphere.position.x);
+	__m128 py = _mm_set1_ps(sphere.position.y);
+	__m128 pz = _mm_set1_ps(sphere.position.z);
+	__m128 radiusSq = _mm_set1_ps(sphere.radius * sphere.radius);
+
+	for (int lane = 0; lane < width; lane += 4)
+	{
+		__m128 dx = _mm_sub_ps(px, _mm_min_ps(_mm_max_ps(px,
+			_mm_loadu_ps(bounds + 0 * width + lane)), _mm_loadu_ps(bounds + 3 * width + lane)));
+		__m128 dy = _mm_sub_ps(py, _mm_min_ps(_mm_max_ps(py,
+			_mm_loadu_ps(bounds + 1 * width + lane)), _mm_loadu_ps(bounds + 4 * width + lane)));
+		__m128 dz = _mm_sub_ps(pz, _mm_min_ps(_mm_max_ps(pz,
+			_mm_loadu_ps(bounds + 2 * width + lane)), _mm_loadu_ps(bounds + 5 * width + lane)));
+		__m128 distSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+		mask |= _mm_movemask_ps(_mm_cmple_ps(distSq, radiusSq)) << lane;
+	}
+#else
+	const float* p = sphere.position.asArray;
+
+	for (int lane = 0; lane < width; ++lane)
+	{
+		float distSq = 0.0f;
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float closest = fminf(fmaxf(p[axis], bounds[axis * width + lane]),
+				bounds[(axis + 3) * width + lane]);
+			distSq += (p[axis] - closest) * (p[axis] - closest);
+		}
+
+		mask |= (distSq <= sphere.radius * sphere.radius) << lane;
+	}
+#endif
+
+	return mask;
+}
+
+static void Quantize(float min, float max, float origin, float scale, int maxValue,
+	int* outMin, int* outMax)
+{
+	if (scale <= 0.0f)
+	{
+		*outMin = 0;
+		*outMax = 0;
+		return;
+	}
+
+	// Round outwards, then nudge until the decoded box contains the original
+	int qMin = (int)floorf((min - origin) / scale);
+	int qMax = (int)ceilf((max - origin) / scale);
+	qMin = qMin < 0 ? 0 : (qMin > maxValue ? maxValue : qMin);
+	qMax = qMax < 0 ? 0 : (qMax > maxValue ? maxValue : qMax);
+
+	while (qMin > 0 && origin + (float)qMin * scale > min)
+	{
+		--qMin;
+	}
+	while (qMax < maxValue && origin + (float)qMax * scale < max)
+	{
+		++qMax;
+	}
+
+	*outMin = qMin;
+	*outMax = qMax;
+}
+
+// Stores the child bounds of a node, given as six rows of width floats,
+// relative to the box around all of them
+static void QuantizeCompressedNode(CompressedBVH* bvh, int node, const float* bounds, int numChildren)
+{
+	int width = bvh->width;
+	int maxValue = (1 << bvh->bits) - 1;
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float lo = numChildren > 0 ? bounds[axis * width] : 0.0f;
+		float hi = numChildren > 0 ? bounds[(axis + 3) * width] : 0.0f;
+
+		for (int slot = 1; slot < numChildren; ++slot)
+		{
+			lo = fminf(lo, bounds[axis * width + slot]);
+			hi = fmaxf(hi, bounds[(axis + 3) * width + slot]);
+		}
+
+		float origin = lo;
+		float scale = (hi - lo) / (float)maxValue;
+		if (scale > 0.0f)
+		{
+			scale *= 1.0f + 4.0f * FLT_EPSILON;
+		}
+
+		bvh->origins[node * 3 + axis] = origin;
+		bvh->scales[node * 3 + axis] = scale;
+
+		for (int slot = 0; slot < width; ++slot)
+		{
+			int qMin = 0;
+			int qMax = 0;
+			if (slot < numChildren)
+			{
+				Quantize(bounds[axis * width + slot], bounds[(axis + 3) * width + slot],
+					origin, scale, maxValue, &qMin, &qMax);
+			}
+
+			int index = (node * 6 + axis) * width + slot;
+			int indexMax = (node * 6 + axis + 3) * width + slot;
+			if (bvh->bits == 8)
+			{
+				bvh->bounds8[index] = (unsigned char)qMin;
+				bvh->bounds8[indexMax] = (unsigned char)qMax;
+			}
+			else
+			{
+				bvh->bounds16[index] = (unsigned short)qMin;
+				bvh->bounds16[indexMax] = (unsigned short)qMax;
+			}
+		}
+	}
+}
+
+bool CompressBVH(Mesh& mesh, int bits)
+{
+	if (mesh.compressedAccelerator != 0 || (bits != 8 && bits != 16))
+	{
+		return false;
+	}
+
+	if (mesh.wideAccelerator == 0 && !CollapseBVH(mesh, 8))
+	{
+		return false;
+	}
+
+	const WideBVH* wide = mesh.wideAccelerator;
+	int width = wide->width;
+
+	for (int i = 0, size = wide->numNodes * width; i < size; ++i)
+	{
+		if (wide->counts[i] > 0xFFFF)
+		{
+			return false;
+		}
+	}
+
+	CompressedBVH* bvh = new CompressedBVH();
+	bvh->width = width;
+	bvh->bits = bits;
+	bvh->numNodes = wide->numNodes;
+	bvh->origins = new float[wide->numNodes * 3];
+	bvh->scales = new float[wide->numNodes * 3];
+	if (bits == 8)
+	{
+		bvh->bounds8 = new unsigned char[wide->numNodes * 6 * width];
+	}
+	else
+	{
+		bvh->bounds16 = new unsigned short[wide->numNodes * 6 * width];
+	}
+	bvh->children = new unsigned int[wide->numNodes * width];
+	bvh->counts = new unsigned short[wide->numNodes * width];
+	bvh->numChildren = new unsigned char[wide->numNodes];
+
+	for (int node = 0; node < wide->numNodes; ++node)
+	{
+		int numChildren = wide->numChildren[node];
+		bvh->numChildren[node] = (unsigned char)numChildren;
+		QuantizeCompressedNode(bvh, node, wide->bounds + node * 6 * width, numChildren);
+
+		for (int slot = 0; slot < width; ++slot)
+		{
+			int child = wide->children[node * width + slot];
+			int count = wide->counts[node * width + slot];
+
+			bvh->children[node * width + slot] = child >= 0 ? (unsigned int)child :
+				((unsigned int)(-child - 1) | COMPRESSED_BVH_LEAF);
+			bvh->counts[node * width + slot] = (unsigned short)count;
+		}
+	}
+
+	// The compressed nodes replace the wide ones, take over its triangle list
+	bvh->triangles = wide->triangles;
+	mesh.wideAccelerator->triangles = 0;
+	FreeWideBVH(mesh.wideAccelerator);
+	delete mesh.wideAccelerator;
+	mesh.wideAccelerator = 0;
+
+	// Every mesh query has a compressed path, so the pointer tree is released
+	// too. ComputeStats, BVHCost and RefitMesh describe the compressed nodes
+	if (mesh.accelerator != 0)
+	{
+		FreeBVHNode(mesh.accelerator);
+		delete mesh.accelerator;
+		mesh.accelerator = 0;
+	}
+
+	mesh.compressedAccelerator = bvh;
+	mesh.acceleratorCost = BVHCost(mesh);
+	return true;
+}
+
+void FreeCompressedBVH(CompressedBVH* bvh)
+{
+	delete[] bvh->origins;
+	delete[] bvh->scales;
+	delete[] bvh->bounds8;
+	delete[] bvh->bounds16;
+	delete[] bvh->children;
+	delete[] bvh->counts;
+	delete[] bvh->numChildren;
+	delete[] bvh->triangles;
+
+	bvh->origins = 0;
+	bvh->scales = 0;
+	bvh->bounds8 = 0;
+	bvh->bounds16 = 0;
+	bvh->children = 0;
+	bvh->counts = 0;
+	bvh->numChildren = 0;
+	bvh->triangles = 0;
+	bvh->numNodes = 0;
+}
+
+static const float* DecodeCompressedNode(const CompressedBVH* bvh, int node, float* outBounds)
+{
+	int width = bvh->width;
+	const float* origins = bvh->origins + node * 3;
+	const float* scales = bvh->scales + node * 3;
+
+	for (int row = 0; row < 6; ++row)
+	{
+		float origin = origins[row % 3];
+		float scale = scales[row % 3];
+		float* out = outBounds + row * width;
+		int offset = (node * 6 + row) * width;
+
+#ifdef WIDE_BVH_SSE
+		__m128i zero = _mm_setzero_si128();
+		__m128 o = _mm_set1_ps(origin);
+		__m128 s = _mm_set1_ps(scale);
+
+		for (int lane = 0; lane < width; lane += 4)
+		{
+			__m128i q;
+			if (bvh->bits == 8)
+			{
+				int packed;
+				memcpy(&packed, bvh->bounds8 + offset + lane, sizeof(int));
+				q = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+			}
+			else
+			{
+				q = _mm_loadl_epi64((const __m128i*)(bvh->bounds16 + offset + lane));
+			}
+			q = _mm_unpacklo_epi16(q, zero);
+
+			_mm_storeu_ps(out + lane, _mm_add_ps(o, _mm_mul_ps(_mm_cvtepi32_ps(q), s)));
+		}
+#else
+		for (int lane = 0; lane < width; ++lane)
+		{
+			int q = bvh->bits == 8 ? bvh->bounds8[offset + lane] : bvh->bounds16[offset + lane];
+			out[lane] = origin + (float)q * scale;
+		}
+#endif
+	}
+
+	return outBounds;
+}
+
+struct WideNodes
+{
+	const WideBVH* bvh;
+	int width;
+	WideNodes(const WideBVH* b) : bvh(b), width(b->width) { }
+	const float* Bounds(int node, float*) const { return bvh->bounds + node * 6 * width; }
+	int NumChildren(int node) const { return bvh->numChildren[node]; }
+	int Child(int node, int slot) const { return bvh->children[node * width + slot]; }
+	int Count(int node, int slot) const { return bvh->counts[node * width + slot]; }
+	const int* Triangles() const { return bvh->triangles; }
+};
+
+struct CompressedNodes
+{
+	const CompressedBVH* bvh;
+	int width;
+	CompressedNodes(const CompressedBVH* b) : bvh(b), width(b->width) { }
+	const float* Bounds(int node, float* scratch) const { return DecodeCompressedNode(bvh, node, scratch); }
+	int NumChildren(int node) const { return bvh->numChildren[node]; }
+	int Child(int node, int slot) const
+	{
+		unsigned int child = bvh->children[node * width + slot];
+		return (child & COMPRESSED_BVH_LEAF) ? -(int)(child & ~COMPRESSED_BVH_LEAF) - 1 : (int)child;
+	}
+	int Count(int node, int slot) const { return bvh->counts[node * width + slot]; }
+	const int* Triangles() const { return bvh->triangles; }
+};
+
+// Recomputes every child box from the triangles, bottom up. Children
+// always come after their parent, so walking the nodes backwards visits
+// them first. store(node, bounds, numChildren) receives the six rows of
+// child bounds of a node.
+template <typename Nodes, typename Store>
+static void RefitWideNodes(const Mesh& mesh, const Nodes& nodes, int numNodes, Store& store)
+{
+	int width = nodes.width;
+	std::vector<float> nodeBounds(numNodes * 6, 0.0f);
+	float bounds[6 * 8];
+
+	for (int node = numNodes - 1; node >= 0; --node)
+	{
+		float* box = &nodeBounds[node * 6];
+
+		for (int slot = 0, numChildren = nodes.NumChildren(node); slot < numChildren; ++slot)
+		{
+			int child = nodes.Child(node, slot);
+			float slotBox[6];
+
+			if (child >= 0)
+			{
+				std::copy(&nodeBounds[child * 6], &nodeBounds[child * 6] + 6, slotBox);
+			}
+			else
+			{
+				const int* triangles = nodes.Triangles() + (-child - 1);
+				Vec3 min, max;
+				GetTriangleMinMax(mesh.triangles[triangles[0]], min, max);
+
+				for (int i = 1, count = nodes.Count(node, slot); i < count; ++i)
+				{
+					Vec3 triMin, triMax;
+					GetTriangleMinMax(mesh.triangles[triangles[i]], triMin, triMax);
+					min = Vec3(fminf(min.x, triMin.x), fminf(min.y, triMin.y), fminf(min.z, triMin.z));
+					max = Vec3(fmaxf(max.x, triMax.x), fmaxf(max.y, triMax.y), fmaxf(max.z, triMax.z));
+				}
+
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					slotBox[axis] = min.asArray[axis];
+					slotBox[axis + 3] = max.asArray[axis];
+				}
+			}
+
+			for (int row = 0; row < 6; ++row)
+			{
+				bounds[row * width + slot] = slotBox[row];
+			}
+
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				box[axis] = slot == 0 ? slotBox[axis] : fminf(box[axis], slotBox[axis]);
+				box[axis + 3] = slot == 0 ? slotBox[axis + 3] : fmaxf(box[axis + 3], slotBox[axis + 3]);
+			}
+		}
+
+		store(node, bounds, nodes.NumChildren(node));
+	}
+}
+
+struct WideRefitStore
+{
+	WideBVH* bvh;
+	WideRefitStore(WideBVH* b) : bvh(b) { }
+	void operator()(int node, const float* bounds, int numChildren)
+	{
+		int width = bvh->width;
+		float* out = bvh->bounds + node * 6 * width;
+
+		for (int row = 0; row < 6; ++row)
+		{
+			std::copy(bounds + row * width, bounds + row * width + numChildren, out + row * width);
+		}
+	}
+};
+
+struct CompressedRefitStore
+{
+	CompressedBVH* bvh;
+	CompressedRefitStore(CompressedBVH* b) : bvh(b) { }
+	void operator()(int node, const float* bounds, int numChildren)
+	{
+		QuantizeCompressedNode(bvh, node, bounds, numChildren);
+	}
+};
+
+static void RefitWideBVH(WideBVH* bvh, const Mesh& mesh)
+{
+	WideRefitStore store(bvh);
+	RefitWideNodes(mesh, WideNodes(bvh), bvh->numNodes, store);
+}
+
+static void RefitCompressedBVH(CompressedBVH* bvh, const Mesh& mesh)
+{
+	CompressedRefitStore store(bvh);
+	RefitWideNodes(mesh, CompressedNodes(bvh), bvh->numNodes, store);
+}
+
+// The pointer tree's SAH cost over the same boxes: every node's box once,
+// every leaf's box once per triangle, relative to the root's box
+template <typename Nodes>
+static float WideBVHCost(const Nodes& nodes, int numNodes)
+{
+	int width = nodes.width;
+	float scratch[6 * 8];
+	float cost = 0.0f;
+	Vec3 rootMin, rootMax;
+
+	for (int node = 0; node < numNodes; ++node)
+	{
+		const float* bounds = nodes.Bounds(node, scratch);
+
+		for (int slot = 0, numChildren = nodes.NumChildren(node); slot < numChildren; ++slot)
+		{
+			Vec3 min(bounds[0 * width + slot], bounds[1 * width + slot], bounds[2 * width + slot]);
+			Vec3 max(bounds[3 * width + slot], bounds[4 * width + slot], bounds[5 * width + slot]);
+			int child = nodes.Child(node, slot);
+
+			cost += SurfaceArea(min, max) * (child >= 0 ? 1.0f : (float)nodes.Count(node, slot));
+
+			if (node == 0)
+			{
+				rootMin = slot == 0 ? min : Vec3(fminf(rootMin.x, min.x), fminf(rootMin.y, min.y), fminf(rootMin.z, min.z));
+				rootMax = slot == 0 ? max : Vec3(fmaxf(rootMax.x, max.x), fmaxf(rootMax.y, max.y), fmaxf(rootMax.z, max.z));
+			}
+		}
+	}
+
+	if (numNodes == 0 || nodes.NumChildren(0) == 0)
+	{
+		return 0.0f;
+	}
+
+	float rootArea = SurfaceArea(rootMin, rootMax);
+	if (rootArea <= 0.0f)
+	{
+		return 0.0f;
+	}
+
+	return (cost + rootArea) / rootArea;
+}
+
+static float FlatBVHCost(const Mesh& mesh)
+{
+	if (mesh.compressedAccelerator != 0)
+	{
+		return WideBVHCost(CompressedNodes(mesh.compressedAccelerator), mesh.compressedAccelerator->numNodes);
+	}
+
+	return WideBVHCost(WideNodes(mesh.wideAccelerator), mesh.wideAccelerator->numNodes);
+}
+
+// Leaf slots count as nodes of their own, like the leaves of the pointer
+// tree. Children come after their parent, so a node's depth and its box in
+// the parent are known by the time it is reached.
+template <typename Nodes>
+static void GatherWideStats(const Nodes& nodes, int numNodes, const Mesh& mesh,
+	BVHStats& stats, std::vector<int>& references, long long& leafDepths)
+{
+	int width = nodes.width;
+	float scratch[6 * 8];
+	std::vector<int> depths(numNodes, 0);
+	std::vector<AABB> parentBounds(numNodes);
+
+	for (int node = 0; node < numNodes; ++node)
+	{
+		const float* bounds = nodes.Bounds(node, scratch);
+		int depth = depths[node];
+		int numChildren = nodes.NumChildren(node);
+		Vec3 nodeMin, nodeMax;
+
+		stats.numNodes += 1;
+		stats.maxDepth = depth > stats.maxDepth ? depth : stats.maxDepth;
+
+		for (int slot = 0; slot < numChildren; ++slot)
+		{
+			Vec3 min(bounds[0 * width + slot], bounds[1 * width + slot], bounds[2 * width + slot]);
+			Vec3 max(bounds[3 * width + slot], bounds[4 * width + slot], bounds[5 * width + slot]);
+			nodeMin = slot == 0 ? min : Vec3(fminf(nodeMin.x, min.x), fminf(nodeMin.y, min.y), fminf(nodeMin.z, min.z));
+			nodeMax = slot == 0 ? max : Vec3(fmaxf(nodeMax.x, max.x), fmaxf(nodeMax.y, max.y), fmaxf(nodeMax.z, max.z));
+
+			int child = nodes.Child(node, slot);
+			if (child >= 0)
+			{
+				depths[child] = depth + 1;
+				parentBounds[child] = FromMinMax(min, max);
+				continue;
+			}
+
+			stats.numNodes += 1;
+			stats.maxDepth = depth + 1 > stats.maxDepth ? depth + 1 : stats.maxDepth;
+
+			int count = nodes.Count(node, slot);
+			if (count == 0)
+			{
+				stats.numEmptyNodes += 1;
+				continue;
+			}
+
+			GatherLeafStats(FromMinMax(min, max), nodes.Triangles() + (-child - 1), count,
+				depth + 1, mesh, stats, references, leafDepths);
+		}
+
+		if (node > 0 && numChildren > 0 &&
+			!ContainsBounds(parentBounds[node], FromMinMax(nodeMin, nodeMax)))
+		{
+			stats.numUncontainedChildren += 1;
+		}
+	}
+}
+
+static void GatherFlatBVHStats(const Mesh& mesh, BVHStats& stats,
+	std::vector<int>& references, long long& leafDepths)
+{
+	if (mesh.compressedAccelerator != 0)
+	{
+		GatherWideStats(CompressedNodes(mesh.compressedAccelerator), mesh.compressedAccelerator->numNodes,
+			mesh, stats, references, leafDepths);
+		return;
+	}
+
+	GatherWideStats(WideNodes(mesh.wideAccelerator), mesh.wideAccelerator->numNodes,
+		mesh, stats, references, leafDepths);
+}
+
+template <typename Nodes>
+static float WideMeshRay(const Mesh& mesh, const Nodes& nodes, const Ray& ray, int* outTriangle)
+{
+	int width = nodes.width;
+
+	Vec3 invDir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+	float best = FLT_MAX;
+	float entry[8];
+	float scratch[6 * 8];
+
+	int stack[WIDE_BVH_STACK_SIZE];
+	float stackEntry[WIDE_BVH_STACK_SIZE];
+	int top = 0;
+	stack[top] = 0;
+	stackEntry[top++] = 0.0f;
+
+	while (top > 0)
+	{
+		--top;
+		if (stackEntry[top] > best)
+		{
+			continue;
+		}
+
+		int node = stack[top];
+		const float* bounds = nodes.Bounds(node, scratch);
+		int mask = WideRayMask(bounds, width, ray.origin, invDir, best, entry);
+		mask &= (1 << nodes.NumChildren(node)) - 1;
+
+		int first = top;
+		for (int slot = 0; slot < width; ++slot)
+		{
+			if ((mask & (1 << slot)) == 0)
+			{
+				continue;
+			}
+
+			int child = nodes.Child(node, slot);
+			if (child >= 0)
+			{
+				// Keep the stack sorted so the nearest child is popped first
+				int i = top++;
+				for (; i > first && stackEntry[i - 1] < entry[slot]; --i)
+				{
+					stack[i] = stack[i - 1];
+					stackEntry[i] = stackEntry[i - 1];
+				}
+				stack[i] = child;
+				stackEntry[i] = entry[slot];
+				continue;
+			}
+
+			const int* triangles = nodes.Triangles() + (-child - 1);
+			for (int i = 0, count = nodes.Count(node, slot); i < count; ++i)
+			{
+				RaycastResult raycastResult;
+				if (Raycast(mesh.triangles[triangles[i]], ray, &raycastResult) &&
+					raycastResult.t < best)
+				{
+					best = raycastResult.t;
+					if (outTriangle != 0)
+					{
+						*outTriangle = triangles[i];
+					}
+				}
+			}
+		}
+	}
+
+	return best == FLT_MAX ? -1 : best;
+}
+
+template <typename Nodes, typename Test, typename Policy>
+static bool WideMeshOverlap(const Mesh& mesh, const Nodes& nodes, const Test& test, Policy& policy)
+{
+	int width = nodes.width;
+	float scratch[6 * 8];
+
+	int stack[WIDE_BVH_STACK_SIZE];
+	int top = 0;
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		int node = stack[--top];
+		int mask = test(nodes.Bounds(node, scratch), width);
+		mask &= (1 << nodes.NumChildren(node)) - 1;
+
+		for (int slot = 0; slot < width; ++slot)
+		{
+			if ((mask & (1 << slot)) == 0)
+			{
+				continue;
+			}
+
+			int child = nodes.Child(node, slot);
+			if (child >= 0)
+			{
+				stack[top++] = child;
+				continue;
+			}
+
+			const int* triangles = nodes.Triangles() + (-child - 1);
+			for (int i = 0, count = nodes.Count(node, slot); i < count; ++i)
+			{
+				if (test(mesh.triangles[triangles[i]]) && policy(triangles[i]))
+				{
+					return true;
+				}
+			}
+		}
+	}
+
+	return false;
+}
+
+struct SphereQuery
+{
+	const Sphere& sphere;
+	Vec3 min;
+	Vec3 max;
+	SphereQuery(const Sphere& s) : sphere(s),
+		min(s.position - Vec3(s.radius, s.radius, s.radius)),
+		max(s.position + Vec3(s.radius, s.radius, s.radius)) { }
+	int operator()(const float* bounds, int width) const { return WideSphereMask(bounds, width, sphere); }
+	bool operator()(const AABB& bounds) const { return AABBShpere(bounds, sphere); }
+	bool operator()(const Triangle& triangle) const { return TriangleSphere(triangle, sphere); }
+};
+
+struct AABBQuery
+{
+	const AABB& aabb;
+	Vec3 min;
+	Vec3 max;
+	AABBQuery(const AABB& a) : aabb(a), min(GetMin(a)), max(GetMax(a)) { }
+	int operator()(const float* bounds, int width) const { return WideOverlapMask(bounds, width, min, max); }
+	bool operator()(const AABB& bounds) const { return AABBAABB(bounds, aabb); }
+	bool operator()(const Triangle& triangle) const { return TriangleAABB(triangle, aabb); }
+};
+
+struct OBBQuery
+{
+	const OBB& obb;
+	Vec3 min;
+	Vec3 max;
+	OBBQuery(const OBB& o) : obb(o)
+	{
+		const float* axis = o.orientation.asArray;
+		Vec3 extent(
+			fabsf(axis[0] * o.size.x) + fabsf(axis[3] * o.size.y) + fabsf(axis[6] * o.size.z),
+			fabsf(axis[1] * o.size.x) + fabsf(axis[4] * o.size.y) + fabsf(axis[7] * o.size.z),
+			fabsf(axis[2] * o.size.x) + fabsf(axis[5] * o.size.y) + fabsf(axis[8] * o.size.z));
+		min = o.position - extent;
+		max = o.position + extent;
+	}
+	int operator()(const float* bounds, int width) const { return WideOverlapMask(bounds, width, min, max); }
+	bool operator()(const AABB& bounds) const { return AABBOBB(bounds, obb); }
+	bool operator()(const Triangle& triangle) const { return TriangleOBB(triangle, obb); }
+};
+
+// Rejects triangles whose bounds miss the query bounds before running the
+// exact shape test
+template <typename Query>
+struct PrefilteredQuery
+{
+	const Query& query;
+	PrefilteredQuery(const Query& q) : query(q) { }
+	int operator()(const float* bounds, int width) const { return query(bounds, width); }
+	bool operator()(const AABB& bounds) const { return query(bounds); }
+	bool operator()(const Triangle& triangle) const
+	{
+		Vec3 min, max;
+		GetTriangleMinMax(triangle, min, max);
+		if (max.x < query.min.x || max.y < query.min.y || max.z < query.min.z ||
+			min.x > query.max.x || min.y > query.max.y || min.z > query.max.z)
+		{
+			return false;
+		}
+
+		return query(triangle);
+	}
+};
+
+struct PlaneQuery
+{
+	const Plane& plane;
+	PlaneQuery(const Plane& p) : plane(p) { }
+	bool operator()(const AABB& bounds) const { return AABBPlane(bounds, plane); }
+	bool operator()(const Triangle& triangle) const { return TrianglePlane(triangle, plane); }
+};
+
+struct TriangleQuery
+{
+	const Triangle& triangle;
+	TriangleQuery(const Triangle& t) : triangle(t) { }
+	bool operator()(const AABB& bounds) const { return AABBTriangle(bounds, triangle); }
+	bool operator()(const Triangle& other) const { return TriangleTriangle(other, triangle); }
+};
+
+// Runs a query that only has an AABB node test against the wide nodes, one
+// lane at a time
+template <typename Query>
+struct LaneQuery
+{
+	const Query& query;
+	LaneQuery(const Query& q) : query(q) { }
+	int operator()(const float* bounds, int width) const
+	{
+		int mask = 0;
+
+		for (int lane = 0; lane < width; ++lane)
+		{
+			Vec3 min(bounds[0 * width + lane], bounds[1 * width + lane], bounds[2 * width + lane]);
+			Vec3 max(bounds[3 * width + lane], bounds[4 * width + lane], bounds[5 * width + lane]);
+			mask |= query(FromMinMax(min, max)) << lane;
+		}
+
+		return mask;
+	}
+	bool operator()(const Triangle& triangle) const { return query(triangle); }
+};
+
+// Queries with a wide node test of their own use it, the rest go lane by lane
+template <typename Query>
+static LaneQuery<Query> WideQuery(const Query& query) { return LaneQuery<Query>(query); }
+static const SphereQuery& WideQuery(const SphereQuery& query) { return query; }
+static const AABBQuery& WideQuery(const AABBQuery& query) { return query; }
+static const OBBQuery& WideQuery(const OBBQuery& query) { return query; }
+
+template <typename Query>
+static bool AnyMeshTriangle(const Mesh& mesh, const Query& query)
+{
+	BVHAnyHit policy;
+
+	if (mesh.compressedAccelerator != 0)
+	{
+		return WideMeshOverlap(mesh, CompressedNodes(mesh.compressedAccelerator), WideQuery(query), policy);
+	}
+
+	if (mesh.wideAccelerator != 0)
+	{
+		return WideMeshOverlap(mesh, WideNodes(mesh.wideAccelerator), WideQuery(query), policy);
+	}
+
+	return TraverseBVH(mesh, query, query, policy);
+}
+
+float MeshRay(const Mesh& mesh, const Ray& ray)
+{
+	return MeshRay(mesh, ray, 0);
+}
+
+// Closest hit below root, nodes entered past the best hit so far are
+// skipped. best is -1 while nothing was hit.
+static void BVHMeshRay(const Mesh& mesh, const BVHNode* root, const Ray& ray,
+	float* best, int* outTriangle)
+{
+	const BVHNode* stack[BVH_TRAVERSAL_STACK_SIZE];
+	float stackEntry[BVH_TRAVERSAL_STACK_SIZE];
+	int top = 0;
+	stack[top] = root;
+	stackEntry[top++] = 0.0f;
+
+	while (top > 0)
+	{
+		--top;
+		if (*best >= 0 && stackEntry[top] > *best)
+		{
+			continue;
+		}
+
+		const BVHNode* node = stack[top];
+		EnsureBVHNode(node, mesh);
+
+		for (int i = 0; i < node->numTriangles; ++i)
+		{
+			RaycastResult raycastResult;
+			Raycast(mesh.triangles[node->triangles[i]], ray, &raycastResult);
+			float t = raycastResult.t;
+
+			if (t >= 0 && (*best < 0 || t < *best))
+			{
+				*best = t;
+				if (outTriangle != 0)
+				{
+					*outTriangle = node->triangles[i];
+				}
+			}
+		}
+
+		if (node->children == 0)
+		{
+			continue;
+		}
+
+		for (int i = 8 - 1; i >= 0; --i)
+		{
+			const BVHNode* child = &node->children[i];
+			if (IsEmptyBVHNode(child))
+			{
+				continue;
+			}
+
+			float entry = RaycastEntry(child->bounds, ray);
+			if (entry < 0 || (*best >= 0 && entry > *best))
+			{
+				continue;
+			}
+
+			if (top == BVH_TRAVERSAL_STACK_SIZE)
+			{
+				// Only very deep, unbalanced trees get here
+				BVHMeshRay(mesh, child, ray, best, outTriangle);
+				continue;
+			}
+
+			stack[top] = child;
+			stackEntry[top++] = entry;
+		}
+	}
+}
+
+float MeshRay(const Mesh& mesh, const Ray& ray, int* outTriangle)
+{
+	if (outTriangle != 0)
+	{
+		*outTriangle = -1;
+	}
+
+	if (mesh.compressedAccelerator != 0)
+	{
+		return WideMeshRay(mesh, CompressedNodes(mesh.compressedAccelerator), ray, outTriangle);
+	}
+
+	if (mesh.wideAccelerator != 0)
+	{
+		return WideMeshRay(mesh, WideNodes(mesh.wideAccelerator), ray, outTriangle);
+	}
+
+	float best = -1;
+
+	if (mesh.accelerator == 0)
+	{
+		for (int i = 0; i < mesh.numTriangles; ++i)
+		{
+			RaycastResult raycastResult;
+			Raycast(mesh.triangles[i], ray, &raycastResult);
+			float result = raycastResult.t;
+			if (result >= 0 && (best < 0 || result < best))
+			{
+				best = result;
+				if (outTriangle != 0)
+				{
+					*outTriangle = i;
+				}
+			}
+		}
+	}
+	else
+	{
+		BVHMeshRay(mesh, mesh.accelerator, ray, &best, outTriangle);
+	}
+
+	return best;
+}
+
+static void ClosestPoint(const Mesh& mesh, const BVHNode* node, const Point& point,
+	Point* outClosest, float* outDistanceSq)
+{
+	EnsureBVHNode(node, mesh);
+
+	for (int i = 0; i < node->numTriangles; ++i)
+	{
+		Point closest = ClosestPoint(mesh.triangles[node->triangles[i]], point);
+		float distanceSq = MagnitudeSq(closest - point);
+
+		if (distanceSq < *outDistanceSq)
+		{
+			*outClosest = closest;
+			*outDistanceSq = distanceSq;
+		}
+	}
+
+	if (node->children == 0)
+	{
+		return;
+	}
+
+	// Nearest children first, so the rest are more likely to be skipped
+	float distances[8];
+	int order[8];
+	int count = 0;
+
+	for (int i = 0; i < 8; ++i)
+	{
+		if (IsEmptyBVHNode(&node->children[i]))
+		{
+			continue;
+		}
+
+		float distanceSq = MagnitudeSq(ClosestPoint(node->children[i].bounds, point) - point);
+		int j = count++;
+		for (; j > 0 && distances[j - 1] > distanceSq; --j)
+		{
+			distances[j] = distances[j - 1];
+			order[j] = order[j - 1];
+		}
+		distances[j] = distanceSq;
+		order[j] = i;
+	}
+
+	for (int i = 0; i < count && distances[i] < *outDistanceSq; ++i)
+	{
+		ClosestPoint(mesh, &node->children[order[i]], point, outClosest, outDistanceSq);
+	}
+}
+
+template <typename Nodes>
+static void WideClosestPoint(const Mesh& mesh, const Nodes& nodes, int node, const Point& point,
+	Point* outClosest, float* outDistanceSq)
+{
+	int width = nodes.width;
+	float scratch[6 * 8];
+	const float* bounds = nodes.Bounds(node, scratch);
+	const float* p = point.asArray;
+
+	float distances[8];
+	int order[8];
+	int count = 0;
+
+	for (int slot = 0, numChildren = nodes.NumChildren(node); slot < numChildren; ++slot)
+	{
+		float distanceSq = 0.0f;
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float closest = fminf(fmaxf(p[axis], bounds[axis * width + slot]),
+				bounds[(axis + 3) * width + slot]);
+			distanceSq += (p[axis] - closest) * (p[axis] - closest);
+		}
+
+		int j = count++;
+		for (; j > 0 && distances[j - 1] > distanceSq; --j)
+		{
+			distances[j] = distances[j - 1];
+			order[j] = order[j - 1];
+		}
+		distances[j] = distanceSq;
+		order[j] = slot;
+	}
+
+	for (int i = 0; i < count && distances[i] < *outDistanceSq; ++i)
+	{
+		int child = nodes.Child(node, order[i]);
+		if (child >= 0)
+		{
+			WideClosestPoint(mesh, nodes, child, point, outClosest, outDistanceSq);
+			continue;
+		}
+
+		const int* triangles = nodes.Triangles() + (-child - 1);
+		for (int k = 0, numTriangles = nodes.Count(node, order[i]); k < numTriangles; ++k)
+		{
+			Point closest = ClosestPoint(mesh.triangles[triangles[k]], point);
+			float distanceSq = MagnitudeSq(closest - point);
+
+			if (distanceSq < *outDistanceSq)
+			{
+				*outClosest = closest;
+				*outDistanceSq = distanceSq;
 			}
 		}
 	}
-	else
+}
+
+Point ClosestPoint(const Mesh& mesh, const Point& point)
+{
+	Point closest = point;
+	float distanceSq = FLT_MAX;
+
+	if (mesh.compressedAccelerator != 0)
+	{
+		WideClosestPoint(mesh, CompressedNodes(mesh.compressedAccelerator), 0, point, &closest, &distanceSq);
+		return closest;
+	}
+
+	if (mesh.wideAccelerator != 0)
+	{
+		WideClosestPoint(mesh, WideNodes(mesh.wideAccelerator), 0, point, &closest, &distanceSq);
+		return closest;
+	}
+
+	if (mesh.accelerator != 0)
+	{
+		ClosestPoint(mesh, mesh.accelerator, point, &closest, &distanceSq);
+		return closest;
+	}
+
+	for (int i = 0; i < mesh.numTriangles; ++i)
+	{
+		Point candidate = ClosestPoint(mesh.triangles[i], point);
+		float candidateSq = MagnitudeSq(candidate - point);
+
+		if (candidateSq < distanceSq)
+		{
+			closest = candidate;
+			distanceSq = candidateSq;
+		}
+	}
+
+	return closest;
+}
+
+#define RAY_PACKET_SIZE 8
+
+struct RayPacket
+{
+	const Ray* rays[RAY_PACKET_SIZE];
+	Vec3 invDir[RAY_PACKET_SIZE];
+	RaycastResult* results[RAY_PACKET_SIZE];
+	float best[RAY_PACKET_SIZE];
+	int count;
+};
+
+static bool RayBoxEntry(const Vec3& min, const Vec3& max, const Vec3& origin,
+	const Vec3& invDir, float tMax, float& outEntry)
+{
+	float enter = 0.0f;
+	float leave = tMax;
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		float t1 = (min.asArray[axis] - origin.asArray[axis]) * invDir.asArray[axis];
+		float t2 = (max.asArray[axis] - origin.asArray[axis]) * invDir.asArray[axis];
+		enter = fmaxf(enter, fminf(t1, t2));
+		leave = fminf(leave, fmaxf(t1, t2));
+	}
+
+	outEntry = enter;
+	return enter <= leave;
+}
+
+static void RaycastPacketLeaf(const Mesh& mesh, RayPacket& packet, int mask,
+	const int* triangles, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		const Triangle& triangle = mesh.triangles[triangles[i]];
+
+		for (int r = 0; r < packet.count; ++r)
+		{
+			if ((mask & (1 << r)) == 0)
+			{
+				continue;
+			}
+
+			RaycastResult raycastResult;
+			if (Raycast(triangle, *packet.rays[r], &raycastResult) &&
+				raycastResult.t >= 0.0f && raycastResult.t < packet.best[r])
+			{
+				packet.best[r] = raycastResult.t;
+				*packet.results[r] = raycastResult;
+			}
+		}
+	}
+}
+
+// Every node is fetched once per packet, the rays of mask that reach it
+// share the visit
+static void RaycastPacket(const Mesh& mesh, RayPacket& packet, BVHNode* root, int rootMask)
+{
+	BVHNode* stack[BVH_TRAVERSAL_STACK_SIZE];
+	int masks[BVH_TRAVERSAL_STACK_SIZE];
+	float stackEntry[BVH_TRAVERSAL_STACK_SIZE];
+	int top = 0;
+	stack[top] = root;
+	masks[top] = rootMask;
+	stackEntry[top++] = 0.0f;
+
+	while (top > 0)
+	{
+		--top;
+		BVHNode* node = stack[top];
+		int mask = masks[top];
+
+		// Drop the rays that found a hit closer than this node since it was pushed
+		for (int r = 0; r < packet.count; ++r)
+		{
+			if (packet.best[r] < stackEntry[top])
+			{
+				mask &= ~(1 << r);
+			}
+		}
+		if (mask == 0)
+		{
+			continue;
+		}
+
+		EnsureBVHNode(node, mesh);
+
+		if (node->numTriangles > 0)
+		{
+			RaycastPacketLeaf(mesh, packet, mask, node->triangles, node->numTriangles);
+		}
+
+		if (node->children == 0)
+		{
+			continue;
+		}
+
+		int childMasks[8];
+		float childEntry[8];
+		int order[8];
+		int numOrdered = 0;
+
+		for (int i = 0; i < 8; ++i)
+		{
+			BVHNode* child = &node->children[i];
+			childMasks[i] = 0;
+			childEntry[i] = FLT_MAX;
+
+			if (IsEmptyBVHNode(child))
+			{
+				continue;
+			}
+
+			Vec3 min = GetMin(child->bounds);
+			Vec3 max = GetMax(child->bounds);
+
+			for (int r = 0; r < packet.count; ++r)
+			{
+				float entry;
+				if ((mask & (1 << r)) != 0 && RayBoxEntry(min, max, packet.rays[r]->origin,
+					packet.invDir[r], packet.best[r], entry))
+				{
+					childMasks[i] |= 1 << r;
+					childEntry[i] = fminf(childEntry[i], entry);
+				}
+			}
+
+			if (childMasks[i] != 0)
+			{
+				order[numOrdered++] = i;
+			}
+		}
+
+		// Push far children first so the nearest one is processed next
+		for (int i = 1; i < numOrdered; ++i)
+		{
+			int j = i;
+			int value = order[i];
+			for (; j > 0 && childEntry[order[j - 1]] < childEntry[value]; --j)
+			{
+				order[j] = order[j - 1];
+			}
+			order[j] = value;
+		}
+
+		for (int i = 0; i < numOrdered; ++i)
+		{
+			if (top == BVH_TRAVERSAL_STACK_SIZE)
+			{
+				// Only very deep, unbalanced trees get here
+				RaycastPacket(mesh, packet, &node->children[order[i]], childMasks[order[i]]);
+				continue;
+			}
+
+			stack[top] = &node->children[order[i]];
+			masks[top] = childMasks[order[i]];
+			stackEntry[top++] = childEntry[order[i]];
+		}
+	}
+}
+
+template <typename Nodes>
+static void WideRaycastPacket(const Mesh& mesh, const Nodes& nodes, RayPacket& packet)
+{
+	int width = nodes.width;
+	float scratch[6 * 8];
+	float entry[8];
+
+	int stack[WIDE_BVH_STACK_SIZE];
+	int masks[WIDE_BVH_STACK_SIZE];
+	float stackEntry[WIDE_BVH_STACK_SIZE];
+	int top = 0;
+	stack[top] = 0;
+	masks[top] = (1 << packet.count) - 1;
+	stackEntry[top++] = 0.0f;
+
+	while (top > 0)
+	{
+		--top;
+		int node = stack[top];
+		int mask = masks[top];
+
+		// Drop the rays that found a hit closer than this node since it was pushed
+		for (int r = 0; r < packet.count; ++r)
+		{
+			if (packet.best[r] < stackEntry[top])
+			{
+				mask &= ~(1 << r);
+			}
+		}
+		if (mask == 0)
+		{
+			continue;
+		}
+
+		const float* bounds = nodes.Bounds(node, scratch);
+		int valid = (1 << nodes.NumChildren(node)) - 1;
+		int childMasks[8] = { 0 };
+		float childEntry[8];
+
+		for (int slot = 0; slot < width; ++slot)
+		{
+			childEntry[slot] = FLT_MAX;
+		}
+
+		for (int r = 0; r < packet.count; ++r)
+		{
+			if ((mask & (1 << r)) == 0)
+			{
+				continue;
+			}
+
+			int hit = WideRayMask(bounds, width, packet.rays[r]->origin,
+				packet.invDir[r], packet.best[r], entry) & valid;
+
+			for (int slot = 0; slot < width; ++slot)
+			{
+				if (hit & (1 << slot))
+				{
+					childMasks[slot] |= 1 << r;
+					childEntry[slot] = fminf(childEntry[slot], entry[slot]);
+				}
+			}
+		}
+
+		int first = top;
+		for (int slot = 0; slot < width; ++slot)
+		{
+			if (childMasks[slot] == 0)
+			{
+				continue;
+			}
+
+			int child = nodes.Child(node, slot);
+			if (child >= 0)
+			{
+				// Keep the stack sorted so the nearest child is popped first
+				int i = top++;
+				for (; i > first && stackEntry[i - 1] < childEntry[slot]; --i)
+				{
+					stack[i] = stack[i - 1];
+					masks[i] = masks[i - 1];
+					stackEntry[i] = stackEntry[i - 1];
+				}
+				stack[i] = child;
+				masks[i] = childMasks[slot];
+				stackEntry[i] = childEntry[slot];
+				continue;
+			}
+
+			RaycastPacketLeaf(mesh, packet, childMasks[slot],
+				nodes.Triangles() + (-child - 1), nodes.Count(node, slot));
+		}
+	}
+}
+
+void MeshRayBatch(const Mesh& mesh, const Ray* rays, int count, RaycastResult* out)
+{
+	if (count <= 0)
+	{
+		return;
+	}
+
+	// Sort by direction octant, then by the Morton code of the origin, so
+	// that consecutive rays walk the same part of the hierarchy
+	Vec3 min = rays[0].origin;
+	Vec3 max = rays[0].origin;
+	for (int i = 1; i < count; ++i)
+	{
+		min = Vec3(fminf(min.x, rays[i].origin.x), fminf(min.y, rays[i].origin.y), fminf(min.z, rays[i].origin.z));
+		max = Vec3(fmaxf(max.x, rays[i].origin.x), fmaxf(max.y, rays[i].origin.y), fmaxf(max.z, rays[i].origin.z));
+	}
+
+	Vec3 extent = max - min;
+	std::vector<unsigned long long> order(count);
+
+	for (int i = 0; i < count; ++i)
+	{
+		const Ray& ray = rays[i];
+		unsigned int octant = (ray.direction.x < 0.0f ? 4 : 0) |
+			(ray.direction.y < 0.0f ? 2 : 0) | (ray.direction.z < 0.0f ? 1 : 0);
+		unsigned int code = 0;
+
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			float range = extent.asArray[axis];
+			float offset = range > 0.0f ? (ray.origin.asArray[axis] - min.asArray[axis]) / range : 0.0f;
+			unsigned int cell = (unsigned int)fminf(offset * 512.0f, 511.0f);
+			code |= ExpandBits(cell) << (2 - axis);
+		}
+
+		order[i] = ((unsigned long long)((octant << 27) | code) << 32) | (unsigned int)i;
+	}
+
+	std::sort(order.begin(), order.end());
+
+	for (int i = 0; i < count; i += RAY_PACKET_SIZE)
 	{
-		std::list<BVHNode*> toProcess;
-		toProcess.push_front(mesh.accelerator);
-		while (!toProcess.empty())
+		RayPacket packet;
+		packet.count = count - i < RAY_PACKET_SIZE ? count - i : RAY_PACKET_SIZE;
+
+		for (int r = 0; r < packet.count; ++r)
 		{
-			BVHNode* iterator = *(toProcess.begin());
-			toProcess.erase(toProcess.begin());
+			int index = (int)(order[i + r] & 0xffffffffu);
+			const Ray& ray = rays[index];
+			packet.rays[r] = &ray;
+			packet.invDir[r] = Vec3(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+			packet.results[r] = &out[index];
+			packet.best[r] = FLT_MAX;
+			ResetRaycastResult(&out[index]);
+		}
+
+		if (mesh.compressedAccelerator != 0)
+		{
+			WideRaycastPacket(mesh, CompressedNodes(mesh.compressedAccelerator), packet);
+		}
+		else if (mesh.wideAccelerator != 0)
+		{
+			WideRaycastPacket(mesh, WideNodes(mesh.wideAccelerator), packet);
+		}
+		else if (mesh.accelerator != 0)
+		{
+			RaycastPacket(mesh, packet, mesh.accelerator, (1 << packet.count) - 1);
+		}
+		else
+		{
+			for (int t = 0; t < mesh.numTriangles; ++t)
+			{
+				RaycastPacketLeaf(mesh, packet, (1 << packet.count) - 1, &t, 1);
+			}
+		}
+	}
+}
+
+// Linecast(AABB) misses segments that start and end inside the box, so
+// nodes are tested with a plain slab test over the segment instead
+struct LineQuery
+{
+	const Line& line;
+	Vec3 invDir;
+	LineQuery(const Line& l) : line(l)
+	{
+		Vec3 d = l.end - l.start;
+		invDir = Vec3(1.0f / d.x, 1.0f / d.y, 1.0f / d.z);
+	}
+	bool operator()(const AABB& bounds) const
+	{
+		float entry;
+		return RayBoxEntry(GetMin(bounds), GetMax(bounds), line.start, invDir, 1.0f, entry);
+	}
+	bool operator()(const Triangle& triangle) const { return Linecast(triangle, line); }
+};
+
+bool LineTest(const Mesh& mesh, const Line& line)
+{
+	return AnyMeshTriangle(mesh, LineQuery(line));
+}
+
+bool MeshSphere(const Mesh& mesh, const Sphere& sphere)
+{
+	return AnyMeshTriangle(mesh, SphereQuery(sphere));
+}
+
+bool MeshAABB(const Mesh& mesh, const AABB& aabb)
+{
+	return AnyMeshTriangle(mesh, AABBQuery(aabb));
+}
+
+bool MeshOBB(const Mesh& mesh, const OBB& obb)
+{
+	return AnyMeshTriangle(mesh, OBBQuery(obb));
+}
+
+template <typename Query>
+static int CollectMeshTriangles(const Mesh& mesh, const Query& query, int* outTriangles, int maxTriangles)
+{
+	if (maxTriangles <= 0)
+	{
+		return 0;
+	}
+
+	PrefilteredQuery<Query> filtered(query);
+	BVHCollectBuffer policy(outTriangles, maxTriangles);
+
+	if (mesh.compressedAccelerator != 0)
+	{
+		WideMeshOverlap(mesh, CompressedNodes(mesh.compressedAccelerator), filtered, policy);
+	}
+	else if (mesh.wideAccelerator != 0)
+	{
+		WideMeshOverlap(mesh, WideNodes(mesh.wideAccelerator), filtered, policy);
+	}
+	else
+	{
+		TraverseBVH(mesh, filtered, filtered, policy);
+	}
+
+	return policy.count;
+}
+
+int MeshSphere(const Mesh& mesh, const Sphere& sphere, int* outTriangles, int maxTriangles)
+{
+	return CollectMeshTriangles(mesh, SphereQuery(sphere), outTriangles, maxTriangles);
+}
+
+int MeshAABB(const Mesh& mesh, const AABB& aabb, int* outTriangles, int maxTriangles)
+{
+	return CollectMeshTriangles(mesh, AABBQuery(aabb), outTriangles, maxTriangles);
+}
+
+int MeshOBB(const Mesh& mesh, const OBB& obb, int* outTriangles, int maxTriangles)
+{
+	return CollectMeshTriangles(mesh, OBBQuery(obb), outTriangles, maxTriangles);
+}
+
+bool MeshPlane(const Mesh& mesh, const Plane& plane)
+{
+	return AnyMeshTriangle(mesh, PlaneQuery(plane));
+}
 
-			if (iterator->numTriangles >= 0)
-			{
-				for (int i = 0; i < iterator->numTriangles; ++i)
-				{
-					if (TriangleSphere(mesh.triangles[iterator->triangles[i]], sphere))
-					{
-						return true;
-					}
-				}
-			}
+bool MeshTriangle(const Mesh& mesh, const Triangle& triangle)
+{
+	return AnyMeshTriangle(mesh, TriangleQuery(triangle));
+}
 
-			if (iterator->children != 0)
-			{
-				for (int i = 8 - 1; i >= 0; --i)
-				{
-					if (AABBShpere(iterator->children[i].bounds, sphere))
-					{
-						toProcess.push_front(&iterator->children[i]);
-					}
-				}
-			}
-		}
-	}
+static OBB TransformBounds(const AABB& aabb, const Mat4& transform)
+{
+	OBB result;
+	result.position = MultiplyPoint(aabb.position, transform);
+	result.size = Vec3(fabsf(aabb.size.x), fabsf(aabb.size.y), fabsf(aabb.size.z));
+	result.orientation = Cut(transform, 3, 3);
 
-	return false;
+	return result;
 }
 
-bool MeshAABB(const Mesh& mesh, const AABB& aabb)
+// One side of a pair in the dual traversal. Pointer tree nodes, wide or
+// compressed nodes and leaf triangle ranges all reduce to this
+struct CollideNode
 {
-	if (mesh.accelerator == 0)
+	AABB bounds;
+	bool unbounded;
+	const BVHNode* pointer;
+	int wide;
+	// Null with numTriangles set for the first numTriangles of the mesh
+	const int* triangles;
+	int numTriangles;
+};
+
+static bool IsCollideLeaf(const CollideNode& node)
+{
+	return node.pointer == 0 && node.wide < 0;
+}
+
+static int GetCollideTriangle(const CollideNode& node, int i)
+{
+	return node.triangles != 0 ? node.triangles[i] : i;
+}
+
+static CollideNode MakeCollideNode(const BVHNode* node)
+{
+	CollideNode result;
+	result.bounds = node->bounds;
+	result.unbounded = false;
+	result.pointer = node->children != 0 ? node : 0;
+	result.wide = -1;
+	result.triangles = node->triangles;
+	result.numTriangles = node->numTriangles;
+
+	return result;
+}
+
+template <typename Nodes>
+static int ExpandWideCollideNode(const Nodes& nodes, int node, CollideNode* outChildren)
+{
+	int width = nodes.width;
+	float scratch[6 * 8];
+	const float* bounds = nodes.Bounds(node, scratch);
+	int count = 0;
+
+	for (int slot = 0, numChildren = nodes.NumChildren(node); slot < numChildren; ++slot)
 	{
-		for (int i = 0; i < mesh.numTriangles; ++i)
+		int child = nodes.Child(node, slot);
+		CollideNode& out = outChildren[count];
+
+		out.bounds = FromMinMax(
+			Vec3(bounds[0 * width + slot], bounds[1 * width + slot], bounds[2 * width + slot]),
+			Vec3(bounds[3 * width + slot], bounds[4 * width + slot], bounds[5 * width + slot]));
+		out.unbounded = false;
+		out.pointer = 0;
+		out.wide = child >= 0 ? child : -1;
+		out.triangles = child >= 0 ? 0 : nodes.Triangles() + (-child - 1);
+		out.numTriangles = child >= 0 ? 0 : nodes.Count(node, slot);
+
+		if (child >= 0 || out.numTriangles > 0)
 		{
-			if (TriangleAABB(mesh.triangles[i], aabb))
-			{
-				return true;
-			}
+			++count;
 		}
 	}
-	else
+
+	return count;
+}
+
+static int ExpandCollideNode(const Mesh& mesh, const CollideNode& node, CollideNode* outChildren)
+{
+	if (node.wide >= 0)
 	{
-		std::list<BVHNode*> toProcess;
-		toProcess.push_front(mesh.accelerator);
-		while (!toProcess.empty())
+		if (mesh.compressedAccelerator != 0)
 		{
-			BVHNode* iterator = *(toProcess.begin());
-			toProcess.erase(toProcess.begin());
+			return ExpandWideCollideNode(CompressedNodes(mesh.compressedAccelerator), node.wide, outChildren);
+		}
 
-			if (iterator->numTriangles >= 0)
-			{
-				for (int i = 0; i < iterator->numTriangles; ++i)
-				{
-					if (TriangleAABB(mesh.triangles[iterator->triangles[i]], aabb))
-					{
-						return true;
-					}
-				}
-			}
+		return ExpandWideCollideNode(WideNodes(mesh.wideAccelerator), node.wide, outChildren);
+	}
 
-			if (iterator->children != 0)
-			{
-				for (int i = 8 - 1; i >= 0; --i)
-				{
-					if (AABBAABB(iterator->children[i].bounds, aabb))
-					{
-						toProcess.push_front(&iterator->children[i]);
-					}
-				}
-			}
+	int count = 0;
+	for (int i = 0; i < 8; ++i)
+	{
+		const BVHNode* child = &node.pointer->children[i];
+		EnsureBVHNode(child, mesh);
+
+		if (!IsEmptyBVHNode(child))
+		{
+			outChildren[count++] = MakeCollideNode(child);
 		}
 	}
 
-	return false;
+	return count;
 }
 
-bool MeshOBB(const Mesh& mesh, const OBB& obb)
+// Starts the traversal at the same tree the single mesh queries prefer. A mesh
+// without any tree is one unbounded leaf holding every triangle
+static CollideNode CollideRoot(const Mesh& mesh)
 {
-	if (mesh.accelerator == 0)
+	CollideNode root;
+	root.bounds = AABB(Vec3(), Vec3(FLT_MAX, FLT_MAX, FLT_MAX));
+	root.unbounded = true;
+	root.pointer = 0;
+	root.wide = -1;
+	root.triangles = 0;
+	root.numTriangles = 0;
+
+	if (mesh.compressedAccelerator != 0 || mesh.wideAccelerator != 0)
 	{
-		for (int i = 0; i < mesh.numTriangles; ++i)
-		{
-			if (TriangleOBB(mesh.triangles[i], obb))
-			{
-				return true;
-			}
-		}
+		root.wide = 0;
+	}
+	else if (mesh.accelerator != 0)
+	{
+		EnsureBVHNode(mesh.accelerator, mesh);
+		root = MakeCollideNode(mesh.accelerator);
 	}
 	else
 	{
-		std::list<BVHNode*> toProcess;
-		toProcess.push_front(mesh.accelerator);
-		while (!toProcess.empty())
-		{
-			BVHNode* iterator = *(toProcess.begin());
-			toProcess.erase(toProcess.begin());
-
-			if (iterator->numTriangles >= 0)
-			{
-				for (int i = 0; i < iterator->numTriangles; ++i)
-				{
-					if (TriangleOBB(mesh.triangles[iterator->triangles[i]], obb))
-					{
-						return true;
-					}
-				}
-			}
-
-			if (iterator->children != 0)
-			{
-				for (int i = 8 - 1; i >= 0; --i)
-				{
-					if (AABBOBB(iterator->children[i].bounds, obb))
-					{
-						toProcess.push_front(&iterator->children[i]);
-					}
-				}
-			}
-		}
+		root.numTriangles = mesh.numTriangles;
 	}
 
-	return false;
+	return root;
 }
 
-bool MeshPlane(const Mesh& mesh, const Plane& plane)
+static bool CollideLeaves(const Mesh& mesh1, const CollideNode& node1, const Mesh& mesh2,
+	const CollideNode& node2, const Mat4& relative, std::vector<TrianglePair>* outPairs)
 {
-	if (mesh.accelerator == 0)
+	bool result = false;
+	Vec3 nodeMin = GetMin(node1.bounds);
+	Vec3 nodeMax = GetMax(node1.bounds);
+
+	for (int j = 0; j < node2.numTriangles; ++j)
 	{
-		for (int i = 0; i < mesh.numTriangles; ++i)
+		int triangle2 = GetCollideTriangle(node2, j);
+		const Triangle& source = mesh2.triangles[triangle2];
+		Triangle other(
+			MultiplyPoint(source.a, relative),
+			MultiplyPoint(source.b, relative),
+			MultiplyPoint(source.c, relative));
+
+		Vec3 otherMin, otherMax;
+		GetTriangleMinMax(other, otherMin, otherMax);
+
+		if (otherMin.x > nodeMax.x || otherMax.x < nodeMin.x ||
+			otherMin.y > nodeMax.y || otherMax.y < nodeMin.y ||
+			otherMin.z > nodeMax.z || otherMax.z < nodeMin.z)
 		{
-			if (TrianglePlane(mesh.triangles[i], plane))
-			{
-				return true;
-			}
+			continue;
 		}
-	}
-	else
-	{
-		std::list<BVHNode*> toProcess;
-		toProcess.push_front(mesh.accelerator);
-		while (!toProcess.empty())
+
+		for (int i = 0; i < node1.numTriangles; ++i)
 		{
-			BVHNode* iterator = *(toProcess.begin());
-			toProcess.erase(toProcess.begin());
+			int triangle1 = GetCollideTriangle(node1, i);
+			const Triangle& triangle = mesh1.triangles[triangle1];
 
-			if (iterator->numTriangles >= 0)
+			Vec3 min, max;
+			GetTriangleMinMax(triangle, min, max);
+
+			if (otherMin.x > max.x || otherMax.x < min.x ||
+				otherMin.y > max.y || otherMax.y < min.y ||
+				otherMin.z > max.z || otherMax.z < min.z)
 			{
-				for (int i = 0; i < iterator->numTriangles; ++i)
-				{
-					if (TrianglePlane(mesh.triangles[iterator->triangles[i]], plane))
-					{
-						return true;
-					}
-				}
+				continue;
 			}
 
-			if (iterator->children != 0)
+			if (!TriangleTriangle(triangle, other))
 			{
-				for (int i = 8 - 1; i >= 0; --i)
-				{
-					if (AABBPlane(iterator->children[i].bounds, plane))
-					{
-						toProcess.push_front(&iterator->children[i]);
-					}
-				}
+				continue;
+			}
+
+			if (outPairs == 0)
+			{
+				return true;
 			}
+
+			TrianglePair pair;
+			pair.triangle1 = triangle1;
+			pair.triangle2 = triangle2;
+			outPairs->push_back(pair);
+			result = true;
 		}
 	}
 
-	return false;
+	return result;
 }
 
-bool MeshTriangle(const Mesh& mesh, const Triangle& triangle)
+static bool operator<(const TrianglePair& left, const TrianglePair& right)
 {
-	if (mesh.accelerator == 0)
+	if (left.triangle1 != right.triangle1)
 	{
-		for (int i = 0; i < mesh.numTriangles; ++i)
-		{
-			if (TriangleTriangle(mesh.triangles[i], triangle))
-			{
-				return true;
-			}
-		}
+		return left.triangle1 < right.triangle1;
 	}
-	else
+
+	return left.triangle2 < right.triangle2;
+}
+
+static bool operator==(const TrianglePair& left, const TrianglePair& right)
+{
+	return left.triangle1 == right.triangle1 && left.triangle2 == right.triangle2;
+}
+
+// Walks the pairs of nodes below root1 and root2 on a fixed stack
+static bool CollidePairs(const Mesh& mesh1, const CollideNode& root1, const Mesh& mesh2,
+	const CollideNode& root2, const Mat4& relative, std::vector<TrianglePair>* outPairs)
+{
+	CollideNode stack[BVH_TRAVERSAL_STACK_SIZE][2];
+	int top = 0;
+	stack[top][0] = root1;
+	stack[top++][1] = root2;
+
+	bool result = false;
+	CollideNode children[8];
+
+	while (top > 0)
 	{
-		std::list<BVHNode*> toProcess;
-		toProcess.push_front(mesh.accelerator);
-		while (!toProcess.empty())
+		--top;
+		CollideNode node1 = stack[top][0];
+		CollideNode node2 = stack[top][1];
+
+		bool leaf1 = IsCollideLeaf(node1);
+		bool leaf2 = IsCollideLeaf(node2);
+
+		if ((leaf1 && node1.numTriangles == 0) || (leaf2 && node2.numTriangles == 0))
+		{
+			continue;
+		}
+
+		bool unbounded = node1.unbounded || node2.unbounded;
+		if (!unbounded && !AABBOBB(node1.bounds, TransformBounds(node2.bounds, relative)))
 		{
-			BVHNode* iterator = *(toProcess.begin());
-			toProcess.erase(toProcess.begin());
+			continue;
+		}
 
-			if (iterator->numTriangles >= 0)
+		if (leaf1 && leaf2)
+		{
+			if (CollideLeaves(mesh1, node1, mesh2, node2, relative, outPairs))
 			{
-				for (int i = 0; i < iterator->numTriangles; ++i)
+				result = true;
+
+				if (outPairs == 0)
 				{
-					if (TriangleTriangle(mesh.triangles[iterator->triangles[i]], triangle))
-					{
-						return true;
-					}
+					return true;
 				}
 			}
+			continue;
+		}
+
+		// Descend into the larger of the two nodes, unbounded roots first
+		bool split1 = leaf2 || (!leaf1 && (node1.unbounded ||
+			(!node2.unbounded && SurfaceArea(node1.bounds) >= SurfaceArea(node2.bounds))));
+
+		int count = split1 ? ExpandCollideNode(mesh1, node1, children) :
+			ExpandCollideNode(mesh2, node2, children);
+
+		for (int i = 0; i < count; ++i)
+		{
+			const CollideNode& child1 = split1 ? children[i] : node1;
+			const CollideNode& child2 = split1 ? node2 : children[i];
 
-			if (iterator->children != 0)
+			if (top == BVH_TRAVERSAL_STACK_SIZE)
 			{
-				for (int i = 8 - 1; i >= 0; --i)
+				// Only very deep, unbalanced trees get here
+				if (CollidePairs(mesh1, child1, mesh2, child2, relative, outPairs))
 				{
-					if (AABBTriangle(iterator->children[i].bounds, triangle))
+					result = true;
+
+					if (outPairs == 0)
 					{
-						toProcess.push_front(&iterator->children[i]);
+						return true;
 					}
 				}
+				continue;
 			}
+
+			stack[top][0] = child1;
+			stack[top++][1] = child2;
 		}
 	}
 
-	return false;
+	return result;
 }
 
-Mat4 GetWorldMatrix(const Model& model)
+// relative takes points from the space of mesh2 into the space of mesh1
+static bool CollideMeshes(const Mesh& mesh1, const Mesh& mesh2, const Mat4& relative,
+	std::vector<TrianglePair>* outPairs)
 {
-	Mat4 translation = Translation(model.position);
-	Mat4 rotation = Rotation(
-		model.rotation.x, 
-		model.rotation.y, 
-		model.rotation.z);
+	size_t firstPair = outPairs != 0 ? outPairs->size() : 0;
+	bool result = CollidePairs(mesh1, CollideRoot(mesh1), mesh2, CollideRoot(mesh2),
+		relative, outPairs);
 
-	Mat4 localMat = rotation * translation;
-	
-	Mat4 parentMat;
-	if (model.parent != 0)
+	// Triangles in several leaves report a pair more than once. Pairs the
+	// caller already had are left alone.
+	if (outPairs != 0 && result)
 	{
-		parentMat = GetWorldMatrix(*model.parent);
+		std::vector<TrianglePair>::iterator first = outPairs->begin() + firstPair;
+		std::sort(first, outPairs->end());
+		outPairs->erase(std::unique(first, outPairs->end()), outPairs->end());
 	}
 
-	return localMat * parentMat;
+	return result;
 }
 
-OBB GetOBB(const Model& model)
+bool MeshMesh(const Mesh& mesh1, const Mesh& mesh2, const Mat4& relative)
 {
-	Mat4 world = GetWorldMatrix(model);
-	AABB aabb = model.GetBounds();
-	OBB obb;
+	return CollideMeshes(mesh1, mesh2, relative, 0);
+}
 
-	obb.size = aabb.size;
-	obb.position = MultiplyPoint(aabb.position, world);
-	obb.orientation = Cut(world, 3, 3);
+bool MeshMesh(const Mesh& mesh1, const Mesh& mesh2, const Mat4& relative,
+	std::vector<TrianglePair>* outPairs)
+{
+	return CollideMeshes(mesh1, mesh2, relative, outPairs);
+}
 
-	return obb;
+Mat4 GetWorldMatrix(const Model& model)
+{
+	return model.GetWorldMatrix();
+}
+OBB GetOBB(const Model& model)
+{
+	return model.GetWorldOBB();
+}
+AABB GetAABB(const Model& model)
+{
+	return model.GetWorldAABB();
 }
 
 float ModelRay(const Model& model, const Ray& ray)
 {
-	Mat4 world = GetWorldMatrix(model);
-	Mat4 inv = Inverse(world);
+	const Mat4& inv = model.GetInverseWorldMatrix();
 	Ray local;
 	local.origin = MultiplyPoint(ray.origin, inv);
 	local.direction = MultiplyVector(ray.direction, inv);
@@ -1644,10 +4919,50 @@ float ModelRay(const Model& model, const Ray& ray)
 	return -1;
 }
 
+Point ClosestPoint(const Model& model, const Point& point)
+{
+	if (model.GetMesh() == 0 || model.GetMesh()->numTriangles == 0)
+	{
+		return ClosestPoint(GetOBB(model), point);
+	}
+
+	Point local = MultiplyPoint(point, model.GetInverseWorldMatrix());
+	return MultiplyPoint(ClosestPoint(*(model.GetMesh()), local), model.GetWorldMatrix());
+}
+
+float ModelRay(const Model& model, const Ray& ray, RaycastResult* outResult, int* outTriangle)
+{
+	ResetRaycastResult(outResult);
+
+	int triangle = -1;
+	const Mat4& inv = model.GetInverseWorldMatrix();
+	Ray local;
+	local.origin = MultiplyPoint(ray.origin, inv);
+	local.direction = MultiplyVector(ray.direction, inv);
+	local.NormalizeDirection();
+
+	float t = model.GetMesh() != 0 ? MeshRay(*(model.GetMesh()), local, &triangle) : -1;
+
+	if (outTriangle != 0)
+	{
+		*outTriangle = triangle;
+	}
+
+	if (t >= 0 && outResult != 0)
+	{
+		Plane plane = FromTriangle(model.GetMesh()->triangles[triangle]);
+		outResult->t = t;
+		outResult->hit = true;
+		outResult->point = ray.origin + ray.direction * t;
+		outResult->normal = Normalized(MultiplyVector(plane.normal, model.GetWorldMatrix()));
+	}
+
+	return t;
+}
+
 bool LineTest(const Model& model, const Line& line)
 {
-	Mat4 world = GetWorldMatrix(model);
-	Mat4 inv = Inverse(world);
+	const Mat4& inv = model.GetInverseWorldMatrix();
 
 	Line local;
 	local.start = MultiplyPoint(line.start, inv);
@@ -1663,11 +4978,11 @@ bool LineTest(const Model& model, const Line& line)
 
 bool ModelSphere(const Model& model, const Sphere& sphere)
 {
-	Mat4 world = GetWorldMatrix(model);
-	Mat4 inv = Inverse(world);
+	const Mat4& inv = model.GetInverseWorldMatrix();
 
 	Sphere local;
 	local.position = MultiplyPoint(sphere.position, inv);
+	local.radius = sphere.radius;
 
 	if (model.GetMesh() != 0)
 	{
@@ -1677,10 +4992,25 @@ bool ModelSphere(const Model& model, const Sphere& sphere)
 	return false;
 }
 
+int ModelSphere(const Model& model, const Sphere& sphere, int* outTriangles, int maxTriangles)
+{
+	const Mat4& inv = model.GetInverseWorldMatrix();
+
+	Sphere local;
+	local.position = MultiplyPoint(sphere.position, inv);
+	local.radius = sphere.radius;
+
+	if (model.GetMesh() != 0)
+	{
+		return MeshSphere(*(model.GetMesh()), local, outTriangles, maxTriangles);
+	}
+
+	return 0;
+}
+
 bool ModelAABB(const Model& model, const AABB& aabb)
 {
-	Mat4 world = GetWorldMatrix(model);
-	Mat4 inv = Inverse(world);
+	const Mat4& inv = model.GetInverseWorldMatrix();
 
 	OBB local;
 	local.size = aabb.size;
@@ -1695,10 +5025,26 @@ bool ModelAABB(const Model& model, const AABB& aabb)
 	return false;
 }
 
+int ModelAABB(const Model& model, const AABB& aabb, int* outTriangles, int maxTriangles)
+{
+	const Mat4& inv = model.GetInverseWorldMatrix();
+
+	OBB local;
+	local.size = aabb.size;
+	local.position = MultiplyPoint(aabb.position, inv);
+	local.orientation = Cut(inv, 3, 3);
+
+	if (model.GetMesh() != 0)
+	{
+		return MeshOBB(*(model.GetMesh()), local, outTriangles, maxTriangles);
+	}
+
+	return 0;
+}
+
 bool ModelOBB(const Model& model, const OBB& obb)
 {
-	Mat4 world = GetWorldMatrix(model);
-	Mat4 inv = Inverse(world);
+	const Mat4& inv = model.GetInverseWorldMatrix();
 
 	OBB local;
 	local.size = obb.size;
@@ -1713,10 +5059,26 @@ bool ModelOBB(const Model& model, const OBB& obb)
 	return false;
 }
 
+int ModelOBB(const Model& model, const OBB& obb, int* outTriangles, int maxTriangles)
+{
+	const Mat4& inv = model.GetInverseWorldMatrix();
+
+	OBB local;
+	local.size = obb.size;
+	local.position = MultiplyPoint(obb.position, inv);
+	local.orientation = obb.orientation * Cut(inv, 3, 3);
+
+	if (model.GetMesh() != 0)
+	{
+		return MeshOBB(*(model.GetMesh()), local, outTriangles, maxTriangles);
+	}
+
+	return 0;
+}
+
 bool ModelPlane(const Model& model, const Plane& plane)
 {
-	Mat4 world = GetWorldMatrix(model);
-	Mat4 inv = Inverse(world);
+	const Mat4& inv = model.GetInverseWorldMatrix();
 
 	Plane local;
 	local.normal = MultiplyVector(plane.normal, inv);
@@ -1732,8 +5094,7 @@ bool ModelPlane(const Model& model, const Plane& plane)
 
 bool ModelTriangle(const Model& model, const Triangle& triangle)
 {
-	Mat4 world = GetWorldMatrix(model);
-	Mat4 inv = Inverse(world);
+	const Mat4& inv = model.GetInverseWorldMatrix();
 
 	Triangle local;
 	local.a = MultiplyPoint(triangle.a, inv);
@@ -1748,6 +5109,31 @@ bool ModelTriangle(const Model& model, const Triangle& triangle)
 	return false;
 }
 
+bool ModelModel(const Model& model1, const Model& model2)
+{
+	if (model1.GetMesh() == 0 || model2.GetMesh() == 0)
+	{
+		return false;
+	}
+
+	Mat4 relative = model2.GetWorldMatrix() * model1.GetInverseWorldMatrix();
+
+	return MeshMesh(*(model1.GetMesh()), *(model2.GetMesh()), relative);
+}
+
+bool ModelModel(const Model& model1, const Model& model2,
+	std::vector<TrianglePair>* outPairs)
+{
+	if (model1.GetMesh() == 0 || model2.GetMesh() == 0)
+	{
+		return false;
+	}
+
+	Mat4 relative = model2.GetWorldMatrix() * model1.GetInverseWorldMatrix();
+
+	return MeshMesh(*(model1.GetMesh()), *(model2.GetMesh()), relative, outPairs);
+}
+
 Point Intersection(Plane plane1, Plane plane2, Plane plane3) 
 {
 	Mat3 D(
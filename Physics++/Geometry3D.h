@@ -2,6 +2,10 @@
 
 #include "Vectors.h"
 #include "Matrices.h"
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
 
 typedef Vec3 Point;
 #define AABBShpere(aabb, sphere)    SphereAABB(sphere, aabb)
@@ -117,7 +121,44 @@ struct BVHNode
 	BVHNode* children;
 	int numTriangles;
 	int* triangles;
-	BVHNode() : children(0), numTriangles(0), triangles(0) { }
+	// Levels left to split the first time a query reaches this leaf,
+	// only set by AccelarateMeshLazy
+	std::atomic<int> pendingDepth;
+	// Octants from the root down to the cell a pending leaf splits, three
+	// bits per level below a leading 1
+	int pendingCell;
+	BVHNode() : children(0), numTriangles(0), triangles(0), pendingDepth(0), pendingCell(0) { }
+};
+
+struct WideBVH
+{
+	int width;
+	int numNodes;
+	float* bounds;
+	int* children;
+	int* counts;
+	int* numChildren;
+	int* triangles;
+	WideBVH() : width(0), numNodes(0), bounds(0), children(0),
+		counts(0), numChildren(0), triangles(0) { }
+};
+
+struct CompressedBVH
+{
+	int width;
+	int bits;
+	int numNodes;
+	float* origins;
+	float* scales;
+	unsigned char* bounds8;
+	unsigned short* bounds16;
+	unsigned int* children;
+	unsigned short* counts;
+	unsigned char* numChildren;
+	int* triangles;
+	CompressedBVH() : width(0), bits(0), numNodes(0), origins(0), scales(0),
+		bounds8(0), bounds16(0), children(0), counts(0), numChildren(0),
+		triangles(0) { }
 };
 
 typedef struct Mesh
@@ -132,7 +173,11 @@ typedef struct Mesh
 	};
 
 	BVHNode* accelerator;
-	Mesh() : numTriangles(0), values(0), accelerator(0) { }
+	float acceleratorCost;
+	WideBVH* wideAccelerator;
+	CompressedBVH* compressedAccelerator;
+	Mesh() : numTriangles(0), values(0), accelerator(0), acceleratorCost(0),
+		wideAccelerator(0), compressedAccelerator(0) { }
 } Mesh;
 
 #undef near
@@ -164,21 +209,113 @@ struct RaycastResult
 	bool hit;
 };
 
+struct TrianglePair
+{
+	int triangle1;
+	int triangle2;
+};
+
+// Describes the tree the queries use, the compressed or wide one if the
+// mesh has one. Their leaf slots count as nodes.
+struct BVHStats
+{
+	int numNodes;
+	int numLeaves;
+	int numEmptyNodes;
+	int numPendingNodes;
+	int maxDepth;
+	float averageLeafDepth;
+	int minLeafTriangles;
+	int maxLeafTriangles;
+	float averageLeafTriangles;
+	int numReferences;
+	int numDuplicateReferences;
+	float sahCost;
+
+	// Invariant violations, a healthy tree has all of these at zero
+	int numMissingTriangles;
+	int numInvalidReferences;
+	int numUncontainedChildren;
+	int numDisjointTriangles;
+	bool valid;
+};
+
+// Number of scene queries that can deduplicate their results at the same
+// time, see Model::FirstVisit
+#define MODEL_QUERY_LANES 8
+
 class Model
 {
 protected:
 	Mesh* content;
 	AABB bounds;
 
+	// World space caches. They remember the inputs they were built from and
+	// are rebuilt on read once position, rotation, parent or the parent's
+	// own cache changed, so writes to the public fields need no setter.
+	// Reads update the caches, concurrent readers must warm them first.
+	mutable Mat4 worldCache;
+	mutable Mat4 inverseWorldCache;
+	mutable OBB obbCache;
+	mutable AABB aabbCache;
+	mutable Vec3 cachedPosition;
+	mutable Vec3 cachedRotation;
+	mutable const Model* cachedParent;
+	mutable unsigned int cachedParentRevision;
+	mutable unsigned int revision;
+	mutable bool cacheValid;
+	mutable bool inverseValid;
+
+	// Last query that reported this model, per query lane
+	mutable unsigned long long queryStamps[MODEL_QUERY_LANES];
+
+	unsigned int RefreshCache() const;
+	// True if the caches match the model's inputs, given that the parent's
+	// caches are up to date
+	bool IsCacheCurrent() const;
+	// Stores an already computed world matrix and the caches derived from
+	// it, returns the new revision
+	unsigned int StoreWorld(const Mat4& world) const;
+
+	// Scene::UpdateTransforms fills the caches level by level
+	friend class Scene;
+
 public:
 	Vec3 position;
 	Vec3 rotation;
 	Model* parent;
 
-	inline Model() : parent(0) { }
+	inline Model() : cachedParent(0), cachedParentRevision(0), revision(0),
+		cacheValid(false), inverseValid(false), parent(0)
+	{
+		for (int i = 0; i < MODEL_QUERY_LANES; ++i)
+		{
+			queryStamps[i] = 0;
+		}
+	}
 	inline Mesh* GetMesh() const { return content; }
 	inline AABB GetBounds() const { return bounds; }
 	void SetContent(Mesh* mesh);
+
+	inline void MarkDirty() { cacheValid = false; }
+	// Rotation(rotation) * Translation(position) without the products
+	Mat4 GetLocalMatrix() const;
+	inline const Mat4& GetWorldMatrix() const { RefreshCache(); return worldCache; }
+	const Mat4& GetInverseWorldMatrix() const;
+	inline const OBB& GetWorldOBB() const { RefreshCache(); return obbCache; }
+	inline const AABB& GetWorldAABB() const { RefreshCache(); return aabbCache; }
+
+	// True the first time a query stamps this model with epoch. Only the
+	// query owning lane may call it.
+	inline bool FirstVisit(int lane, unsigned long long epoch) const
+	{
+		if (queryStamps[lane] == epoch)
+		{
+			return false;
+		}
+		queryStamps[lane] = epoch;
+		return true;
+	}
 };
 
 float Lenght(const Line& line);
@@ -189,6 +326,7 @@ Ray FromPoints(const Point& from, const Point& to);
 Vec3 GetMin(const AABB& aabb);
 Vec3 GetMax(const AABB& aabb);
 AABB FromMinMax(const Vec3& min, const Vec3& max);
+float SurfaceArea(const AABB& aabb);
 
 float PlaneEquation(const Point& point, const Plane& plane);
 
@@ -229,6 +367,7 @@ Interval GetInterval(const OBB& obb, const Vec3& axis);
 
 bool Raycast(const Sphere& sphere, const Ray& ray, RaycastResult* outResult);
 bool Raycast(const AABB& aabb, const Ray& ray, RaycastResult* outResult);
+float RaycastEntry(const AABB& aabb, const Ray& ray);
 bool Raycast(const OBB& obb, const Ray& ray, RaycastResult* outResult);
 bool Raycast(const Plane& plane, const Ray& ray, RaycastResult* outResult);
 bool Raycast(const Triangle& triangle, const Ray& ray, RaycastResult* outResult);
@@ -257,25 +396,197 @@ bool TriangleTriangle(const Triangle& triangle1, const Triangle& triangle2);
 bool TriangleTriangleRobust(const Triangle& triangle1, const Triangle& triangle2);
 
 void AccelarateMesh(Mesh& mesh);
+void AccelarateMeshLBVH(Mesh& mesh, int mortonBits, int numThreads, bool flatten);
+void AccelarateMeshSBVH(Mesh& mesh, float maxDuplication);
+void AccelarateMeshLazy(Mesh& mesh, int eagerDepth);
+void SplitPendingBVHNode(BVHNode* node, const Mesh& mesh);
+void SplitAllPendingBVHNodes(BVHNode* node, const Mesh& mesh);
+void FlattenBVHNodes(BVHNode* node);
 void SplitBVHNode(BVHNode* node, const Mesh& model, int depth);
 void FreeBVHNode(BVHNode* node);
+bool RefitBVHNode(BVHNode* node, const Mesh& mesh);
+float RefitMesh(Mesh& mesh);
+float BVHCost(const Mesh& mesh);
+BVHStats ComputeStats(const Mesh& mesh);
+bool CollapseBVH(Mesh& mesh, int width);
+void FreeWideBVH(WideBVH* bvh);
+bool CompressBVH(Mesh& mesh, int bits);
+void FreeCompressedBVH(CompressedBVH* bvh);
 float MeshRay(const Mesh& mesh, const Ray& ray);
+float MeshRay(const Mesh& mesh, const Ray& ray, int* outTriangle);
+Point ClosestPoint(const Mesh& mesh, const Point& point);
+void MeshRayBatch(const Mesh& mesh, const Ray* rays, int count, RaycastResult* out);
 bool LineTest(const Mesh& mesh, const Line& line);
 bool MeshSphere(const Mesh& mesh, const Sphere& sphere);
 bool MeshAABB(const Mesh& mesh, const AABB& aabb);
 bool MeshOBB(const Mesh& mesh, const OBB& obb);
+int MeshSphere(const Mesh& mesh, const Sphere& sphere, int* outTriangles, int maxTriangles);
+int MeshAABB(const Mesh& mesh, const AABB& aabb, int* outTriangles, int maxTriangles);
+int MeshOBB(const Mesh& mesh, const OBB& obb, int* outTriangles, int maxTriangles);
 bool MeshPlane(const Mesh& mesh, const Plane& plane);
 bool MeshTriangle(const Mesh& mesh, const Triangle& triangle);
+bool MeshMesh(const Mesh& mesh1, const Mesh& mesh2, const Mat4& relative);
+// Appends each colliding pair once, sorted, after the pairs already in
+// outPairs
+bool MeshMesh(const Mesh& mesh1, const Mesh& mesh2, const Mat4& relative,
+	std::vector<TrianglePair>* outPairs);
+
+#define BVH_TRAVERSAL_STACK_SIZE 256
+
+// A node waiting for its lazy split is never empty, checking that first
+// keeps readers off the fields the splitting thread is writing
+inline bool IsEmptyBVHNode(const BVHNode* node)
+{
+	return node->pendingDepth.load(std::memory_order_acquire) == 0 &&
+		node->children == 0 && node->numTriangles == 0;
+}
+
+// Must be called before reading a node's children or triangles, it
+// finishes a lazily built node on first visit
+inline void EnsureBVHNode(const BVHNode* node, const Mesh& mesh)
+{
+	if (node->pendingDepth.load(std::memory_order_acquire) != 0)
+	{
+		SplitPendingBVHNode(const_cast<BVHNode*>(node), mesh);
+	}
+}
+
+// Stops at the first triangle that passes the leaf test
+struct BVHAnyHit
+{
+	bool hit;
+	BVHAnyHit() : hit(false) { }
+	bool operator()(int) { hit = true; return true; }
+};
+
+// Visits the whole tree, appending every triangle that passes the leaf test
+struct BVHCollectAll
+{
+	std::vector<int>* triangles;
+	BVHCollectAll(std::vector<int>* out) : triangles(out) { }
+	bool operator()(int triangle) { triangles->push_back(triangle); return false; }
+};
+
+// Writes triangles into a caller buffer, stopping once it is full. The
+// buffer is kept sorted so a triangle listed in several leaves is only
+// written once and never takes the place of another.
+struct BVHCollectBuffer
+{
+	int* triangles;
+	int capacity;
+	int count;
+	BVHCollectBuffer(int* out, int max) : triangles(out), capacity(max), count(0) { }
+	bool operator()(int triangle)
+	{
+		int* end = triangles + count;
+		int* at = std::lower_bound(triangles, end, triangle);
+		if (at != end && *at == triangle)
+		{
+			return false;
+		}
+
+		std::copy_backward(at, end, end + 1);
+		*at = triangle;
+		return ++count >= capacity;
+	}
+};
+
+// Depth-first walk over the subtree at root. NodeTest is called with a
+// child's bounds, LeafTest with a triangle, and Policy with the index of
+// every triangle that passed; returning true from Policy ends the walk.
+template <typename NodeTest, typename LeafTest, typename Policy>
+bool TraverseBVH(const Mesh& mesh, const BVHNode* root, const NodeTest& nodeTest,
+	const LeafTest& leafTest, Policy& policy)
+{
+	const BVHNode* stack[BVH_TRAVERSAL_STACK_SIZE];
+	int top = 0;
+	stack[top++] = root;
+
+	while (top > 0)
+	{
+		const BVHNode* node = stack[--top];
+		EnsureBVHNode(node, mesh);
+
+		for (int i = 0; i < node->numTriangles; ++i)
+		{
+			int triangle = node->triangles[i];
+			if (leafTest(mesh.triangles[triangle]) && policy(triangle))
+			{
+				return true;
+			}
+		}
+
+		if (node->children == 0)
+		{
+			continue;
+		}
+
+		for (int i = 8 - 1; i >= 0; --i)
+		{
+			const BVHNode* child = &node->children[i];
+			if (IsEmptyBVHNode(child) || !nodeTest(child->bounds))
+			{
+				continue;
+			}
+
+			if (top == BVH_TRAVERSAL_STACK_SIZE)
+			{
+				// Only very deep, unbalanced trees get here
+				if (TraverseBVH(mesh, child, nodeTest, leafTest, policy))
+				{
+					return true;
+				}
+				continue;
+			}
+
+			stack[top++] = child;
+		}
+	}
+
+	return false;
+}
+
+template <typename NodeTest, typename LeafTest, typename Policy>
+bool TraverseBVH(const Mesh& mesh, const NodeTest& nodeTest, const LeafTest& leafTest, Policy& policy)
+{
+	if (mesh.accelerator == 0)
+	{
+		for (int i = 0; i < mesh.numTriangles; ++i)
+		{
+			if (leafTest(mesh.triangles[i]) && policy(i))
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	return TraverseBVH(mesh, mesh.accelerator, nodeTest, leafTest, policy);
+}
 
 Mat4 GetWorldMatrix(const Model& model);
 OBB GetOBB(const Model& model);
+AABB GetAABB(const Model& model);
 float ModelRay(const Model& model, const Ray& ray);
+float ModelRay(const Model& model, const Ray& ray, RaycastResult* outResult, int* outTriangle);
+Point ClosestPoint(const Model& model, const Point& point);
 bool LineTest(const Model& model, const Line& line);
 bool ModelSphere(const Model& model, const Sphere& sphere);
 bool ModelAABB(const Model& model, const AABB& aabb);
 bool ModelOBB(const Model& model, const OBB& obb);
+int ModelSphere(const Model& model, const Sphere& sphere, int* outTriangles, int maxTriangles);
+int ModelAABB(const Model& model, const AABB& aabb, int* outTriangles, int maxTriangles);
+int ModelOBB(const Model& model, const OBB& obb, int* outTriangles, int maxTriangles);
 bool ModelPlane(const Model& model, const Plane& plane);
 bool ModelTriangle(const Model& model, const Triangle& triangle);
+bool ModelModel(const Model& model1, const Model& model2);
+bool ModelModel(const Model& model1, const Model& model2,
+	std::vector<TrianglePair>* outPairs);
+
+// Called for each model a scene query finds, returning false stops the query
+typedef bool (*ModelVisitor)(Model* model, void* userData);
+typedef bool (*ModelRayVisitor)(Model* model, float t, void* userData);
 
 Point Intersection(Plane plane1, Plane plane2, Plane plane3);
 void GetCorners(const Frustum& frustum, Vec3* outCorners);
@@ -286,6 +597,162 @@ float Classify(const OBB& obb, const Plane& plane);
 bool Intersects(const Frustum& frustum, const AABB& aabb);
 bool Intersects(const Frustum& frustum, const OBB& obb);
 
+// Bounds and model tests shared by the scene accelerators
+struct SceneSphereTest
+{
+	const Sphere& sphere;
+	SceneSphereTest(const Sphere& s) : sphere(s) { }
+	bool operator()(const AABB& bounds) const { return SphereAABB(sphere, bounds); }
+	bool operator()(const Model& model) const { return SphereOBB(sphere, GetOBB(model)); }
+};
+
+struct SceneAABBTest
+{
+	const AABB& aabb;
+	SceneAABBTest(const AABB& a) : aabb(a) { }
+	bool operator()(const AABB& bounds) const { return AABBAABB(aabb, bounds); }
+	bool operator()(const Model& model) const { return AABBOBB(aabb, GetOBB(model)); }
+};
+
+struct SceneFrustumTest
+{
+	const Frustum& frustum;
+	SceneFrustumTest(const Frustum& f) : frustum(f) { }
+	bool operator()(const AABB& bounds) const { return Intersects(frustum, bounds); }
+	bool operator()(const Model& model) const { return Intersects(frustum, GetOBB(model)); }
+};
+
+// Passes the models that pass test on to a visitor
+template <typename Test>
+struct SceneVisit
+{
+	const Test& test;
+	ModelVisitor visit;
+	void* userData;
+	SceneVisit(const Test& t, ModelVisitor v, void* u) : test(t), visit(v), userData(u) { }
+	bool operator()(Model* model) { return !test(*model) || visit(model, userData); }
+};
+
+template <typename Test>
+struct SceneCollect
+{
+	const Test& test;
+	std::vector<Model*>& result;
+	SceneCollect(const Test& t, std::vector<Model*>& r) : test(t), result(r) { }
+	bool operator()(Model* model)
+	{
+		if (test(*model))
+		{
+			result.push_back(model);
+		}
+		return true;
+	}
+};
+
+// Best-first k nearest model search shared by the scene accelerators.
+// Nodes and models wait in one queue ordered by a lower bound on their
+// distance, world AABB distance for models. A model popped the first time
+// is pushed back with its real distance, popped the second time it is the
+// next nearest. Expand(node, search) pushes a node's models and children.
+// Anything farther than the k-th nearest real distance seen so far can not
+// make the result and is never queued.
+template <typename Node>
+class NearestSearch
+{
+	struct Entry
+	{
+		float distanceSq;
+		Node node;
+		Model* model;
+		bool refined;
+		bool operator<(const Entry& other) const { return distanceSq > other.distanceSq; }
+	};
+
+	std::vector<Entry> queue;
+	// Max heap of the k smallest real distances pushed so far
+	std::vector<float> nearest;
+	Point point;
+	float maxDistanceSq;
+	bool exact;
+	int k;
+
+	void Push(float distanceSq, const Node& node, Model* model, bool refined)
+	{
+		if (distanceSq > maxDistanceSq ||
+			(!nearest.empty() && (int)nearest.size() >= k && distanceSq > nearest.front()))
+		{
+			return;
+		}
+
+		Entry entry = { distanceSq, node, model, refined };
+		queue.push_back(entry);
+		std::push_heap(queue.begin(), queue.end());
+
+		if (refined)
+		{
+			nearest.push_back(distanceSq);
+			std::push_heap(nearest.begin(), nearest.end());
+
+			if ((int)nearest.size() > k)
+			{
+				std::pop_heap(nearest.begin(), nearest.end());
+				nearest.pop_back();
+			}
+		}
+	}
+
+public:
+	NearestSearch(const Point& p, float maxDistance, bool e) :
+		point(p), maxDistanceSq(maxDistance * maxDistance), exact(e), k(0) { }
+
+	void PushNode(const Node& node, const AABB& bounds)
+	{
+		Push(MagnitudeSq(ClosestPoint(bounds, point) - point), node, 0, false);
+	}
+
+	void PushModel(Model* model)
+	{
+		Push(MagnitudeSq(ClosestPoint(GetAABB(*model), point) - point), Node(), model, false);
+	}
+
+	template <typename Expand>
+	int Run(const Node& root, int maxModels, Expand& expand, Model** outModels, float* outDistances)
+	{
+		int count = 0;
+		k = maxModels;
+		Push(0.0f, root, 0, false);
+
+		while (!queue.empty() && count < k)
+		{
+			std::pop_heap(queue.begin(), queue.end());
+			Entry entry = queue.back();
+			queue.pop_back();
+
+			if (entry.model == 0)
+			{
+				expand(entry.node, *this);
+			}
+			else if (!entry.refined)
+			{
+				Point closest = exact ? ClosestPoint(*entry.model, point) :
+					ClosestPoint(GetOBB(*entry.model), point);
+				Push(MagnitudeSq(closest - point), entry.node, entry.model, true);
+			}
+			else
+			{
+				outModels[count] = entry.model;
+				if (outDistances != 0)
+				{
+					outDistances[count] = sqrtf(entry.distanceSq);
+				}
+				++count;
+			}
+		}
+
+		return count;
+	}
+};
+
 Vec3 Uproject(const Vec3& viewportPoint, const Vec2& viewportOrigin,
 	const Vec2& viewportSize, const Mat4& view, const Mat4& projection);
 Ray GetPickRay(const Vec2& viewportPoint, const Vec2& viewportOrigin,
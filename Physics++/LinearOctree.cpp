@@ -0,0 +1,422 @@
+#include "LinearOctree.h"
+#include <algorithm>
+#include <utility>
+
+#define LINEAR_OCTREE_STACK_SIZE (LINEAR_OCTREE_MAX_DEPTH * 7 + 1)
+
+struct LinearOctreeEntry
+{
+	int node;
+	Vec3 center;
+	float half;
+};
+
+static bool ContainsAABB(const AABB& outer, const AABB& inner)
+{
+	Vec3 outerMin = GetMin(outer);
+	Vec3 outerMax = GetMax(outer);
+	Vec3 innerMin = GetMin(inner);
+	Vec3 innerMax = GetMax(inner);
+
+	return innerMin.x >= outerMin.x && innerMin.y >= outerMin.y && innerMin.z >= outerMin.z &&
+		innerMax.x <= outerMax.x && innerMax.y <= outerMax.y && innerMax.z <= outerMax.z;
+}
+
+static Vec3 ChildCenter(const Vec3& center, float childHalf, int digit)
+{
+	return center + Vec3(
+		(digit & 1) ? childHalf : -childHalf,
+		(digit & 2) ? childHalf : -childHalf,
+		(digit & 4) ? childHalf : -childHalf);
+}
+
+// Visits the models of every node whose loose bounds pass test, the root's
+// models are always visited since they may reach past the root cell.
+// Returns false as soon as visit does.
+template <typename NodeTest, typename Visit>
+static bool TraverseLinearOctree(const std::vector<LinearOctreeNode>& nodes,
+	const std::vector<Model*>& models, const Vec3& center, float size,
+	float looseness, const NodeTest& test, Visit& visit)
+{
+	if (nodes.empty())
+	{
+		return true;
+	}
+
+	LinearOctreeEntry stack[LINEAR_OCTREE_STACK_SIZE];
+	int top = 0;
+	stack[top].node = 0;
+	stack[top].center = center;
+	stack[top++].half = size;
+
+	while (top > 0)
+	{
+		LinearOctreeEntry entry = stack[--top];
+		const LinearOctreeNode& node = nodes[entry.node];
+
+		for (int i = node.firstModel, last = node.firstModel + node.numModels; i < last; ++i)
+		{
+			if (!visit(models[i]))
+			{
+				return false;
+			}
+		}
+
+		float childHalf = entry.half * 0.5f;
+		float looseHalf = childHalf * looseness;
+		int child = node.firstChild;
+
+		for (int digit = 0; digit < 8; ++digit)
+		{
+			if ((node.childMask & (1 << digit)) == 0)
+			{
+				continue;
+			}
+
+			Vec3 childCenter = ChildCenter(entry.center, childHalf, digit);
+			if (test(AABB(childCenter, Vec3(looseHalf, looseHalf, looseHalf))))
+			{
+				stack[top].node = child;
+				stack[top].center = childCenter;
+				stack[top++].half = childHalf;
+			}
+
+			++child;
+		}
+	}
+
+	return true;
+}
+
+unsigned int LinearOctree::FindKey(const AABB& bounds) const
+{
+	unsigned int key = LINEAR_OCTREE_ROOT;
+	Vec3 cellCenter = center;
+	float half = size;
+
+	for (int level = 0; level < depth; ++level)
+	{
+		float childHalf = half * 0.5f;
+		int digit = (bounds.position.x >= cellCenter.x ? 1 : 0) |
+			(bounds.position.y >= cellCenter.y ? 2 : 0) |
+			(bounds.position.z >= cellCenter.z ? 4 : 0);
+
+		Vec3 childCenter = ChildCenter(cellCenter, childHalf, digit);
+		float looseHalf = childHalf * looseness;
+
+		if (!ContainsAABB(AABB(childCenter, Vec3(looseHalf, looseHalf, looseHalf)), bounds))
+		{
+			break;
+		}
+
+		key = (key << 3) | digit;
+		cellCenter = childCenter;
+		half = childHalf;
+	}
+
+	return key;
+}
+
+void LinearOctree::Build(const std::vector<Model*>& objects, const Vec3& position,
+	float size, float looseness, int depth)
+{
+	this->center = position;
+	this->size = size;
+	this->looseness = looseness < 1.0f ? 1.0f : looseness;
+	this->depth = depth < 0 ? 0 : (depth > LINEAR_OCTREE_MAX_DEPTH ? LINEAR_OCTREE_MAX_DEPTH : depth);
+
+	std::vector<std::pair<unsigned int, Model*> > entries(objects.size());
+	for (int i = 0, count = objects.size(); i < count; ++i)
+	{
+		entries[i] = std::make_pair(FindKey(GetAABB(*objects[i])), objects[i]);
+	}
+	std::sort(entries.begin(), entries.end());
+
+	// Occupied cells and every ancestor on the way to the root
+	std::vector<unsigned int> keys;
+	keys.push_back(LINEAR_OCTREE_ROOT);
+	for (int i = 0, count = entries.size(); i < count; ++i)
+	{
+		if (i > 0 && entries[i].first == entries[i - 1].first)
+		{
+			continue;
+		}
+
+		for (unsigned int key = entries[i].first; key > LINEAR_OCTREE_ROOT; key >>= 3)
+		{
+			keys.push_back(key);
+		}
+	}
+	std::sort(keys.begin(), keys.end());
+	keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+	nodes.resize(keys.size());
+	models.resize(entries.size());
+
+	for (int i = 0, entry = 0, count = keys.size(); i < count; ++i)
+	{
+		LinearOctreeNode& node = nodes[i];
+		node.key = keys[i];
+		node.firstChild = -1;
+		node.childMask = 0;
+		node.firstModel = entry;
+
+		for (; entry < (int)entries.size() && entries[entry].first == node.key; ++entry)
+		{
+			models[entry] = entries[entry].second;
+		}
+		node.numModels = entry - node.firstModel;
+
+		if (node.key == LINEAR_OCTREE_ROOT)
+		{
+			continue;
+		}
+
+		// Keys sort level by level, so siblings end up next to each other
+		int parent = std::lower_bound(keys.begin(), keys.end(), node.key >> 3) - keys.begin();
+		nodes[parent].childMask |= 1 << (node.key & 7);
+		if (nodes[parent].firstChild < 0)
+		{
+			nodes[parent].firstChild = i;
+		}
+	}
+}
+
+struct LinearOctreeClosestHit
+{
+	const Ray& ray;
+	Model* closest;
+	float closestT;
+	int closestTriangle;
+	LinearOctreeClosestHit(const Ray& r) : ray(r), closest(0), closestT(-1), closestTriangle(-1) { }
+	// Whether a node entered at entry can still hold a closer hit
+	bool Reaches(float entry) const
+	{
+		return closest == 0 || entry <= closestT;
+	}
+	bool operator()(Model* model)
+	{
+		int triangle;
+		float t = ModelRay(*model, ray, 0, &triangle);
+		if (t >= 0 && (closest == 0 || t < closestT))
+		{
+			closest = model;
+			closestT = t;
+			closestTriangle = triangle;
+		}
+		return true;
+	}
+};
+
+// Like TraverseLinearOctree, but children are visited nearest first and
+// nodes entered past the closest hit so far are skipped
+static void RaycastLinearOctree(const std::vector<LinearOctreeNode>& nodes,
+	const std::vector<Model*>& models, const Vec3& center, float size,
+	float looseness, LinearOctreeClosestHit& hit)
+{
+	if (nodes.empty())
+	{
+		return;
+	}
+
+	LinearOctreeEntry stack[LINEAR_OCTREE_STACK_SIZE];
+	float stackEntry[LINEAR_OCTREE_STACK_SIZE];
+	int top = 0;
+	stack[top].node = 0;
+	stack[top].center = center;
+	stack[top].half = size;
+	stackEntry[top++] = 0.0f;
+
+	while (top > 0)
+	{
+		--top;
+		if (!hit.Reaches(stackEntry[top]))
+		{
+			continue;
+		}
+
+		LinearOctreeEntry entry = stack[top];
+		const LinearOctreeNode& node = nodes[entry.node];
+
+		for (int i = node.firstModel, last = node.firstModel + node.numModels; i < last; ++i)
+		{
+			hit(models[i]);
+		}
+
+		float childHalf = entry.half * 0.5f;
+		float looseHalf = childHalf * looseness;
+		int child = node.firstChild;
+		int first = top;
+
+		for (int digit = 0; digit < 8; ++digit)
+		{
+			if ((node.childMask & (1 << digit)) == 0)
+			{
+				continue;
+			}
+
+			Vec3 childCenter = ChildCenter(entry.center, childHalf, digit);
+			float childEntry = RaycastEntry(AABB(childCenter, Vec3(looseHalf, looseHalf, looseHalf)), hit.ray);
+
+			if (childEntry >= 0 && hit.Reaches(childEntry))
+			{
+				// Keep the children sorted so the nearest one is popped first
+				int i = top++;
+				for (; i > first && stackEntry[i - 1] < childEntry; --i)
+				{
+					stack[i] = stack[i - 1];
+					stackEntry[i] = stackEntry[i - 1];
+				}
+				stack[i].node = child;
+				stack[i].center = childCenter;
+				stack[i].half = childHalf;
+				stackEntry[i] = childEntry;
+			}
+
+			++child;
+		}
+	}
+}
+
+struct LinearOctreeRayVisit
+{
+	const Ray& ray;
+	ModelRayVisitor visit;
+	void* userData;
+	LinearOctreeRayVisit(const Ray& r, ModelRayVisitor v, void* u) : ray(r), visit(v), userData(u) { }
+	bool operator()(const AABB& bounds) const
+	{
+		return RaycastEntry(bounds, ray) >= 0;
+	}
+	bool operator()(Model* model)
+	{
+		float t = ModelRay(*model, ray);
+		return t < 0 || visit(model, t, userData);
+	}
+};
+
+Model* LinearOctree::Raycast(const Ray& ray) const
+{
+	float t;
+	int triangle;
+	return Raycast(ray, &t, &triangle);
+}
+
+Model* LinearOctree::Raycast(const Ray& ray, float* outT, int* outTriangle) const
+{
+	LinearOctreeClosestHit raycast(ray);
+	RaycastLinearOctree(nodes, models, center, size, looseness, raycast);
+
+	*outT = raycast.closestT;
+	*outTriangle = raycast.closestTriangle;
+
+	return raycast.closest;
+}
+
+bool LinearOctree::Raycast(const Ray& ray, ModelRayVisitor visit, void* userData) const
+{
+	LinearOctreeRayVisit raycast(ray, visit, userData);
+	return TraverseLinearOctree(nodes, models, center, size, looseness, raycast, raycast);
+}
+
+std::vector<Model*> LinearOctree::Query(const Sphere& sphere) const
+{
+	std::vector<Model*> result;
+	SceneSphereTest test(sphere);
+	SceneCollect<SceneSphereTest> collect(test, result);
+	TraverseLinearOctree(nodes, models, center, size, looseness, test, collect);
+	return result;
+}
+
+bool LinearOctree::Query(const Sphere& sphere, ModelVisitor visit, void* userData) const
+{
+	SceneSphereTest test(sphere);
+	SceneVisit<SceneSphereTest> visitor(test, visit, userData);
+	return TraverseLinearOctree(nodes, models, center, size, looseness, test, visitor);
+}
+
+std::vector<Model*> LinearOctree::Query(const AABB& aabb) const
+{
+	std::vector<Model*> result;
+	SceneAABBTest test(aabb);
+	SceneCollect<SceneAABBTest> collect(test, result);
+	TraverseLinearOctree(nodes, models, center, size, looseness, test, collect);
+	return result;
+}
+
+bool LinearOctree::Query(const AABB& aabb, ModelVisitor visit, void* userData) const
+{
+	SceneAABBTest test(aabb);
+	SceneVisit<SceneAABBTest> visitor(test, visit, userData);
+	return TraverseLinearOctree(nodes, models, center, size, looseness, test, visitor);
+}
+
+std::vector<Model*> LinearOctree::Cull(const Frustum& frustum) const
+{
+	std::vector<Model*> result;
+	SceneFrustumTest test(frustum);
+	SceneCollect<SceneFrustumTest> collect(test, result);
+	TraverseLinearOctree(nodes, models, center, size, looseness, test, collect);
+	return result;
+}
+
+bool LinearOctree::Cull(const Frustum& frustum, ModelVisitor visit, void* userData) const
+{
+	SceneFrustumTest test(frustum);
+	SceneVisit<SceneFrustumTest> visitor(test, visit, userData);
+	return TraverseLinearOctree(nodes, models, center, size, looseness, test, visitor);
+}
+
+struct LinearOctreeNearestExpand
+{
+	const std::vector<LinearOctreeNode>& nodes;
+	const std::vector<Model*>& models;
+	float looseness;
+	LinearOctreeNearestExpand(const std::vector<LinearOctreeNode>& n,
+		const std::vector<Model*>& m, float l) : nodes(n), models(m), looseness(l) { }
+	void operator()(const LinearOctreeEntry& entry, NearestSearch<LinearOctreeEntry>& search) const
+	{
+		const LinearOctreeNode& node = nodes[entry.node];
+
+		for (int i = node.firstModel, last = node.firstModel + node.numModels; i < last; ++i)
+		{
+			search.PushModel(models[i]);
+		}
+
+		float childHalf = entry.half * 0.5f;
+		float looseHalf = childHalf * looseness;
+		int child = node.firstChild;
+
+		for (int digit = 0; digit < 8; ++digit)
+		{
+			if ((node.childMask & (1 << digit)) == 0)
+			{
+				continue;
+			}
+
+			LinearOctreeEntry next;
+			next.node = child++;
+			next.center = ChildCenter(entry.center, childHalf, digit);
+			next.half = childHalf;
+			search.PushNode(next, AABB(next.center, Vec3(looseHalf, looseHalf, looseHalf)));
+		}
+	}
+};
+
+int LinearOctree::Nearest(const Point& point, int k, float maxDistance, bool exact,
+	Model** outModels, float* outDistances) const
+{
+	if (nodes.empty())
+	{
+		return 0;
+	}
+
+	LinearOctreeEntry root;
+	root.node = 0;
+	root.center = center;
+	root.half = size;
+
+	NearestSearch<LinearOctreeEntry> search(point, maxDistance, exact);
+	LinearOctreeNearestExpand expand(nodes, models, looseness);
+	return search.Run(root, k, expand, outModels, outDistances);
+}
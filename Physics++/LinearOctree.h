@@ -0,0 +1,58 @@
+#pragma once
+
+#include "Geometry3D.h"
+#include <vector>
+
+// Key of an octree cell: a leading 1 followed by one 3 bit octant digit
+// per level, so keys sort level by level and a parent is key >> 3
+#define LINEAR_OCTREE_ROOT 1u
+#define LINEAR_OCTREE_MAX_DEPTH 10
+
+struct LinearOctreeNode
+{
+	unsigned int key;
+	// Occupied children are stored next to each other starting here
+	int firstChild;
+	unsigned char childMask;
+	// Range of this node's models in LinearOctree::models
+	int firstModel;
+	int numModels;
+};
+
+// Loose octree that only stores occupied cells and their ancestors. Nodes
+// live in one array sorted by key, models in one packed array.
+class LinearOctree
+{
+protected:
+	std::vector<LinearOctreeNode> nodes;
+	std::vector<Model*> models;
+	Vec3 center;
+	float size;
+	float looseness;
+	int depth;
+
+	unsigned int FindKey(const AABB& bounds) const;
+
+public:
+	inline LinearOctree() : size(1.0f), looseness(2.0f), depth(5) { }
+
+	void Build(const std::vector<Model*>& objects, const Vec3& position,
+		float size, float looseness, int depth);
+	inline int NumNodes() const { return nodes.size(); }
+
+	Model* Raycast(const Ray& ray) const;
+	// Also reports the distance and mesh triangle of the hit, -1 on a miss
+	Model* Raycast(const Ray& ray, float* outT, int* outTriangle) const;
+	std::vector<Model*> Query(const Sphere& sphere) const;
+	std::vector<Model*> Query(const AABB& aabb) const;
+	std::vector<Model*> Cull(const Frustum& frustum) const;
+
+	// Return false if visit stopped the traversal early
+	bool Raycast(const Ray& ray, ModelRayVisitor visit, void* userData) const;
+	bool Query(const Sphere& sphere, ModelVisitor visit, void* userData) const;
+	bool Query(const AABB& aabb, ModelVisitor visit, void* userData) const;
+	bool Cull(const Frustum& frustum, ModelVisitor visit, void* userData) const;
+	// See Scene::Nearest
+	int Nearest(const Point& point, int k, float maxDistance, bool exact,
+		Model** outModels, float* outDistances) const;
+};
@@ -1,427 +1,1709 @@
 #include "Scene.h"
 #include <algorithm>
+#include <cfloat>
 #include <stack>
-#include <list>
+#include <atomic>
+#include <thread>
+#include <unordered_set>
+
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SCENE_TRANSFORM_SSE
+#endif
+
+#define OCTREE_DEPTH 5
+#define RAY_BATCH_CHUNK 64
+// Fewest chunks worth starting a batch thread for
+#define RAY_BATCH_THREAD_CHUNKS 4
+// Smallest share of a hierarchy level worth a thread of its own
+#define TRANSFORM_THREAD_MIN 4096
+// Radians, larger angles fall back to sinf and cosf
+#define TRANSFORM_MAX_ANGLE 8192.0f
+
+static bool ContainsAABB(const AABB& outer, const AABB& inner);
+static void RemoveFromNode(OctreeNode* node, Model* model);
 
 void Scene::AddModel(Model* model)
 {
-	if (std::find(objects.begin(), objects.end(), model) != objects.end())
+	SceneHierarchyNode& node = hierarchy[model];
+	if (node.inScene)
 	{
 		return;
 	}
 
 	objects.push_back(model);
+	node.inScene = true;
+	transformsDirty = true;
+	Refile(model);
+	linearOctreeDirty = linearOctree != 0;
+
+	if (aabbTree != 0)
+	{
+		proxies[model] = aabbTree->Insert(model);
+	}
+
+	if (octree == 0)
+	{
+		return;
+	}
+
+	std::vector<OctreeNode*>& nodes = owners[model];
+
+	if (looseness > 1.0f)
+	{
+		nodes.push_back(InsertLoose(octree, model, OCTREE_DEPTH, looseness));
+	}
+	else
+	{
+		Insert(octree, model, &nodes);
+	}
 }
 
 void Scene::RemoveModel(Model* model) 
 {
+	std::map<const Model*, SceneHierarchyNode>::iterator filed = hierarchy.find(model);
+	if (filed == hierarchy.end() || !filed->second.inScene)
+	{
+		return;
+	}
+
 	objects.erase(std::remove(objects.begin(), objects.end(), model), 
 		objects.end());
+	filed->second.inScene = false;
+	transformsDirty = true;
+	Prune(model);
+	linearOctreeDirty = linearOctree != 0;
+
+	std::map<Model*, int>::iterator proxy = proxies.find(model);
+	if (proxy != proxies.end())
+	{
+		aabbTree->Remove(proxy->second);
+		proxies.erase(proxy);
+	}
+
+	std::map<Model*, std::vector<OctreeNode*> >::iterator it = owners.find(model);
+	if (it == owners.end())
+	{
+		return;
+	}
+
+	for (int i = 0, size = it->second.size(); i < size; ++i)
+	{
+		RemoveFromNode(it->second[i], model);
+	}
+
+	owners.erase(it);
+}
+
+static int GetLevel(const OctreeNode* node)
+{
+	int level = 0;
+
+	for (; node->parent != 0; node = node->parent)
+	{
+		++level;
+	}
+
+	return level;
+}
+
+static OctreeNode* CommonAncestor(OctreeNode* a, OctreeNode* b)
+{
+	int levelA = GetLevel(a);
+	int levelB = GetLevel(b);
+
+	for (; levelA > levelB; --levelA)
+	{
+		a = a->parent;
+	}
+	for (; levelB > levelA; --levelB)
+	{
+		b = b->parent;
+	}
+
+	while (a != b)
+	{
+		a = a->parent;
+		b = b->parent;
+	}
+
+	return a;
 }
 
 void Scene::UpdateModel(Model* model)
 {
-	// Placeholder
+	Refile(model);
+
+	if (linearOctree != 0)
+	{
+		linearOctreeDirty = true;
+	}
+
+	std::map<Model*, int>::iterator proxy = proxies.find(model);
+	if (proxy != proxies.end())
+	{
+		aabbTree->Move(proxy->second);
+	}
+
+	if (octree == 0)
+	{
+		return;
+	}
+
+	std::map<Model*, std::vector<OctreeNode*> >::iterator it = owners.find(model);
+	if (it == owners.end())
+	{
+		return;
+	}
+
+	std::vector<OctreeNode*>& nodes = it->second;
+	AABB bounds = GetAABB(*model);
+
+	// A model that still fits inside the one node holding it stays there
+	if (nodes.size() == 1 && ContainsAABB(nodes[0]->bounds, bounds))
+	{
+		return;
+	}
+
+	// Reinsert from the smallest ancestor of the old nodes that holds the
+	// new bounds, only that subtree is touched
+	OctreeNode* ancestor = nodes.empty() ? octree : nodes[0];
+	for (int i = 1, size = nodes.size(); i < size; ++i)
+	{
+		ancestor = CommonAncestor(ancestor, nodes[i]);
+	}
+
+	while (ancestor->parent != 0 && !ContainsAABB(ancestor->bounds, bounds))
+	{
+		ancestor = ancestor->parent;
+	}
+
+	for (int i = 0, size = nodes.size(); i < size; ++i)
+	{
+		RemoveFromNode(nodes[i], model);
+	}
+	nodes.clear();
+
+	if (looseness > 1.0f)
+	{
+		nodes.push_back(InsertLoose(ancestor, model, OCTREE_DEPTH - GetLevel(ancestor), looseness));
+	}
+	else
+	{
+		Insert(ancestor, model, &nodes);
+	}
+}
+
+void Scene::UpdateModels(Model** models, int count)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		UpdateModel(models[i]);
+	}
 }
 
-std::vector<Model*> Scene::FindChildren(const Model* model)
+void Scene::RefreshLinearOctree()
 {
-	std::vector<Model*> result;
+	if (linearOctreeDirty)
+	{
+		linearOctree->Build(objects, linearOctreeCenter, linearOctreeSize, looseness, OCTREE_DEPTH);
+		linearOctreeDirty = false;
+	}
+}
 
-	for (int i = 0, size = objects.size(); i < size; ++i)
+void Scene::FindOwners(OctreeNode* node)
+{
+	for (int i = 0, size = node->models.size(); i < size; ++i)
 	{
-		if (objects[i] == 0 || objects[i] == model)
+		owners[node->models[i]].push_back(node);
+	}
+
+	if (node->children != 0)
+	{
+		for (int i = 0; i < 8; ++i)
 		{
-			continue;
+			FindOwners(&node->children[i]);
+		}
+	}
+}
+
+// Files model under its parent, filing missing ancestors as links
+void Scene::File(Model* model)
+{
+	Model* parent = model->parent;
+	hierarchy[model].parent = parent;
+	transformsDirty = true;
+
+	if (parent == 0)
+	{
+		return;
+	}
+
+	std::map<const Model*, SceneHierarchyNode>::iterator filed = hierarchy.find(parent);
+	if (filed == hierarchy.end())
+	{
+		filed = hierarchy.insert(std::make_pair((const Model*)parent, SceneHierarchyNode())).first;
+		File(parent);
+	}
+
+	filed->second.children.push_back(model);
+}
+
+void Scene::Unfile(Model* model)
+{
+	SceneHierarchyNode& node = hierarchy[model];
+	Model* parent = node.parent;
+	node.parent = 0;
+	transformsDirty = true;
+
+	if (parent == 0)
+	{
+		return;
+	}
+
+	std::vector<Model*>& siblings = hierarchy[parent].children;
+	siblings.erase(std::find(siblings.begin(), siblings.end(), model));
+	Prune(parent);
+}
+
+// Moves a filed model under its current parent if it was written directly
+void Scene::Refile(Model* model)
+{
+	std::map<const Model*, SceneHierarchyNode>::iterator filed = hierarchy.find(model);
+	if (filed == hierarchy.end())
+	{
+		return;
+	}
+
+	if (filed->second.parent != model->parent)
+	{
+		Unfile(model);
+		File(model);
+	}
+}
+
+// Drops links with nothing left below them
+void Scene::Prune(Model* model)
+{
+	std::map<const Model*, SceneHierarchyNode>::iterator filed = hierarchy.find(model);
+	if (filed->second.inScene || !filed->second.children.empty())
+	{
+		return;
+	}
+
+	Unfile(model);
+	hierarchy.erase(model);
+}
+
+void Scene::FlattenHierarchy()
+{
+	transformModels.clear();
+	transformParents.clear();
+	transformInScene.clear();
+	transformLevels.clear();
+
+	for (std::map<const Model*, SceneHierarchyNode>::iterator it = hierarchy.begin();
+		it != hierarchy.end(); ++it)
+	{
+		if (it->second.parent == 0)
+		{
+			// Every filed model was handed to the scene as non-const
+			transformModels.push_back(const_cast<Model*>(it->first));
+			transformParents.push_back(-1);
+			transformInScene.push_back(it->second.inScene);
 		}
+	}
+
+	for (int first = 0, last = transformModels.size(); first < last; first = last, last = transformModels.size())
+	{
+		transformLevels.push_back(first);
 
-		Model* iterator = objects[i]->parent;
-		if (iterator != 0)
+		for (int i = first; i < last; ++i)
 		{
-			if (iterator == model)
+			const std::vector<Model*>& children = hierarchy[transformModels[i]].children;
+
+			for (int j = 0, size = children.size(); j < size; ++j)
 			{
-				result.push_back(objects[i]);
-				continue;
+				transformModels.push_back(children[j]);
+				transformParents.push_back(i);
+				transformInScene.push_back(hierarchy[children[j]].inScene);
 			}
-			iterator = iterator->parent;
 		}
 	}
+	transformLevels.push_back(transformModels.size());
+
+	transformWorlds.resize(transformModels.size());
+	transformChanged.resize(transformModels.size());
+	transformWork.resize(transformModels.size());
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		transformPositions[axis].resize(transformModels.size());
+		transformRotations[axis].resize(transformModels.size());
+	}
+	transformsDirty = false;
+}
 
+std::vector<Model*> Scene::FindChildren(const Model* model)
+{
+	std::vector<Model*> result;
+	FindChildren(model, result);
 	return result;
 }
 
+int Scene::FindChildren(const Model* model, std::vector<Model*>& outModels)
+{
+	outModels.clear();
+
+	std::map<const Model*, SceneHierarchyNode>::iterator filed = hierarchy.find(model);
+	if (filed == hierarchy.end())
+	{
+		return 0;
+	}
+
+	// Breadth first through links as well as scene models
+	std::vector<const SceneHierarchyNode*> queue(1, &filed->second);
+	for (int i = 0; i < (int)queue.size(); ++i)
+	{
+		const std::vector<Model*>& children = queue[i]->children;
+
+		for (int j = 0, size = children.size(); j < size; ++j)
+		{
+			const SceneHierarchyNode& child = hierarchy.find(children[j])->second;
+			if (child.inScene)
+			{
+				outModels.push_back(children[j]);
+			}
+			if (!child.children.empty())
+			{
+				queue.push_back(&child);
+			}
+		}
+	}
+
+	return outModels.size();
+}
+
+bool Scene::SetParent(Model* model, Model* parent)
+{
+	for (const Model* ancestor = parent; ancestor != 0; ancestor = ancestor->parent)
+	{
+		if (ancestor == model)
+		{
+			return false;
+		}
+	}
+
+	model->parent = parent;
+	Refile(model);
+
+	std::map<const Model*, SceneHierarchyNode>::iterator filed = hierarchy.find(model);
+	if (filed != hierarchy.end() && filed->second.inScene)
+	{
+		UpdateModel(model);
+	}
+
+	// Everything below moved along with model
+	std::vector<Model*> moved;
+	FindChildren(model, moved);
+	for (int i = 0, size = moved.size(); i < size; ++i)
+	{
+		UpdateModel(moved[i]);
+	}
+
+	return true;
+}
+
 Model* Scene::Raycast(const Ray& ray)
 {
-	if (octree != 0)
+	if (linearOctree != 0)
+	{
+		RefreshLinearOctree();
+		return linearOctree->Raycast(ray);
+	}
+
+	if (aabbTree != 0)
+	{
+		return aabbTree->Raycast(ray);
+	}
+
+	if (octree != 0)
+	{
+		return ::Raycast(octree, ray);
+	}
+
+	return FindClosest(objects, ray);
+}
+
+std::vector<Model*> Scene::Query(const Sphere& sphere) 
+{
+	std::vector<Model*> result;
+	Query(sphere, result);
+	return result;
+}
+
+std::vector<Model*> Scene::Query(const AABB& aabb)
+{
+	std::vector<Model*> result;
+	Query(aabb, result);
+	return result;
+}
+
+std::vector<Model*> Scene::Cull(const Frustum& frustum)
+{
+	std::vector<Model*> result;
+	Cull(frustum, result);
+	return result;
+}
+
+static bool PushModel(Model* model, void* userData)
+{
+	((std::vector<Model*>*)userData)->push_back(model);
+	return true;
+}
+
+int Scene::Query(const Sphere& sphere, std::vector<Model*>& outModels)
+{
+	outModels.clear();
+	Query(sphere, PushModel, &outModels);
+	return outModels.size();
+}
+
+int Scene::Query(const AABB& aabb, std::vector<Model*>& outModels)
+{
+	outModels.clear();
+	Query(aabb, PushModel, &outModels);
+	return outModels.size();
+}
+
+int Scene::Cull(const Frustum& frustum, std::vector<Model*>& outModels)
+{
+	outModels.clear();
+	Cull(frustum, PushModel, &outModels);
+	return outModels.size();
+}
+
+template <typename Visit>
+static bool VisitObjects(const std::vector<Model*>& objects, Visit& visit)
+{
+	for (int i = 0, size = objects.size(); i < size; ++i)
+	{
+		if (!visit(objects[i]))
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+struct OctreeRayVisit
+{
+	const Ray& ray;
+	ModelRayVisitor visit;
+	void* userData;
+	OctreeRayVisit(const Ray& r, ModelRayVisitor v, void* u) : ray(r), visit(v), userData(u) { }
+	bool operator()(const AABB& bounds) const
+	{
+		return RaycastEntry(bounds, ray) >= 0;
+	}
+	bool operator()(Model* model)
+	{
+		float t = ModelRay(*model, ray);
+		return t < 0 || visit(model, t, userData);
+	}
+};
+
+bool Scene::Raycast(const Ray& ray, ModelRayVisitor visit, void* userData)
+{
+	if (linearOctree != 0)
+	{
+		RefreshLinearOctree();
+		return linearOctree->Raycast(ray, visit, userData);
+	}
+
+	if (aabbTree != 0)
+	{
+		return aabbTree->Raycast(ray, visit, userData);
+	}
+
+	if (octree != 0)
+	{
+		return ::Raycast(octree, ray, visit, userData);
+	}
+
+	OctreeRayVisit raycast(ray, visit, userData);
+	return VisitObjects(objects, raycast);
+}
+
+bool Scene::Query(const Sphere& sphere, ModelVisitor visit, void* userData)
+{
+	if (linearOctree != 0)
+	{
+		RefreshLinearOctree();
+		return linearOctree->Query(sphere, visit, userData);
+	}
+
+	if (aabbTree != 0)
+	{
+		return aabbTree->Query(sphere, visit, userData);
+	}
+
+	if (octree != 0)
+	{
+		return ::Query(octree, sphere, visit, userData);
+	}
+
+	SceneSphereTest test(sphere);
+	SceneVisit<SceneSphereTest> visitor(test, visit, userData);
+	return VisitObjects(objects, visitor);
+}
+
+bool Scene::Query(const AABB& aabb, ModelVisitor visit, void* userData)
+{
+	if (linearOctree != 0)
+	{
+		RefreshLinearOctree();
+		return linearOctree->Query(aabb, visit, userData);
+	}
+
+	if (aabbTree != 0)
+	{
+		return aabbTree->Query(aabb, visit, userData);
+	}
+
+	if (octree != 0)
+	{
+		return ::Query(octree, aabb, visit, userData);
+	}
+
+	SceneAABBTest test(aabb);
+	SceneVisit<SceneAABBTest> visitor(test, visit, userData);
+	return VisitObjects(objects, visitor);
+}
+
+bool Scene::Cull(const Frustum& frustum, ModelVisitor visit, void* userData)
+{
+	if (linearOctree != 0)
+	{
+		RefreshLinearOctree();
+		return linearOctree->Cull(frustum, visit, userData);
+	}
+
+	if (aabbTree != 0)
+	{
+		return aabbTree->Cull(frustum, visit, userData);
+	}
+
+	if (octree != 0)
+	{
+		return ::Cull(octree, frustum, visit, userData);
+	}
+
+	SceneFrustumTest test(frustum);
+	SceneVisit<SceneFrustumTest> visitor(test, visit, userData);
+	return VisitObjects(objects, visitor);
+}
+
+bool Scene::Accelerate(const Vec3& position, float size)
+{
+	if (octree != 0 || linearOctree != 0 || aabbTree != 0)
+	{
+		return false;
+	}
+
+	Vec3 min(position.x - size, position.y - size, position.z - size);
+	Vec3 max(position.x + size, position.y + size, position.z + size);
+
+	octree = new OctreeNode();
+	octree->bounds = FromMinMax(min, max);
+	octree->children = 0;
+
+	for (int i = 0, size = objects.size(); i < size; ++i)
+	{
+		octree->models.push_back(objects[i]);
+	}
+
+	SplitTree(octree, OCTREE_DEPTH);
+	FindOwners(octree);
+	return true;
+}
+
+bool Scene::Accelerate(const Vec3& position, float size, float looseness)
+{
+	if (looseness <= 1.0f)
+	{
+		return Accelerate(position, size);
+	}
+
+	if (octree != 0 || linearOctree != 0 || aabbTree != 0)
+	{
+		return false;
+	}
+
+	// The root is stored loose like every other node, InsertLoose finds
+	// the cells by dividing the bounds by looseness
+	octree = new OctreeNode();
+	octree->bounds = AABB(position, Vec3(size, size, size) * looseness);
+	octree->children = 0;
+	this->looseness = looseness;
+
+	for (int i = 0, size = objects.size(); i < size; ++i)
+	{
+		octree->models.push_back(objects[i]);
+	}
+
+	SplitLooseTree(octree, OCTREE_DEPTH, looseness);
+	FindOwners(octree);
+	return true;
+}
+
+bool Scene::AccelerateLinear(const Vec3& position, float size, float looseness)
+{
+	if (octree != 0 || linearOctree != 0 || aabbTree != 0)
+	{
+		return false;
+	}
+
+	this->looseness = looseness;
+	linearOctreeCenter = position;
+	linearOctreeSize = size;
+	linearOctree = new LinearOctree();
+	linearOctreeDirty = true;
+	RefreshLinearOctree();
+	return true;
+}
+
+bool Scene::AccelerateDynamic(float margin)
+{
+	if (octree != 0 || linearOctree != 0 || aabbTree != 0)
+	{
+		return false;
+	}
+
+	aabbTree = new AABBTree(margin);
+
+	for (int i = 0, size = objects.size(); i < size; ++i)
+	{
+		proxies[objects[i]] = aabbTree->Insert(objects[i]);
+	}
+
+	return true;
+}
+
+void SplitTree(OctreeNode* node, int depth)
+{
+	if (depth-- <= 0)
+	{
+		return;
+	}
+
+	if (node->children == 0)
+	{
+		node->children = new OctreeNode[8];
+		
+		Vec3 c = node->bounds.position;
+		Vec3 e = node->bounds.size * 0.5f;
+
+		node->children[0].bounds = AABB(c + Vec3(-e.x, +e.y, -e.z), e);
+		node->children[1].bounds = AABB(c + Vec3(+e.x, +e.y, -e.z), e);
+		node->children[2].bounds = AABB(c + Vec3(-e.x, +e.y, +e.z), e);
+		node->children[3].bounds = AABB(c + Vec3(+e.x, +e.y, +e.z), e);
+		node->children[4].bounds = AABB(c + Vec3(-e.x, -e.y, -e.z), e);
+		node->children[5].bounds = AABB(c + Vec3(+e.x, -e.y, -e.z), e);
+		node->children[6].bounds = AABB(c + Vec3(-e.x, -e.y, +e.z), e);
+		node->children[7].bounds = AABB(c + Vec3(+e.x, -e.y, +e.z), e);
+
+		for (int i = 0; i < 8; ++i)
+		{
+			node->children[i].parent = node;
+		}
+	}
+
+	if (node->children != 0 && node->models.size() > 0)
+	{
+		for (int i = 0; i < 8; ++i)
+		{
+			for (int j = 0, size = node->models.size(); j < size; ++j)
+			{
+				OBB bounds = GetOBB(*node->models[j]);
+
+				if (AABBOBB(node->children[i].bounds, bounds))
+				{
+					node->children[i].models.push_back(node->models[j]);
+				}
+			}
+		}
+
+		node->models.clear();
+
+		for (int i = 0; i < 8; ++i)
+		{
+			SplitTree(&(node->children[i]), depth);
+		}
+	}
+}
+
+// Index of the child octant holding point, in SplitTree's child order
+static int GetOctant(const OctreeNode* node, const Vec3& point)
+{
+	const Vec3& c = node->bounds.position;
+	return (point.x >= c.x ? 1 : 0) | (point.z >= c.z ? 2 : 0) | (point.y < c.y ? 4 : 0);
+}
+
+static bool ContainsAABB(const AABB& outer, const AABB& inner)
+{
+	Vec3 outerMin = GetMin(outer);
+	Vec3 outerMax = GetMax(outer);
+	Vec3 innerMin = GetMin(inner);
+	Vec3 innerMax = GetMax(inner);
+
+	return innerMin.x >= outerMin.x && innerMin.y >= outerMin.y && innerMin.z >= outerMin.z &&
+		innerMax.x <= outerMax.x && innerMax.y <= outerMax.y && innerMax.z <= outerMax.z;
+}
+
+// The bounds of a loose node are its octree cell scaled by looseness, so a
+// model fits in the child cell holding its center as long as it is not
+// more than (looseness - 1) cell half-sizes larger than the cell.
+void SplitLooseTree(OctreeNode* node, int depth, float looseness)
+{
+	std::vector<Model*> models;
+	models.swap(node->models);
+
+	for (int i = 0, size = models.size(); i < size; ++i)
+	{
+		InsertLoose(node, models[i], depth, looseness);
+	}
+}
+
+OctreeNode* InsertLoose(OctreeNode* node, Model* model, int depth, float looseness)
+{
+	AABB bounds = GetAABB(*model);
+
+	for (; depth > 0; --depth)
+	{
+		int octant = GetOctant(node, bounds.position);
+		Vec3 e = node->bounds.size * (0.5f / looseness);
+		Vec3 offset(
+			(octant & 1) ? e.x : -e.x,
+			(octant & 4) ? -e.y : e.y,
+			(octant & 2) ? e.z : -e.z);
+		AABB child(node->bounds.position + offset, e * looseness);
+
+		if (!ContainsAABB(child, bounds))
+		{
+			break;
+		}
+
+		if (node->children == 0)
+		{
+			node->children = new OctreeNode[8];
+
+			for (int i = 0; i < 8; ++i)
+			{
+				Vec3 o(
+					(i & 1) ? e.x : -e.x,
+					(i & 4) ? -e.y : e.y,
+					(i & 2) ? e.z : -e.z);
+				node->children[i].bounds = AABB(node->bounds.position + o, e * looseness);
+				node->children[i].parent = node;
+			}
+		}
+
+		node = &node->children[octant];
+	}
+
+	node->models.push_back(model);
+	return node;
+}
+
+static void Insert(OctreeNode* node, Model* model, const OBB& bounds,
+	const AABB& box, std::vector<OctreeNode*>* outOwners)
+{
+	// The world box rejects most nodes before the separating axis test
+	if (AABBAABB(node->bounds, box) && AABBOBB(node->bounds, bounds))
+	{
+		if (node->children == 0)
+		{
+			node->models.push_back(model);
+
+			if (outOwners != 0)
+			{
+				outOwners->push_back(node);
+			}
+		}
+		else
+		{
+			for (int i = 0; i < 8; ++i)
+			{
+				Insert(&(node->children[i]), model, bounds, box, outOwners);
+			}
+		}
+	}
+}
+
+void Insert(OctreeNode* node, Model* model)
+{
+	Insert(node, model, GetOBB(*model), GetAABB(*model), 0);
+}
+
+void Insert(OctreeNode* node, Model* model, std::vector<OctreeNode*>* outOwners)
+{
+	Insert(node, model, GetOBB(*model), GetAABB(*model), outOwners);
+}
+
+static void RemoveFromNode(OctreeNode* node, Model* model)
+{
+	std::vector<Model*>::iterator it = 
+		std::find(node->models.begin(), node->models.end(), model);
+
+	if (it != node->models.end())
+	{
+		node->models.erase(it);
+	}
+}
+
+void Remove(OctreeNode* node, Model* model)
+{
+	RemoveFromNode(node, model);
+
+	if (node->children != 0)
+	{
+		for (int i = 0; i < 8; ++i)
+		{
+			Remove(&(node->children[i]), model);
+		}
+	}
+}
+
+void Update(OctreeNode* node, Model* model)
+{
+	Remove(node, model);
+	Insert(node, model);
+}
+
+static Model* FindClosest(const std::vector<Model*>& set, const Ray& ray,
+	float* outT, int* outTriangle)
+{
+	Model* closest = 0;
+	float closest_t = -1;
+	int closest_triangle = -1;
+
+	for (int i = 0, size = set.size(); i < size; ++i)
+	{
+		int triangle;
+		float this_t = ModelRay(*set[i], ray, 0, &triangle);
+
+		if (this_t < 0)
+		{
+			continue;
+		}
+
+		if (closest_t < 0 || this_t < closest_t)
+		{
+			closest_t = this_t;
+			closest_triangle = triangle;
+			closest = set[i];
+		}
+	}
+
+	*outT = closest_t;
+	*outTriangle = closest_triangle;
+	return closest;
+}
+
+Model* FindClosest(const std::vector<Model*>& set, const Ray& ray) 
+{
+	float t;
+	int triangle;
+	return FindClosest(set, ray, &t, &triangle);
+}
+
+// A lane is owned by one query at a time, so only that query reads or
+// writes the lane's epoch and the models' stamps for it
+static std::atomic<bool> queryLaneBusy[MODEL_QUERY_LANES];
+static unsigned long long queryLaneEpoch[MODEL_QUERY_LANES];
+
+// Reports each model once even though the octree can hold it in many
+// leaves. Queries that find every lane taken remember what they visited.
+class OctreeVisited
+{
+	int lane;
+	unsigned long long epoch;
+	std::unordered_set<const Model*> visited;
+
+public:
+	inline OctreeVisited() : lane(-1), epoch(0)
+	{
+		for (int i = 0; i < MODEL_QUERY_LANES; ++i)
+		{
+			bool busy = false;
+
+			if (queryLaneBusy[i].compare_exchange_strong(busy, true, std::memory_order_acquire))
+			{
+				lane = i;
+				epoch = ++queryLaneEpoch[i];
+				break;
+			}
+		}
+	}
+
+	inline ~OctreeVisited()
+	{
+		if (lane >= 0)
+		{
+			queryLaneBusy[lane].store(false, std::memory_order_release);
+		}
+	}
+
+	// Starts the next query on the same lane
+	inline void Reset()
+	{
+		if (lane >= 0)
+		{
+			epoch = ++queryLaneEpoch[lane];
+		}
+		visited.clear();
+	}
+
+	inline bool FirstVisit(const Model* model)
+	{
+		if (lane >= 0)
+		{
+			return model->FirstVisit(lane, epoch);
+		}
+
+		return visited.insert(model).second;
+	}
+};
+
+// Visits the models of node and of every descendant whose bounds pass
+// test. A node's own bounds are not tested, the root of a loose octree
+// can hold models that reach past them.
+template <typename NodeTest, typename Visit>
+static bool TraverseOctree(const OctreeNode* node, const NodeTest& test, Visit& visit,
+	OctreeVisited& visited)
+{
+	for (int i = 0, size = node->models.size(); i < size; ++i)
+	{
+		if (visited.FirstVisit(node->models[i]) && !visit(node->models[i]))
+		{
+			return false;
+		}
+	}
+
+	if (node->children != 0)
+	{
+		for (int i = 0; i < 8; ++i)
+		{
+			if (test(node->children[i].bounds) &&
+				!TraverseOctree(&node->children[i], test, visit, visited))
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+template <typename NodeTest, typename Visit>
+static bool TraverseOctree(const OctreeNode* node, const NodeTest& test, Visit& visit)
+{
+	OctreeVisited visited;
+	return TraverseOctree(node, test, visit, visited);
+}
+
+// Children are visited nearest entry first. With cutoff the walk stops at
+// the first child the ray enters beyond the closest hit so far: inside the
+// root every part of a model lies in a node holding it, so that hit cannot
+// be beaten there. A model reaching past the root of a classic octree can
+// be hit before the ray enters the root, so cutoff needs the ray to start
+// inside it.
+static void RaycastOctree(const OctreeNode* node, const Ray& ray, OctreeVisited& visited,
+	bool cutoff, Model** closest, float* closestT, int* closestTriangle)
+{
+	for (int i = 0, size = node->models.size(); i < size; ++i)
+	{
+		Model* model = node->models[i];
+		if (!visited.FirstVisit(model))
+		{
+			continue;
+		}
+
+		// The world box is much cheaper to test than the model's mesh
+		float entry = RaycastEntry(GetAABB(*model), ray);
+		if (entry < 0 || (*closest != 0 && entry > *closestT))
+		{
+			continue;
+		}
+
+		int triangle;
+		float t = ModelRay(*model, ray, 0, &triangle);
+		if (t >= 0 && (*closest == 0 || t < *closestT))
+		{
+			*closest = model;
+			*closestT = t;
+			*closestTriangle = triangle;
+		}
+	}
+
+	if (node->children == 0)
+	{
+		return;
+	}
+
+	float entries[8];
+	int order[8];
+	int count = 0;
+
+	for (int i = 0; i < 8; ++i)
+	{
+		float entry = RaycastEntry(node->children[i].bounds, ray);
+		if (entry < 0)
+		{
+			continue;
+		}
+
+		int j = count++;
+		for (; j > 0 && entries[j - 1] > entry; --j)
+		{
+			entries[j] = entries[j - 1];
+			order[j] = order[j - 1];
+		}
+		entries[j] = entry;
+		order[j] = i;
+	}
+
+	for (int i = 0; i < count; ++i)
+	{
+		if (cutoff && *closest != 0 && entries[i] > *closestT)
+		{
+			break;
+		}
+
+		RaycastOctree(&node->children[order[i]], ray, visited, cutoff,
+			closest, closestT, closestTriangle);
+	}
+}
+
+Model* Raycast(OctreeNode* node, const Ray& ray) 
+{
+	OctreeVisited visited;
+	Model* closest = 0;
+	float closestT = -1;
+	int closestTriangle = -1;
+
+	RaycastOctree(node, ray, visited, PointInAABB(ray.origin, node->bounds),
+		&closest, &closestT, &closestTriangle);
+	return closest;
+}
+
+bool Raycast(OctreeNode* node, const Ray& ray, ModelRayVisitor visit, void* userData)
+{
+	OctreeRayVisit raycast(ray, visit, userData);
+	return TraverseOctree(node, raycast, raycast);
+}
+
+std::vector<Model*> Query(OctreeNode* node, const Sphere& sphere) 
+{
+	std::vector<Model*> result;
+	SceneSphereTest test(sphere);
+	SceneCollect<SceneSphereTest> collect(test, result);
+	TraverseOctree(node, test, collect);
+	return result;
+}
+
+bool Query(OctreeNode* node, const Sphere& sphere, ModelVisitor visit, void* userData)
+{
+	SceneSphereTest test(sphere);
+	SceneVisit<SceneSphereTest> visitor(test, visit, userData);
+	return TraverseOctree(node, test, visitor);
+}
+
+std::vector<Model*> Query(OctreeNode* node, const AABB& aabb) 
+{
+	std::vector<Model*> result;
+	SceneAABBTest test(aabb);
+	SceneCollect<SceneAABBTest> collect(test, result);
+	TraverseOctree(node, test, collect);
+	return result;
+}
+
+bool Query(OctreeNode* node, const AABB& aabb, ModelVisitor visit, void* userData)
+{
+	SceneAABBTest test(aabb);
+	SceneVisit<SceneAABBTest> visitor(test, visit, userData);
+	return TraverseOctree(node, test, visitor);
+}
+
+bool Cull(OctreeNode* node, const Frustum& frustum, ModelVisitor visit, void* userData)
+{
+	SceneFrustumTest test(frustum);
+	SceneVisit<SceneFrustumTest> visitor(test, visit, userData);
+	return TraverseOctree(node, test, visitor);
+}
+
+struct OctreeAnyHit
+{
+	const Ray& ray;
+	float maxT;
+	OctreeAnyHit(const Ray& r, float m) : ray(r), maxT(m) { }
+	bool operator()(const AABB& bounds) const
+	{
+		float entry = RaycastEntry(bounds, ray);
+		return entry >= 0 && entry <= maxT;
+	}
+	// Returns false to stop at the first hit
+	bool operator()(Model* model)
+	{
+		float entry = RaycastEntry(GetAABB(*model), ray);
+		if (entry < 0 || entry > maxT)
+		{
+			return true;
+		}
+
+		float t = ModelRay(*model, ray);
+		return t < 0 || t > maxT;
+	}
+};
+
+static bool StopWithinDistance(Model*, float t, void* userData)
+{
+	return t > *(float*)userData;
+}
+
+Model* Scene::ClosestHit(const Ray& ray, OctreeVisited& visited, float* outT, int* outTriangle) const
+{
+	if (linearOctree != 0)
 	{
-		return ::Raycast(octree, ray);
+		return linearOctree->Raycast(ray, outT, outTriangle);
 	}
 
-	Model* result = 0;
-	float result_t = -1;
+	if (aabbTree != 0)
+	{
+		return aabbTree->Raycast(ray, outT, outTriangle);
+	}
 
-	for (int i = 0, size = objects.size(); i < size; ++i)
+	if (octree != 0)
 	{
-		float t = ModelRay(*objects[i], ray);
-		if (result == 0 && t >= 0)
-		{
-			result = objects[i];
-			result_t = t;
-		}
-		else if (result != 0 && t < result_t)
-		{
-			result = objects[i];
-			result_t = t;
-		}
+		Model* closest = 0;
+		*outT = -1;
+		*outTriangle = -1;
+
+		visited.Reset();
+		RaycastOctree(octree, ray, visited, PointInAABB(ray.origin, octree->bounds),
+			&closest, outT, outTriangle);
+		return closest;
 	}
 
-	return result;
+	return FindClosest(objects, ray, outT, outTriangle);
 }
 
-std::vector<Model*> Scene::Query(const Sphere& sphere) 
+bool Scene::AnyHit(const Ray& ray, float maxT, OctreeVisited& visited) const
 {
-	if (octree != 0)
+	if (linearOctree != 0)
 	{
-		return ::Query(octree, sphere);
+		return !linearOctree->Raycast(ray, StopWithinDistance, &maxT);
 	}
 
-	std::vector<Model*> result;
+	if (aabbTree != 0)
+	{
+		return !aabbTree->Raycast(ray, StopWithinDistance, &maxT);
+	}
 
-	for (int i = 0, size = objects.size(); i < size; ++i)
+	OctreeAnyHit anyHit(ray, maxT);
+
+	if (octree != 0)
 	{
-		OBB bounds = GetOBB(*objects[i]);
-		
-		if (SphereOBB(sphere, bounds))
-		{
-			result.push_back(objects[i]);
-		}
+		visited.Reset();
+		return !TraverseOctree(octree, anyHit, anyHit, visited);
 	}
 
-	return result;
+	return !VisitObjects(objects, anyHit);
 }
 
-std::vector<Model*> Scene::Query(const AABB& aabb)
+void Scene::PrepareConcurrentQueries()
 {
-	if (octree != 0)
+	if (linearOctree != 0)
 	{
-		return ::Query(octree, aabb);
+		RefreshLinearOctree();
 	}
 
-	std::vector<Model*> result;
-
+	// Reading a stale cache rebuilds it, which must not happen on workers
 	for (int i = 0, size = objects.size(); i < size; ++i)
 	{
-		OBB bounds = GetOBB(*objects[i]);
-
-		if (AABBOBB(aabb, bounds))
-		{
-			result.push_back(objects[i]);
-		}
+		objects[i]->GetWorldAABB();
+		objects[i]->GetInverseWorldMatrix();
 	}
-
-	return result;
 }
 
-bool Scene::Accelerate(const Vec3& position, float size)
+// Runs work(first, last) over [first, last) split evenly on up to
+// numThreads threads, every entry costs about the same
+template <typename Work>
+static void RunSplit(int first, int last, int numThreads, const Work& work)
 {
-	if (octree != 0)
+	if (numThreads <= 0)
 	{
-		return false;
+		numThreads = std::thread::hardware_concurrency();
 	}
 
-	Vec3 min(position.x - size, position.y - size, position.z - size);
-	Vec3 max(position.x + size, position.y + size, position.z + size);
+	int count = last - first;
+	int maxThreads = (count + TRANSFORM_THREAD_MIN - 1) / TRANSFORM_THREAD_MIN;
+	if (numThreads > maxThreads)
+	{
+		numThreads = maxThreads;
+	}
 
-	octree = new OctreeNode();
-	octree->bounds = FromMinMax(min, max);
-	octree->children = 0;
+	if (numThreads <= 1)
+	{
+		work(first, last);
+		return;
+	}
 
-	for (int i = 0, size = objects.size(); i < size; ++i)
+	std::vector<std::thread> workers;
+	for (int t = 1; t < numThreads; ++t)
 	{
-		octree->models.push_back(objects[i]);
+		workers.push_back(std::thread(work, first + (int)((long long)count * t / numThreads),
+			first + (int)((long long)count * (t + 1) / numThreads)));
 	}
 
-	SplitTree(octree, 5);
-	return true;
+	work(first, first + count / numThreads);
+
+	for (int t = 0, size = workers.size(); t < size; ++t)
+	{
+		workers[t].join();
+	}
 }
 
-std::vector<Model*> Scene::Cull(const Frustum& frustum)
+#ifdef SCENE_TRANSFORM_SSE
+// sinf and cosf of four angles in radians, with the single precision Cephes
+// reduction and polynomials. Only accurate below TRANSFORM_MAX_ANGLE.
+static void SinCos4(__m128 x, __m128* outSin, __m128* outCos)
 {
-	std::vector<Model*> result;
+	__m128 signMask = _mm_castsi128_ps(_mm_set1_epi32(0x80000000));
+	__m128 sinSign = _mm_and_ps(x, signMask);
+	x = _mm_andnot_ps(signMask, x);
+
+	// Octant rounded up to even, leaving a remainder in [-pi/4, pi/4]
+	__m128i j = _mm_cvttps_epi32(_mm_mul_ps(x, _mm_set1_ps(1.27323954473516f)));
+	j = _mm_and_si128(_mm_add_epi32(j, _mm_set1_epi32(1)), _mm_set1_epi32(~1));
+	__m128 y = _mm_cvtepi32_ps(j);
+
+	x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(0.78515625f)));
+	x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(2.4187564849853515625e-4f)));
+	x = _mm_sub_ps(x, _mm_mul_ps(y, _mm_set1_ps(3.77489497744594108e-8f)));
+	__m128 z = _mm_mul_ps(x, x);
+
+	__m128 c = _mm_set1_ps(2.443315711809948e-5f);
+	c = _mm_add_ps(_mm_mul_ps(c, z), _mm_set1_ps(-1.388731625493765e-3f));
+	c = _mm_add_ps(_mm_mul_ps(c, z), _mm_set1_ps(4.166664568298827e-2f));
+	c = _mm_mul_ps(_mm_mul_ps(c, z), z);
+	c = _mm_add_ps(_mm_sub_ps(c, _mm_mul_ps(z, _mm_set1_ps(0.5f))), _mm_set1_ps(1.0f));
+
+	__m128 s = _mm_set1_ps(-1.9515295891e-4f);
+	s = _mm_add_ps(_mm_mul_ps(s, z), _mm_set1_ps(8.3321608736e-3f));
+	s = _mm_add_ps(_mm_mul_ps(s, z), _mm_set1_ps(-1.6666654611e-1f));
+	s = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(s, z), x), x);
+
+	// Odd quadrants swap the polynomials, the signs follow the quadrant
+	__m128i two = _mm_set1_epi32(2);
+	__m128i four = _mm_set1_epi32(4);
+	__m128 swap = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(j, two), two));
+	__m128 sinValue = _mm_or_ps(_mm_and_ps(swap, c), _mm_andnot_ps(swap, s));
+	__m128 cosValue = _mm_or_ps(_mm_and_ps(swap, s), _mm_andnot_ps(swap, c));
+
+	sinSign = _mm_xor_ps(sinSign, _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(j, four), 29)));
+	__m128 cosSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_andnot_si128(_mm_sub_epi32(j, two), four), 29));
+
+	*outSin = _mm_xor_ps(sinValue, sinSign);
+	*outCos = _mm_xor_ps(cosValue, cosSign);
+}
+#endif
 
-	if (octree == 0)
+// Rows of GetLocalMatrix's rotation for four models, lane by lane
+static void LocalRotations4(const float* const* rotations, float outRotation[9][4])
+{
+	float sines[3][4];
+	float cosines[3][4];
+
+#ifdef SCENE_TRANSFORM_SSE
+	__m128 toRadians = _mm_set1_ps(DEG2RAD(1.0f));
+	__m128 limit = _mm_set1_ps(TRANSFORM_MAX_ANGLE);
+	__m128 signMask = _mm_castsi128_ps(_mm_set1_epi32(0x80000000));
+	__m128 angles[3];
+	int outside = 0;
+
+	for (int axis = 0; axis < 3; ++axis)
 	{
-		for (int i = 0; i < objects.size(); ++i)
-		{
-			OBB bounds = GetOBB(*(objects[i]));
+		angles[axis] = _mm_mul_ps(_mm_loadu_ps(rotations[axis]), toRadians);
+		outside |= _mm_movemask_ps(_mm_cmpgt_ps(_mm_andnot_ps(signMask, angles[axis]), limit));
+	}
 
-			if (Intersects(frustum, bounds))
-			{
-				result.push_back(objects[i]);
-			}
+	if (outside == 0)
+	{
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			__m128 sine, cosine;
+			SinCos4(angles[axis], &sine, &cosine);
+			_mm_storeu_ps(sines[axis], sine);
+			_mm_storeu_ps(cosines[axis], cosine);
 		}
 	}
 	else
+#endif
 	{
-		std::list<OctreeNode*> nodes;
-		nodes.push_back(octree);
-
-		while (nodes.size() > 0)
+		for (int axis = 0; axis < 3; ++axis)
 		{
-			OctreeNode* active = *nodes.begin();
-			nodes.pop_front();
-
-			if (active->children != 0)
-			{
-				for (int i = 0; i < 8; ++i)
-				{
-					AABB bounds = active->children[i].bounds;
-					
-					if (Intersects(frustum, bounds))
-					{
-						nodes.push_back(&active->children[i]);
-					}
-				}
-			}
-			else
+			for (int lane = 0; lane < 4; ++lane)
 			{
-				for (int i = 0; i < active->models.size(); ++i)
-				{
-					OBB bounds = GetOBB(*(active->models[i]));
-
-					if (Intersects(frustum, bounds))
-					{
-						result.push_back(active->models[i]);
-					}
-				}
+				sines[axis][lane] = sinf(DEG2RAD(rotations[axis][lane]));
+				cosines[axis][lane] = cosf(DEG2RAD(rotations[axis][lane]));
 			}
 		}
 	}
 
-	return result;
+	for (int lane = 0; lane < 4; ++lane)
+	{
+		float sp = sines[0][lane], cp = cosines[0][lane];
+		float sy = sines[1][lane], cy = cosines[1][lane];
+		float sr = sines[2][lane], cr = cosines[2][lane];
+
+		outRotation[0][lane] = cr * cy + sr * sp * sy;
+		outRotation[1][lane] = sr * cp;
+		outRotation[2][lane] = sr * sp * cy - cr * sy;
+		outRotation[3][lane] = cr * sp * sy - sr * cy;
+		outRotation[4][lane] = cr * cp;
+		outRotation[5][lane] = sr * sy + cr * sp * cy;
+		outRotation[6][lane] = cp * sy;
+		outRotation[7][lane] = -sp;
+		outRotation[8][lane] = cp * cy;
+	}
 }
 
-void SplitTree(OctreeNode* node, int depth)
+void Scene::ComputeWorlds(int first, int last)
 {
-	if (depth-- <= 0)
+	for (int slot = first; slot < last; slot += 4)
 	{
-		return;
-	}
+		int count = last - slot < 4 ? last - slot : 4;
 
-	if (node->children == 0)
-	{
-		node->children = new OctreeNode[8];
-		
-		Vec3 c = node->bounds.position;
-		Vec3 e = node->bounds.size * 0.5f;
+		// The last block of a range reads padded copies
+		float padded[3][4] = { { 0.0f } };
+		const float* rotations[3];
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			rotations[axis] = &transformRotations[axis][slot];
+			if (count < 4)
+			{
+				std::copy(rotations[axis], rotations[axis] + count, padded[axis]);
+				rotations[axis] = padded[axis];
+			}
+		}
 
-		node->children[0].bounds = AABB(c + Vec3(-e.x, +e.y, -e.z), e);
-		node->children[1].bounds = AABB(c + Vec3(+e.x, +e.y, -e.z), e);
-		node->children[2].bounds = AABB(c + Vec3(-e.x, +e.y, +e.z), e);
-		node->children[3].bounds = AABB(c + Vec3(+e.x, +e.y, +e.z), e);
-		node->children[4].bounds = AABB(c + Vec3(-e.x, -e.y, -e.z), e);
-		node->children[5].bounds = AABB(c + Vec3(+e.x, -e.y, -e.z), e);
-		node->children[6].bounds = AABB(c + Vec3(-e.x, -e.y, +e.z), e);
-		node->children[7].bounds = AABB(c + Vec3(+e.x, -e.y, +e.z), e);
-	}
+		float rotation[9][4];
+		LocalRotations4(rotations, rotation);
 
-	if (node->children != 0 && node->models.size() > 0)
-	{
-		for (int i = 0; i < 8; ++i)
+		for (int lane = 0; lane < count; ++lane)
 		{
-			for (int j = 0, size = node->models.size(); j < size; ++j)
+			int i = transformWork[slot + lane];
+			int parent = transformParents[i];
+			float* world = transformWorlds[i].asArray;
+			float px = transformPositions[0][slot + lane];
+			float py = transformPositions[1][slot + lane];
+			float pz = transformPositions[2][slot + lane];
+
+			if (parent < 0)
 			{
-				OBB bounds = GetOBB(*node->models[j]);
+				transformWorlds[i] = Mat4(
+					rotation[0][lane], rotation[1][lane], rotation[2][lane], 0.0f,
+					rotation[3][lane], rotation[4][lane], rotation[5][lane], 0.0f,
+					rotation[6][lane], rotation[7][lane], rotation[8][lane], 0.0f,
+					px, py, pz, 1.0f);
+				continue;
+			}
 
-				if (AABBOBB(node->children[i].bounds, bounds))
+			const float* p = transformWorlds[parent].asArray;
+
+#ifdef SCENE_TRANSFORM_SSE
+			// Each world row is the local row times the parent's rows
+			__m128 p0 = _mm_loadu_ps(p + 0), p1 = _mm_loadu_ps(p + 4);
+			__m128 p2 = _mm_loadu_ps(p + 8), p3 = _mm_loadu_ps(p + 12);
+
+			for (int row = 0; row < 3; ++row)
+			{
+				__m128 r = _mm_mul_ps(_mm_set1_ps(rotation[row * 3 + 0][lane]), p0);
+				r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(rotation[row * 3 + 1][lane]), p1));
+				r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(rotation[row * 3 + 2][lane]), p2));
+				_mm_storeu_ps(world + row * 4, r);
+			}
+
+			__m128 t = _mm_mul_ps(_mm_set1_ps(px), p0);
+			t = _mm_add_ps(t, _mm_mul_ps(_mm_set1_ps(py), p1));
+			t = _mm_add_ps(t, _mm_mul_ps(_mm_set1_ps(pz), p2));
+			_mm_storeu_ps(world + 12, _mm_add_ps(t, p3));
+#else
+			for (int row = 0; row < 3; ++row)
+			{
+				for (int column = 0; column < 4; ++column)
 				{
-					node->children[i].models.push_back(node->models[j]);
+					world[row * 4 + column] = rotation[row * 3 + 0][lane] * p[column] +
+						rotation[row * 3 + 1][lane] * p[4 + column] +
+						rotation[row * 3 + 2][lane] * p[8 + column];
 				}
 			}
-		}
-
-		node->models.clear();
 
-		for (int i = 0; i < 8; ++i)
-		{
-			SplitTree(&(node->children[i]), depth);
+			for (int column = 0; column < 4; ++column)
+			{
+				world[12 + column] = px * p[column] + py * p[4 + column] + pz * p[8 + column] + p[12 + column];
+			}
+#endif
 		}
 	}
 }
 
-void Insert(OctreeNode* node, Model* model)
+void Scene::UpdateTransforms(int numThreads)
 {
-	OBB bounds = GetOBB(*model);
+	// Pick up parents written directly since the last call
+	for (int i = 0, size = transformModels.size(); i < size && !transformsDirty; ++i)
+	{
+		int parent = transformParents[i];
+		if (transformModels[i]->parent != (parent < 0 ? 0 : transformModels[parent]))
+		{
+			transformsDirty = true;
+		}
+	}
 
-	if (AABBOBB(node->bounds, bounds))
+	if (transformsDirty)
 	{
-		if (node->children == 0)
+		for (int i = 0, size = transformModels.size(); i < size; ++i)
 		{
-			node->models.push_back(model);
+			Refile(transformModels[i]);
 		}
-		else
+		FlattenHierarchy();
+	}
+
+	// A level only reads the world matrices of the level before it
+	for (int level = 0, numLevels = transformLevels.size() - 1; level < numLevels; ++level)
+	{
+		RunSplit(transformLevels[level], transformLevels[level + 1], numThreads, [this](int first, int last)
 		{
-			for (int i = 0; i < 8; ++i)
+			// Gather the stale models' inputs, compute their worlds four at a
+			// time, then store them
+			int numStale = first;
+
+			for (int i = first; i < last; ++i)
 			{
-				Insert(&(node->children[i]), model);
+				const Model* model = transformModels[i];
+
+				if (model->IsCacheCurrent())
+				{
+					transformWorlds[i] = model->worldCache;
+					transformChanged[i] = 0;
+					continue;
+				}
+
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					transformPositions[axis][numStale] = model->position.asArray[axis];
+					transformRotations[axis][numStale] = model->rotation.asArray[axis];
+				}
+				transformWork[numStale++] = i;
+				transformChanged[i] = 1;
 			}
-		}
+
+			ComputeWorlds(first, numStale);
+
+			for (int slot = first; slot < numStale; ++slot)
+			{
+				int i = transformWork[slot];
+				transformModels[i]->StoreWorld(transformWorlds[i]);
+			}
+		});
 	}
-}
 
-void Remove(OctreeNode* node, Model* model)
-{
-	if (node->children == 0)
+	if (octree == 0 && aabbTree == 0 && linearOctree == 0)
 	{
-		std::vector<Model*>::iterator it = 
-			std::find(node->models.begin(), node->models.end(), model);
-
-		if (it != node->models.end())
-		{
-			node->models.erase(it);
-		}
+		return;
 	}
-	else
+
+	for (int i = 0, size = transformModels.size(); i < size; ++i)
 	{
-		for (int i = 0; i < 8; ++i)
+		if (transformChanged[i] && transformInScene[i])
 		{
-			Remove(&(node->children[i]), model);
+			UpdateModel(transformModels[i]);
 		}
 	}
 }
 
-void Update(OctreeNode* node, Model* model)
+// Runs work(first, last, visited) over [0, count) on numThreads threads.
+// Rays differ a lot in cost, so workers take small chunks as they go.
+// Threads are started per call like the builders' and RunSplit's: every
+// thread gets at least RAY_BATCH_THREAD_CHUNKS chunks, which outweighs
+// starting it, and nothing is left running between batches.
+template <typename Work>
+static void RunBatch(int count, int numThreads, const Work& work)
 {
-	Remove(node, model);
-	Insert(node, model);
-}
+	if (numThreads <= 0)
+	{
+		numThreads = std::thread::hardware_concurrency();
+	}
 
-Model* FindClosest(const std::vector<Model*>& set, const Ray& ray) 
-{
-	if (set.size() == 0)
+	int numChunks = (count + RAY_BATCH_CHUNK - 1) / RAY_BATCH_CHUNK;
+	int maxThreads = (numChunks + RAY_BATCH_THREAD_CHUNKS - 1) / RAY_BATCH_THREAD_CHUNKS;
+	if (numThreads > maxThreads)
 	{
-		return 0;
+		numThreads = maxThreads;
 	}
 
-	Model* closest = 0;
-	float closest_t = -1;
+	std::atomic<int> nextChunk(0);
+	std::vector<std::thread> workers;
 
-	for (int i = 0, size = set.size(); i < size; ++i)
+	for (int t = 1; t < numThreads; ++t)
 	{
-		float this_t = ModelRay(*set[i], ray);
-
-		if (this_t < 0)
+		workers.push_back(std::thread([&]()
 		{
-			continue;
-		}
+			OctreeVisited visited;
+			for (int chunk = nextChunk++; chunk < numChunks; chunk = nextChunk++)
+			{
+				int first = chunk * RAY_BATCH_CHUNK;
+				work(first, std::min(first + RAY_BATCH_CHUNK, count), visited);
+			}
+		}));
+	}
 
-		if (closest_t < 0 || this_t < closest_t)
-		{
-			closest_t = this_t;
-			closest = set[i];
-		}
+	OctreeVisited visited;
+	for (int chunk = nextChunk++; chunk < numChunks; chunk = nextChunk++)
+	{
+		int first = chunk * RAY_BATCH_CHUNK;
+		work(first, std::min(first + RAY_BATCH_CHUNK, count), visited);
 	}
 
-	return closest;
+	for (int t = 0, size = workers.size(); t < size; ++t)
+	{
+		workers[t].join();
+	}
 }
 
-Model* Raycast(OctreeNode* node, const Ray& ray) 
+void Scene::RaycastBatch(const Ray* rays, int count, SceneHit* outHits, int numThreads)
 {
-	RaycastResult result;
-
-	float t = Raycast(node->bounds, ray, &result);
+	PrepareConcurrentQueries();
 
-	// CHECK FOR t == 0 => return;?
-
-	if (t >= 0)
+	RunBatch(count, numThreads, [this, rays, outHits](int first, int last, OctreeVisited& visited)
 	{
-		if (node->children == 0)
-		{
-			return FindClosest(node->models, ray);
-		}
-		else
+		for (int i = first; i < last; ++i)
 		{
-			std::vector<Model*> results;
-			
-			for (int i = 0; i < 8; ++i)
+			SceneHit& hit = outHits[i];
+			hit.model = ClosestHit(rays[i], visited, &hit.t, &hit.triangle);
+
+			hit.point = Vec3(0, 0, 0);
+			hit.normal = Vec3(0, 0, 1);
+
+			// The search already found t and the triangle, the rest follows
+			// like in ModelRay
+			if (hit.model != 0)
 			{
-				Model* result = Raycast(&(node->children[i]), ray);
-				if (result != 0)
-				{
-					results.push_back(result);
-				}
+				Plane plane = FromTriangle(hit.model->GetMesh()->triangles[hit.triangle]);
+				hit.point = rays[i].origin + rays[i].direction * hit.t;
+				hit.normal = Normalized(MultiplyVector(plane.normal, hit.model->GetWorldMatrix()));
 			}
-
-			return FindClosest(results, ray);
 		}
-	}
-
-	return 0;
+	});
 }
 
-std::vector<Model*> Query(OctreeNode* node, const Sphere& sphere) 
+void Scene::OcclusionBatch(const Ray* rays, const float* maxDistances, int count,
+	bool* outOccluded, int numThreads)
 {
-	std::vector<Model*> result;
+	PrepareConcurrentQueries();
 
-	if (node->children == 0)
+	RunBatch(count, numThreads, [this, rays, maxDistances, outOccluded](int first, int last,
+		OctreeVisited& visited)
 	{
-		for (int i = 0, size = node->models.size(); i < size; ++i)
+		for (int i = first; i < last; ++i)
 		{
-			OBB bounds = GetOBB(*(node->models[i]));
+			float maxT = maxDistances != 0 ? maxDistances[i] : FLT_MAX;
+			outOccluded[i] = AnyHit(rays[i], maxT, visited);
+		}
+	});
+}
 
-			if (SphereOBB(sphere, bounds))
+struct OctreeNearestExpand
+{
+	OctreeVisited visited;
+	void operator()(const OctreeNode* node, NearestSearch<const OctreeNode*>& search)
+	{
+		for (int i = 0, size = node->models.size(); i < size; ++i)
+		{
+			if (visited.FirstVisit(node->models[i]))
 			{
-				result.push_back(node->models[i]);
+				search.PushModel(node->models[i]);
 			}
 		}
-	}
-	else
-	{
-		for (int i = 0; i < 8; ++i)
-		{
-			std::vector<Model*> child = Query(&(node->children[i]), sphere);
 
-			if (child.size() > 0)
+		if (node->children != 0)
+		{
+			for (int i = 0; i < 8; ++i)
 			{
-				result.insert(result.end(), child.begin(), child.end());
+				search.PushNode(&node->children[i], node->children[i].bounds);
 			}
 		}
 	}
+};
 
-	return result;
+int Nearest(OctreeNode* node, const Point& point, int k, float maxDistance, bool exact,
+	Model** outModels, float* outDistances)
+{
+	NearestSearch<const OctreeNode*> search(point, maxDistance, exact);
+	OctreeNearestExpand expand;
+	return search.Run(node, k, expand, outModels, outDistances);
 }
 
-std::vector<Model*> Query(OctreeNode* node, const AABB& aabb) 
+struct ObjectsNearestExpand
 {
-	std::vector<Model*> result;
-
-	if (AABBAABB(aabb, node->bounds))
+	const std::vector<Model*>& objects;
+	ObjectsNearestExpand(const std::vector<Model*>& o) : objects(o) { }
+	void operator()(int, NearestSearch<int>& search) const
 	{
-		if (node->children == 0)
+		for (int i = 0, size = objects.size(); i < size; ++i)
 		{
-			for (int i = 0, size = node->models.size(); i < size; ++i)
-			{
-				OBB bounds = GetOBB(*(node->models[i]));
-				
-				if (AABBOBB(aabb, bounds))
-				{
-					result.push_back(node->models[i]);
-				}
-			}
+			search.PushModel(objects[i]);
 		}
-		else
-		{
-			for (int i = 0; i < 8; ++i)
-			{
-				std::vector<Model*> child = Query(&(node->children[i]), aabb);
+	}
+};
 
-				if (child.size() > 0)
-				{
-					result.insert(result.end(), child.begin(), child.end());
-				}
-			}
-		}
+int Scene::Nearest(const Point& point, int k, float maxDistance, bool exact,
+	Model** outModels, float* outDistances)
+{
+	if (k <= 0)
+	{
+		return 0;
 	}
 
+	if (linearOctree != 0)
+	{
+		RefreshLinearOctree();
+		return linearOctree->Nearest(point, k, maxDistance, exact, outModels, outDistances);
+	}
+
+	if (aabbTree != 0)
+	{
+		return aabbTree->Nearest(point, k, maxDistance, exact, outModels, outDistances);
+	}
+
+	if (octree != 0)
+	{
+		return ::Nearest(octree, point, k, maxDistance, exact, outModels, outDistances);
+	}
+
+	NearestSearch<int> search(point, maxDistance, exact);
+	ObjectsNearestExpand expand(objects);
+	return search.Run(0, k, expand, outModels, outDistances);
+}
+
+std::vector<Model*> Scene::Nearest(const Point& point, int k, float maxDistance)
+{
+	std::vector<Model*> result(k > 0 ? k : 0);
+	if (k > 0)
+	{
+		result.resize(Nearest(point, k, maxDistance, false, &result[0], 0));
+	}
 	return result;
-}
\ No newline at end of file
+}
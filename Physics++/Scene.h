@@ -1,15 +1,19 @@
 #pragma once
 
 #include "Geometry3D.h"
+#include "LinearOctree.h"
+#include "AABBTree.h"
 #include <vector>
+#include <map>
 
 struct OctreeNode
 {
 	AABB bounds;
+	OctreeNode* parent;
 	OctreeNode* children;
 	std::vector<Model*> models;
 
-	inline OctreeNode() : children(0) { }
+	inline OctreeNode() : parent(0), children(0) { }
 	inline ~OctreeNode()
 	{
 		if (children != 0)
@@ -19,31 +23,164 @@ struct OctreeNode
 	}
 };
 
+struct SceneHit
+{
+	// Null on a miss
+	Model* model;
+	Vec3 point;
+	Vec3 normal;
+	float t;
+	int triangle;
+};
+
+struct SceneHierarchyNode
+{
+	// The parent the model was filed under, which may since have been
+	// written directly
+	Model* parent;
+	std::vector<Model*> children;
+	// False for links that are not in the scene themselves
+	bool inScene;
+
+	inline SceneHierarchyNode() : parent(0), inScene(false) { }
+};
+
+class OctreeVisited;
+
 class Scene
 {
 public:
-	inline Scene() : octree(0) { }
+	inline Scene() : octree(0), looseness(0.0f), transformsDirty(true), linearOctree(0),
+		linearOctreeDirty(false), aabbTree(0) { }
 	inline ~Scene()
 	{
 		if (octree != 0)
 		{
 			delete octree;
 		}
+		if (linearOctree != 0)
+		{
+			delete linearOctree;
+		}
+		if (aabbTree != 0)
+		{
+			delete aabbTree;
+		}
 	}
 
 	void AddModel(Model* model);
 	void RemoveModel(Model* model);
 	void UpdateModel(Model* model); 
+	void UpdateModels(Model** models, int count);
+	// Every scene model below model at any depth, parents before children
 	std::vector<Model*> FindChildren(const Model* model);
+	int FindChildren(const Model* model, std::vector<Model*>& outModels);
+	// Sets model->parent and updates the models below it. Returns false and
+	// changes nothing if parent is model or one of its descendants. Models
+	// whose parent is written directly need an UpdateModel.
+	bool SetParent(Model* model, Model* parent);
+	// Brings the world caches of every scene model and its ancestors up to
+	// date in one pass, a hierarchy level at a time with each level split
+	// over numThreads threads, 0 uses one per core. Models that moved are
+	// then updated in the accelerators. Models must not be read or written
+	// until the call returns.
+	void UpdateTransforms(int numThreads);
 	Model* Raycast(const Ray& ray);
 	std::vector<Model*> Query(const Sphere& sphere);
 	std::vector<Model*> Query(const AABB& aabb);
-	bool Accelerate(const Vec3& position, float size);
 	std::vector<Model*> Cull(const Frustum& frustum);
 
+	// Clear outModels and fill it, reusing its storage across calls
+	int Query(const Sphere& sphere, std::vector<Model*>& outModels);
+	int Query(const AABB& aabb, std::vector<Model*>& outModels);
+	int Cull(const Frustum& frustum, std::vector<Model*>& outModels);
+
+	// Call visit once for every model found, in no particular order, until it
+	// returns false. Return false if the query was stopped early.
+	bool Raycast(const Ray& ray, ModelRayVisitor visit, void* userData);
+	bool Query(const Sphere& sphere, ModelVisitor visit, void* userData);
+	bool Query(const AABB& aabb, ModelVisitor visit, void* userData);
+	bool Cull(const Frustum& frustum, ModelVisitor visit, void* userData);
+
+	// The k models nearest to point and no further than maxDistance, nearest
+	// first. Distances are to the models' world OBBs, or to their meshes if
+	// exact is set. Returns the number of models written.
+	int Nearest(const Point& point, int k, float maxDistance, bool exact,
+		Model** outModels, float* outDistances);
+	std::vector<Model*> Nearest(const Point& point, int k, float maxDistance);
+
+	// Trace rays on numThreads threads, 0 uses one per core. The scene and
+	// its models must not change until the call returns.
+	void RaycastBatch(const Ray* rays, int count, SceneHit* outHits, int numThreads);
+	// A ray is occluded by any hit closer than its max distance, or by any
+	// hit at all if maxDistances is null
+	void OcclusionBatch(const Ray* rays, const float* maxDistances, int count,
+		bool* outOccluded, int numThreads);
+
+	bool Accelerate(const Vec3& position, float size);
+	bool Accelerate(const Vec3& position, float size, float looseness);
+	bool AccelerateLinear(const Vec3& position, float size, float looseness);
+	bool AccelerateDynamic(float margin);
+
 protected:
 	std::vector<Model*> objects;
 	OctreeNode* octree;
+	// Greater than 1 when the octree is loose, see SplitLooseTree
+	float looseness;
+	// Nodes holding each model, one for loose octrees
+	std::map<Model*, std::vector<OctreeNode*> > owners;
+
+	void FindOwners(OctreeNode* node);
+
+	// Scene models and, as links, every ancestor that has scene models below
+	// it, each filed under its parent
+	std::map<const Model*, SceneHierarchyNode> hierarchy;
+
+	void File(Model* model);
+	void Unfile(Model* model);
+	void Refile(Model* model);
+	void Prune(Model* model);
+
+	// The hierarchy flattened in level order, parents before children.
+	// Rebuilt from the index before the next UpdateTransforms after any
+	// change to it.
+	std::vector<Model*> transformModels;
+	// Index of the parent's entry, -1 for roots
+	std::vector<int> transformParents;
+	std::vector<Mat4> transformWorlds;
+	// First entry of every level, and the number of entries
+	std::vector<int> transformLevels;
+	std::vector<char> transformInScene;
+	std::vector<char> transformChanged;
+	bool transformsDirty;
+	// Inputs of the stale models of a level in structure of arrays form.
+	// A worker's slots start at the first entry of its range and
+	// transformWork maps them back to entries.
+	std::vector<int> transformWork;
+	std::vector<float> transformPositions[3];
+	std::vector<float> transformRotations[3];
+
+	void FlattenHierarchy();
+	// World matrices of the gathered slots [first, last)
+	void ComputeWorlds(int first, int last);
+
+	// Rebuilt from objects before the next query after any change
+	LinearOctree* linearOctree;
+	Vec3 linearOctreeCenter;
+	float linearOctreeSize;
+	bool linearOctreeDirty;
+
+	void RefreshLinearOctree();
+
+	// Unbounded alternative to the octrees, updated as models move
+	AABBTree* aabbTree;
+	std::map<Model*, int> proxies;
+
+	// Brings every cache up to date so the queries below only read
+	void PrepareConcurrentQueries();
+	// Also reports the hit's distance and mesh triangle
+	Model* ClosestHit(const Ray& ray, OctreeVisited& visited, float* outT, int* outTriangle) const;
+	bool AnyHit(const Ray& ray, float maxT, OctreeVisited& visited) const;
 
 private:
 	Scene(const Scene&);
@@ -51,10 +188,19 @@ private:
 };
 
 void SplitTree(OctreeNode* node, int depth);
+void SplitLooseTree(OctreeNode* node, int depth, float looseness);
 void Insert(OctreeNode* node, Model* model);
+void Insert(OctreeNode* node, Model* model, std::vector<OctreeNode*>* outOwners);
+OctreeNode* InsertLoose(OctreeNode* node, Model* model, int depth, float looseness);
 void Remove(OctreeNode* node, Model* model);
 void Update(OctreeNode* node, Model* model);
 Model* FindClosest(const std::vector<Model*>& set, const Ray& ray);
 Model* Raycast(OctreeNode* node, const Ray& ray);
 std::vector<Model*> Query(OctreeNode* node, const Sphere& sphere);
-std::vector<Model*> Query(OctreeNode* node, const AABB& aabb);
\ No newline at end of file
+std::vector<Model*> Query(OctreeNode* node, const AABB& aabb);
+bool Raycast(OctreeNode* node, const Ray& ray, ModelRayVisitor visit, void* userData);
+bool Query(OctreeNode* node, const Sphere& sphere, ModelVisitor visit, void* userData);
+bool Query(OctreeNode* node, const AABB& aabb, ModelVisitor visit, void* userData);
+bool Cull(OctreeNode* node, const Frustum& frustum, ModelVisitor visit, void* userData);
+int Nearest(OctreeNode* node, const Point& point, int k, float maxDistance, bool exact,
+	Model** outModels, float* outDistances);
\ No newline at end of file
@@ -0,0 +1,189 @@
+// Builds the mesh accelerators for an OBJ file and prints their quality
+// statistics. Exits with 1 if any builder produced an invalid tree.
+//
+// Usage: BVHReport mesh.obj [octree|lazy|lbvh|sbvh ...]
+
+#include "../Physics++/Geometry3D.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Reads vertex positions and faces, fans polygons into triangles
+static bool LoadOBJ(const char* path, Mesh& outMesh)
+{
+	FILE* file = fopen(path, "r");
+	if (file == 0)
+	{
+		return false;
+	}
+
+	std::vector<Vec3> positions;
+	std::vector<Triangle> triangles;
+	char line[1024];
+
+	while (fgets(line, sizeof(line), file) != 0)
+	{
+		if (line[0] == 'v' && line[1] == ' ')
+		{
+			Vec3 p;
+			if (sscanf(line + 2, "%f %f %f", &p.x, &p.y, &p.z) == 3)
+			{
+				positions.push_back(p);
+			}
+			continue;
+		}
+
+		if (line[0] != 'f' || line[1] != ' ')
+		{
+			continue;
+		}
+
+		std::vector<int> face;
+		char* token = strtok(line + 2, " \t\r\n");
+
+		while (token != 0)
+		{
+			int index = atoi(token);
+			index = index < 0 ? (int)positions.size() + index : index - 1;
+
+			if (index >= 0 && index < (int)positions.size())
+			{
+				face.push_back(index);
+			}
+			token = strtok(0, " \t\r\n");
+		}
+
+		for (int i = 2; i < (int)face.size(); ++i)
+		{
+			triangles.push_back(Triangle(positions[face[0]], positions[face[i - 1]], positions[face[i]]));
+		}
+	}
+
+	fclose(file);
+
+	if (triangles.empty())
+	{
+		return false;
+	}
+
+	outMesh.numTriangles = triangles.size();
+	outMesh.triangles = new Triangle[triangles.size()];
+
+	for (int i = 0; i < outMesh.numTriangles; ++i)
+	{
+		outMesh.triangles[i] = triangles[i];
+	}
+
+	return true;
+}
+
+static bool Build(Mesh& mesh, const std::string& builder)
+{
+	if (builder == "octree")
+	{
+		AccelarateMesh(mesh);
+	}
+	else if (builder == "lazy")
+	{
+		AccelarateMeshLazy(mesh, 1);
+	}
+	else if (builder == "lbvh")
+	{
+		AccelarateMeshLBVH(mesh, 30, 4, true);
+	}
+	else if (builder == "sbvh")
+	{
+		AccelarateMeshSBVH(mesh, 0.3f);
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+static void PrintStats(const std::string& builder, const BVHStats& stats, double milliseconds)
+{
+	printf("%s\n", builder.c_str());
+	printf("  build time        %.2f ms\n", milliseconds);
+	printf("  nodes             %d (%d leaves, %d empty, %d pending)\n",
+		stats.numNodes, stats.numLeaves, stats.numEmptyNodes, stats.numPendingNodes);
+	printf("  depth             max %d, average leaf %.2f\n", stats.maxDepth, stats.averageLeafDepth);
+	printf("  leaf triangles    min %d, max %d, average %.2f\n",
+		stats.minLeafTriangles, stats.maxLeafTriangles, stats.averageLeafTriangles);
+	printf("  references        %d (%d duplicates)\n", stats.numReferences, stats.numDuplicateReferences);
+	printf("  SAH cost          %f\n", stats.sahCost);
+
+	if (stats.valid)
+	{
+		printf("  valid\n");
+		return;
+	}
+
+	printf("  INVALID: %d missing triangles, %d invalid references, "
+		"%d children outside parent, %d triangles outside leaf\n",
+		stats.numMissingTriangles, stats.numInvalidReferences,
+		stats.numUncontainedChildren, stats.numDisjointTriangles);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		printf("Usage: %s mesh.obj [octree|lazy|lbvh|sbvh ...]\n", argv[0]);
+		return 2;
+	}
+
+	Mesh source;
+	if (!LoadOBJ(argv[1], source))
+	{
+		printf("Could not load %s\n", argv[1]);
+		return 2;
+	}
+
+	printf("%s: %d triangles\n", argv[1], source.numTriangles);
+
+	std::vector<std::string> builders;
+	for (int i = 2; i < argc; ++i)
+	{
+		builders.push_back(argv[i]);
+	}
+	if (builders.empty())
+	{
+		builders.push_back("octree");
+		builders.push_back("lazy");
+		builders.push_back("lbvh");
+		builders.push_back("sbvh");
+	}
+
+	bool valid = true;
+
+	for (int i = 0; i < (int)builders.size(); ++i)
+	{
+		Mesh mesh;
+		mesh.numTriangles = source.numTriangles;
+		mesh.triangles = source.triangles;
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (!Build(mesh, builders[i]))
+		{
+			printf("Unknown builder %s\n", builders[i].c_str());
+			return 2;
+		}
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+		BVHStats stats = ComputeStats(mesh);
+		PrintStats(builders[i], stats, elapsed.count());
+		valid = valid && stats.valid;
+
+		FreeBVHNode(mesh.accelerator);
+		delete mesh.accelerator;
+	}
+
+	delete[] source.triangles;
+	return valid ? 0 : 1;
+}
@@ -0,0 +1,804 @@
+// Compares accelerated queries against brute force on random data, see the
+// Check functions below. Exits with 1 if any query disagreed.
+//
+// Usage: QueryCheck [seed]
+
+#include "../Physics++/Geometry3D.h"
+#include "../Physics++/Scene.h"
+#include "../Physics++/Broadphase.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <iterator>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+typedef std::set<std::pair<int, int> > PairSet;
+
+static int numFailures = 0;
+
+static void Fail(const std::string& check, const char* what)
+{
+	if (numFailures++ < 20)
+	{
+		printf("  FAILED %s: %s\n", check.c_str(), what);
+	}
+}
+
+static float Random(float min, float max)
+{
+	return min + (max - min) * (rand() / (float)RAND_MAX);
+}
+
+static Vec3 RandomVec3(float extent)
+{
+	return Vec3(Random(-extent, extent), Random(-extent, extent), Random(-extent, extent));
+}
+
+static bool SameT(float t1, float t2)
+{
+	if (t1 < 0 || t2 < 0)
+	{
+		return t1 < 0 && t2 < 0;
+	}
+
+	return fabsf(t1 - t2) <= 1e-3f * (1.0f + fabsf(t1));
+}
+
+// Every third ray runs along an axis, the case where the inverse direction
+// has infinite components
+static Ray RandomRay(float extent, int index)
+{
+	Vec3 origin = RandomVec3(extent);
+
+	if (index % 3 != 0)
+	{
+		return Ray(origin, RandomVec3(1.0f));
+	}
+
+	Vec3 direction;
+	direction.asArray[(index / 3) % 3] = (index / 9) % 2 == 0 ? 1.0f : -1.0f;
+	return Ray(origin, direction);
+}
+
+// Half the triangles lie in an axis plane, so their bounds are flat
+static Mesh MakeMesh(int numTriangles, float extent, float triangleSize)
+{
+	Mesh mesh;
+	mesh.numTriangles = numTriangles;
+	mesh.triangles = new Triangle[numTriangles];
+
+	for (int i = 0; i < numTriangles; ++i)
+	{
+		Vec3 center = RandomVec3(extent);
+		Vec3 a = center + RandomVec3(triangleSize);
+		Vec3 b = center + RandomVec3(triangleSize);
+		Vec3 c = center + RandomVec3(triangleSize);
+
+		if (i % 2 == 0)
+		{
+			a.z = b.z = c.z = center.z;
+		}
+
+		mesh.triangles[i] = Triangle(a, b, c);
+	}
+
+	return mesh;
+}
+
+static PairSet BrutePairs(const std::vector<AABB>& bounds, const std::vector<bool>& alive)
+{
+	PairSet pairs;
+
+	for (int i = 0; i < (int)bounds.size(); ++i)
+	{
+		for (int j = i + 1; alive[i] && j < (int)bounds.size(); ++j)
+		{
+			if (alive[j] && AABBAABB(bounds[i], bounds[j]))
+			{
+				pairs.insert(std::make_pair(i, j));
+			}
+		}
+	}
+
+	return pairs;
+}
+
+static PairSet ToSet(const std::vector<BroadphasePair>& pairs)
+{
+	PairSet result;
+
+	for (int i = 0; i < (int)pairs.size(); ++i)
+	{
+		result.insert(std::make_pair(pairs[i].proxy1, pairs[i].proxy2));
+	}
+
+	return result;
+}
+
+static PairSet Difference(const PairSet& a, const PairSet& b)
+{
+	PairSet result;
+	std::set_difference(a.begin(), a.end(), b.begin(), b.end(),
+		std::inserter(result, result.begin()));
+	return result;
+}
+
+// Moves, destroys and creates proxies for a number of frames and checks the
+// pairs and the added and removed events of every Update, and the sphere
+// queries of a grid
+static void CheckBroadphase(Broadphase& broadphase, HashGrid* grid, const std::string& name)
+{
+	printf("%s\n", name.c_str());
+
+	std::vector<AABB> bounds;
+	std::vector<bool> alive;
+	PairSet previous;
+
+	for (int frame = 0; frame < 30; ++frame)
+	{
+		for (int i = 0; i < (int)bounds.size(); ++i)
+		{
+			if (!alive[i])
+			{
+				continue;
+			}
+
+			if (rand() % 50 == 0)
+			{
+				broadphase.DestroyProxy(i);
+				alive[i] = false;
+				continue;
+			}
+
+			bounds[i].position = bounds[i].position + RandomVec3(0.3f);
+			broadphase.MoveProxy(i, bounds[i]);
+		}
+
+		for (int i = 0, count = frame == 0 ? 1000 : 20; i < count; ++i)
+		{
+			AABB box(RandomVec3(30.0f), Vec3(Random(0.2f, 1.0f), Random(0.2f, 1.0f), Random(0.2f, 1.0f)));
+			int proxy = broadphase.CreateProxy(box, 0);
+
+			if (proxy >= (int)bounds.size())
+			{
+				bounds.resize(proxy + 1);
+				alive.resize(proxy + 1, false);
+			}
+			if (alive[proxy])
+			{
+				Fail(name, "created proxy reuses a live one");
+			}
+			bounds[proxy] = box;
+			alive[proxy] = true;
+		}
+
+		broadphase.Update();
+
+		PairSet expected = BrutePairs(bounds, alive);
+		PairSet pairs = ToSet(broadphase.GetPairs());
+		if (pairs.size() != broadphase.GetPairs().size())
+		{
+			Fail(name, "duplicate pairs");
+		}
+		if (pairs != expected)
+		{
+			Fail(name, "pairs differ from brute force");
+		}
+		if (ToSet(broadphase.GetAddedPairs()) != Difference(expected, previous))
+		{
+			Fail(name, "added pairs differ from brute force");
+		}
+		if (ToSet(broadphase.GetRemovedPairs()) != Difference(previous, expected))
+		{
+			Fail(name, "removed pairs differ from brute force");
+		}
+		previous = expected;
+
+		for (int i = 0; grid != 0 && i < 20; ++i)
+		{
+			Sphere sphere(RandomVec3(30.0f), Random(0.5f, 4.0f));
+			std::vector<int> found;
+			grid->Query(sphere, found);
+
+			std::vector<int> reference;
+			for (int j = 0; j < (int)bounds.size(); ++j)
+			{
+				if (alive[j] && SphereAABB(sphere, bounds[j]))
+				{
+					reference.push_back(j);
+				}
+			}
+
+			std::sort(found.begin(), found.end());
+			if (found != reference)
+			{
+				Fail(name, "sphere query differs from brute force");
+			}
+		}
+	}
+}
+
+static float BruteMeshRay(const Mesh& mesh, const Ray& ray)
+{
+	float closest = -1;
+
+	for (int i = 0; i < mesh.numTriangles; ++i)
+	{
+		RaycastResult result;
+		if (Raycast(mesh.triangles[i], ray, &result) && (closest < 0 || result.t < closest))
+		{
+			closest = result.t;
+		}
+	}
+
+	return closest;
+}
+
+static void CheckMeshRays(const Mesh& mesh, const std::string& name)
+{
+	std::vector<Ray> rays;
+	for (int i = 0; i < 300; ++i)
+	{
+		rays.push_back(RandomRay(12.0f, i));
+	}
+
+	std::vector<RaycastResult> batch(rays.size());
+	MeshRayBatch(mesh, &rays[0], rays.size(), &batch[0]);
+
+	for (int i = 0; i < (int)rays.size(); ++i)
+	{
+		float expected = BruteMeshRay(mesh, rays[i]);
+		if (!SameT(MeshRay(mesh, rays[i]), expected))
+		{
+			Fail(name, "MeshRay differs from brute force");
+		}
+		if (!SameT(batch[i].hit ? batch[i].t : -1, expected))
+		{
+			Fail(name, "MeshRayBatch differs from brute force");
+		}
+	}
+}
+
+// Collecting with room for every triangle must find exactly the overlapping
+// ones, with too little room it must fill the buffer with distinct ones. The
+// overlap test must agree with both.
+template <typename Test>
+static void CheckCollect(const Mesh& mesh, const Test& test, const std::string& name)
+{
+	std::vector<int> reference;
+	for (int i = 0; i < mesh.numTriangles; ++i)
+	{
+		if (test(mesh.triangles[i]))
+		{
+			reference.push_back(i);
+		}
+	}
+
+	if (test(mesh) != !reference.empty())
+	{
+		Fail(name, "overlap test differs from brute force");
+	}
+
+	std::vector<int> found(mesh.numTriangles);
+	found.resize(test(mesh, &found[0], mesh.numTriangles));
+	std::sort(found.begin(), found.end());
+	if (found != reference)
+	{
+		Fail(name, "collected triangles differ from brute force");
+	}
+
+	if (reference.size() < 2)
+	{
+		return;
+	}
+
+	int room = reference.size() / 2;
+	std::vector<int> partial(room);
+	partial.resize(test(mesh, &partial[0], room));
+	std::sort(partial.begin(), partial.end());
+	if ((int)partial.size() != room ||
+		std::unique(partial.begin(), partial.end()) != partial.end() ||
+		!std::includes(reference.begin(), reference.end(), partial.begin(), partial.end()))
+	{
+		Fail(name, "truncated collect is not a subset of brute force");
+	}
+}
+
+struct SphereTest
+{
+	Sphere sphere;
+	bool operator()(const Triangle& triangle) const { return TriangleSphere(triangle, sphere); }
+	bool operator()(const Mesh& mesh) const { return MeshSphere(mesh, sphere); }
+	int operator()(const Mesh& mesh, int* out, int max) const { return MeshSphere(mesh, sphere, out, max); }
+};
+
+struct AABBTest
+{
+	AABB aabb;
+	bool operator()(const Triangle& triangle) const { return TriangleAABB(triangle, aabb); }
+	bool operator()(const Mesh& mesh) const { return MeshAABB(mesh, aabb); }
+	int operator()(const Mesh& mesh, int* out, int max) const { return MeshAABB(mesh, aabb, out, max); }
+};
+
+struct OBBTest
+{
+	OBB obb;
+	bool operator()(const Triangle& triangle) const { return TriangleOBB(triangle, obb); }
+	bool operator()(const Mesh& mesh) const { return MeshOBB(mesh, obb); }
+	int operator()(const Mesh& mesh, int* out, int max) const { return MeshOBB(mesh, obb, out, max); }
+};
+
+static void CheckMeshCollect(const Mesh& mesh, const std::string& name)
+{
+	for (int i = 0; i < 100; ++i)
+	{
+		SphereTest sphere;
+		sphere.sphere = Sphere(RandomVec3(10.0f), Random(0.5f, 3.0f));
+		CheckCollect(mesh, sphere, name + " sphere");
+
+		AABBTest aabb;
+		aabb.aabb = AABB(RandomVec3(10.0f), Vec3(Random(0.2f, 3.0f), Random(0.2f, 3.0f), Random(0.2f, 3.0f)));
+		CheckCollect(mesh, aabb, name + " aabb");
+
+		OBBTest obb;
+		obb.obb = OBB(RandomVec3(10.0f), Vec3(Random(0.2f, 3.0f), Random(0.2f, 3.0f), Random(0.2f, 3.0f)),
+			Rotation3x3(Random(0, 90), Random(0, 90), Random(0, 90)));
+		CheckCollect(mesh, obb, name + " obb");
+	}
+}
+
+static bool operator<(const TrianglePair& left, const TrianglePair& right)
+{
+	if (left.triangle1 != right.triangle1)
+	{
+		return left.triangle1 < right.triangle1;
+	}
+
+	return left.triangle2 < right.triangle2;
+}
+
+static bool operator==(const TrianglePair& left, const TrianglePair& right)
+{
+	return left.triangle1 == right.triangle1 && left.triangle2 == right.triangle2;
+}
+
+// MeshMesh must report every brute-force triangle pair once, sorted, against
+// a mesh with and without a tree
+static void CheckMeshMesh(const Mesh& mesh, const Mesh& other, const Mesh& otherTree,
+	const std::string& name)
+{
+	for (int i = 0; i < 3; ++i)
+	{
+		Mat4 relative = Rotation(Random(0, 90), Random(0, 90), Random(0, 90)) *
+			Translation(RandomVec3(8.0f));
+
+		std::vector<TrianglePair> reference;
+		for (int j = 0; j < other.numTriangles; ++j)
+		{
+			const Triangle& source = other.triangles[j];
+			Triangle moved(MultiplyPoint(source.a, relative), MultiplyPoint(source.b, relative),
+				MultiplyPoint(source.c, relative));
+
+			for (int k = 0; k < mesh.numTriangles; ++k)
+			{
+				if (TriangleTriangle(mesh.triangles[k], moved))
+				{
+					TrianglePair pair;
+					pair.triangle1 = k;
+					pair.triangle2 = j;
+					reference.push_back(pair);
+				}
+			}
+		}
+		std::sort(reference.begin(), reference.end());
+
+		// Pairs already in the list are left alone, even ones that would
+		// sort after the new ones
+		std::vector<TrianglePair> pairs(1);
+		pairs[0].triangle1 = pairs[0].triangle2 = mesh.numTriangles;
+		std::vector<TrianglePair> treePairs = pairs;
+
+		bool any = MeshMesh(mesh, other, relative, &pairs);
+		MeshMesh(mesh, otherTree, relative, &treePairs);
+		pairs.erase(pairs.begin());
+		treePairs.erase(treePairs.begin());
+
+		if (pairs != reference || treePairs != reference)
+		{
+			Fail(name, "MeshMesh pairs differ from brute force");
+		}
+		if (any != !reference.empty() || MeshMesh(mesh, otherTree, relative) != !reference.empty())
+		{
+			Fail(name, "MeshMesh overlap differs from brute force");
+		}
+	}
+}
+
+static void Build(Mesh& mesh, const std::string& builder)
+{
+	if (builder == "octree")
+	{
+		AccelarateMesh(mesh);
+	}
+	else if (builder == "lazy")
+	{
+		AccelarateMeshLazy(mesh, 1);
+	}
+	else if (builder == "lbvh")
+	{
+		AccelarateMeshLBVH(mesh, 30, 4, true);
+	}
+	else
+	{
+		AccelarateMeshSBVH(mesh, 0.3f);
+	}
+}
+
+static void Release(Mesh& mesh)
+{
+	if (mesh.accelerator != 0)
+	{
+		FreeBVHNode(mesh.accelerator);
+		delete mesh.accelerator;
+		mesh.accelerator = 0;
+	}
+
+	if (mesh.wideAccelerator != 0)
+	{
+		FreeWideBVH(mesh.wideAccelerator);
+		delete mesh.wideAccelerator;
+		mesh.wideAccelerator = 0;
+	}
+
+	if (mesh.compressedAccelerator != 0)
+	{
+		FreeCompressedBVH(mesh.compressedAccelerator);
+		delete mesh.compressedAccelerator;
+		mesh.compressedAccelerator = 0;
+	}
+}
+
+static const char* builders[] = { "octree", "lazy", "lbvh", "sbvh" };
+
+// Every builder must produce a tree ComputeStats finds valid
+static void CheckBuilders(const Mesh& source)
+{
+	for (int i = 0; i < 4; ++i)
+	{
+		printf("%s\n", builders[i]);
+
+		Mesh mesh;
+		mesh.numTriangles = source.numTriangles;
+		mesh.triangles = source.triangles;
+		Build(mesh, builders[i]);
+
+		if (!ComputeStats(mesh).valid)
+		{
+			Fail(builders[i], "invalid tree");
+		}
+
+		Release(mesh);
+	}
+}
+
+static const char* forms[] = { "pointer", "wide4", "wide8", "compressed8", "compressed16" };
+static const int numForms = sizeof(forms) / sizeof(forms[0]);
+
+static bool Convert(Mesh& mesh, int form)
+{
+	if (form == 1 || form == 2)
+	{
+		return CollapseBVH(mesh, form == 1 ? 4 : 8);
+	}
+
+	if (form == 3 || form == 4)
+	{
+		return CompressBVH(mesh, form == 3 ? 8 : 16);
+	}
+
+	return true;
+}
+
+// Stats and cost must come from whichever tree the mesh holds. Refitting
+// unchanged triangles must not make the cost worse than the build left it,
+// except for SBVH leaves that grow back over their clipped triangles. Lazy
+// trees get better as the queries split their pending nodes.
+static void CheckMeshStats(Mesh& mesh, const std::string& name)
+{
+	BVHStats stats = ComputeStats(mesh);
+	if (!stats.valid || stats.numLeaves == 0 || stats.sahCost <= 0.0f)
+	{
+		Fail(name, "stats");
+	}
+
+	float ratio = RefitMesh(mesh);
+	if (ratio <= 0.0f || (ratio > 1.001f && name.compare(0, 4, "sbvh") != 0))
+	{
+		Fail(name, "refit cost");
+	}
+}
+
+// Every form of every builder's tree must answer like brute force
+static void CheckMeshForms(const Mesh& source)
+{
+	Mesh other = MakeMesh(100, 5.0f, 1.5f);
+	Mesh otherTree = other;
+	AccelarateMesh(otherTree);
+
+	for (int i = 0; i < 4; ++i)
+	{
+		for (int j = 0; j < numForms; ++j)
+		{
+			std::string name = std::string(builders[i]) + " " + forms[j];
+			printf("%s\n", name.c_str());
+
+			Mesh mesh;
+			mesh.numTriangles = source.numTriangles;
+			mesh.triangles = source.triangles;
+			Build(mesh, builders[i]);
+
+			if (!Convert(mesh, j))
+			{
+				Fail(name, "could not build");
+			}
+			else
+			{
+				CheckMeshRays(mesh, name);
+				CheckMeshCollect(mesh, name);
+				CheckMeshMesh(mesh, other, otherTree, name);
+				CheckMeshStats(mesh, name);
+			}
+
+			Release(mesh);
+		}
+	}
+
+	Release(otherTree);
+	delete[] other.triangles;
+}
+
+static float BruteSceneRay(const std::vector<Model>& models, const Ray& ray)
+{
+	float closest = -1;
+
+	for (int i = 0; i < (int)models.size(); ++i)
+	{
+		float t = ModelRay(models[i], ray);
+		if (t >= 0 && (closest < 0 || t < closest))
+		{
+			closest = t;
+		}
+	}
+
+	return closest;
+}
+
+static void CheckSceneRays(Scene& scene, const std::vector<Model>& models, const std::string& name)
+{
+	std::vector<Ray> rays;
+	for (int i = 0; i < 600; ++i)
+	{
+		rays.push_back(RandomRay(45.0f, i));
+	}
+
+	std::vector<SceneHit> hits(rays.size());
+	scene.RaycastBatch(&rays[0], rays.size(), &hits[0], 2);
+
+	for (int i = 0; i < (int)rays.size(); ++i)
+	{
+		float expected = BruteSceneRay(models, rays[i]);
+		Model* hit = scene.Raycast(rays[i]);
+		if (!SameT(hit != 0 ? ModelRay(*hit, rays[i]) : -1, expected))
+		{
+			Fail(name, "Raycast differs from brute force");
+		}
+		if (!SameT(hits[i].model != 0 ? hits[i].t : -1, expected))
+		{
+			Fail(name, "RaycastBatch differs from brute force");
+		}
+	}
+}
+
+// The scene's distances are to the world OBBs
+static std::vector<float> BruteNearest(const std::vector<Model>& models, const Point& point,
+	int k, float maxDistance)
+{
+	std::vector<float> distances;
+
+	for (int i = 0; i < (int)models.size(); ++i)
+	{
+		float distance = Magnitude(ClosestPoint(GetOBB(models[i]), point) - point);
+		if (distance <= maxDistance)
+		{
+			distances.push_back(distance);
+		}
+	}
+
+	std::sort(distances.begin(), distances.end());
+	if ((int)distances.size() > k)
+	{
+		distances.resize(k);
+	}
+
+	return distances;
+}
+
+static bool SameDistance(float d1, float d2)
+{
+	return fabsf(d1 - d2) <= 1e-3f * (1.0f + d1);
+}
+
+// Models at the same distance may come in any order, so only the distances
+// are compared, and each model must really be at its reported distance
+static void CheckSceneNearest(Scene& scene, const std::vector<Model>& models, const std::string& name)
+{
+	for (int i = 0; i < 200; ++i)
+	{
+		Point point = RandomVec3(50.0f);
+		int k = 1 + i % 8;
+		float maxDistance = i % 2 == 0 ? 1e30f : Random(2.0f, 20.0f);
+
+		Model* found[8];
+		float distances[8];
+		int count = scene.Nearest(point, k, maxDistance, false, found, distances);
+
+		std::vector<float> expected = BruteNearest(models, point, k, maxDistance);
+		bool same = count == (int)expected.size();
+		for (int j = 0; same && j < count; ++j)
+		{
+			float actual = Magnitude(ClosestPoint(GetOBB(*found[j]), point) - point);
+			same = SameDistance(distances[j], expected[j]) && SameDistance(actual, distances[j]);
+		}
+		if (!same)
+		{
+			Fail(name, "Nearest differs from brute force");
+		}
+	}
+}
+
+struct OctreeScene : Scene
+{
+	const OctreeNode* Root() const { return octree; }
+};
+
+static void FindModelDepths(const OctreeNode* node, int depth, int& maxDepth,
+	std::vector<int>& outDepths)
+{
+	maxDepth = depth > maxDepth ? depth : maxDepth;
+
+	for (int i = 0, size = node->models.size(); i < size; ++i)
+	{
+		outDepths.push_back(depth);
+	}
+
+	for (int i = 0; node->children != 0 && i < 8; ++i)
+	{
+		FindModelDepths(&node->children[i], depth + 1, maxDepth, outDepths);
+	}
+}
+
+// Models much smaller than the smallest cell, spread over the whole root,
+// all fit in a loose leaf
+static void CheckLooseOctree(Mesh& mesh)
+{
+	printf("loose octree leaves\n");
+
+	std::vector<Model> models(1000);
+	OctreeScene scene;
+	for (int i = 0; i < (int)models.size(); ++i)
+	{
+		models[i].SetContent(&mesh);
+		models[i].position = RandomVec3(63.0f);
+		scene.AddModel(&models[i]);
+	}
+	scene.Accelerate(Vec3(), 64.0f, 2.0f);
+
+	int maxDepth = 0;
+	std::vector<int> depths;
+	FindModelDepths(scene.Root(), 0, maxDepth, depths);
+
+	if ((int)depths.size() != (int)models.size())
+	{
+		Fail("loose octree", "models missing from the tree");
+	}
+	if (std::count(depths.begin(), depths.end(), maxDepth) != (int)depths.size())
+	{
+		Fail("loose octree", "small models stayed above the leaves");
+	}
+}
+
+// Every scene accelerator must answer like brute force. The models stay
+// well inside the octree roots.
+static void CheckScenes(Mesh* meshes, int numMeshes)
+{
+	std::vector<Model> models(500);
+	for (int i = 0; i < (int)models.size(); ++i)
+	{
+		models[i].SetContent(&meshes[i % numMeshes]);
+		models[i].position = RandomVec3(40.0f);
+		models[i].rotation = Vec3(Random(0, 90), Random(0, 90), Random(0, 90));
+	}
+
+	const char* names[] = { "scene brute force", "scene octree", "scene loose octree",
+		"scene linear octree", "scene dynamic tree" };
+
+	for (int i = 0; i < 5; ++i)
+	{
+		printf("%s\n", names[i]);
+
+		Scene scene;
+		for (int j = 0; j < (int)models.size(); ++j)
+		{
+			scene.AddModel(&models[j]);
+		}
+
+		if (i == 1)
+		{
+			scene.Accelerate(Vec3(), 64.0f);
+		}
+		else if (i == 2)
+		{
+			scene.Accelerate(Vec3(), 64.0f, 2.0f);
+		}
+		else if (i == 3)
+		{
+			scene.AccelerateLinear(Vec3(), 64.0f, 2.0f);
+		}
+		else if (i == 4)
+		{
+			scene.AccelerateDynamic(0.5f);
+		}
+
+		CheckSceneRays(scene, models, names[i]);
+		CheckSceneNearest(scene, models, names[i]);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	unsigned int seed = argc > 1 ? (unsigned int)atoi(argv[1]) : 1;
+	srand(seed);
+	printf("seed %u\n", seed);
+
+	SweepAndPrune sweep;
+	CheckBroadphase(sweep, 0, "sort and sweep");
+
+	HashGrid grid(2.0f);
+	CheckBroadphase(grid, &grid, "hash grid");
+
+	Mesh source = MakeMesh(3000, 10.0f, 1.0f);
+	CheckBuilders(source);
+	CheckMeshForms(source);
+	delete[] source.triangles;
+
+	Mesh meshes[3];
+	for (int i = 0; i < 3; ++i)
+	{
+		meshes[i] = MakeMesh(60, 1.0f + i, 0.4f);
+		AccelarateMesh(meshes[i]);
+	}
+	CheckScenes(meshes, 3);
+
+	Mesh small = MakeMesh(20, 0.3f, 0.2f);
+	CheckLooseOctree(small);
+	delete[] small.triangles;
+
+	for (int i = 0; i < 3; ++i)
+	{
+		Release(meshes[i]);
+		delete[] meshes[i].triangles;
+	}
+
+	if (numFailures > 0)
+	{
+		printf("%d checks FAILED\n", numFailures);
+		return 1;
+	}
+
+	printf("all checks passed\n");
+	return 0;
+}